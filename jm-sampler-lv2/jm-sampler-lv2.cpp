@@ -52,17 +52,38 @@ enum {
   SAMPLER_NOTIFY  = 3,
   SAMPLER_OUT_L = 4,
   SAMPLER_OUT_R = 5
+  // further buses follow as left/right pairs up to 2 * LV2_OUTPUTS audio ports
 };
 
 enum worker_msg_type {
   WORKER_LOAD_PATCH,
+  WORKER_COLLECT,
+  // zone edits from the ui
+  WORKER_ADD_ZONE,
+  WORKER_DUP_ZONE,
+  WORKER_REMOVE_ZONE,
+  WORKER_UPDATE_ZONE,
+  WORKER_RELOAD_WAVES
 };
 
 struct worker_msg {
   worker_msg_type type;
-  int i;
+  int part;
+  int index;
+  int key;
+  // own copy so a newer request can't change it mid load; the wave path or
+  // field value for zone edits
+  char path[MAX_PATH];
 };
 
+// block lengths are atom:Int; anything else is left unread
+static bool get_int_option(const jm::uris& uris, const LV2_Options_Option& opt, int* val) {
+  if (opt.type != uris.atom_Int || opt.size != sizeof(int32_t) || opt.value == NULL)
+    return false;
+  *val = *((const int32_t*) opt.value);
+  return true;
+}
+
 static LV2_Handle instantiate(const LV2_Descriptor*, double sample_rate, const char*,
     const LV2_Feature* const* features) {
 
@@ -105,11 +126,12 @@ static LV2_Handle instantiate(const LV2_Descriptor*, double sample_rate, const c
       break;
 
     if (opt[index].key == uris.bufsize_maxBlockLength) {
-      max_block_len = *((int*) opt[index].value);
+      if (!get_int_option(uris, opt[index], &max_block_len))
+        fprintf(stderr, "SAMPLER: bufsz:maxBlockLength is not an int\n");
       //fprintf(stderr, "SAMPLER max block len: %i\n", max_block_len);
     }
     else if (opt[index].key == uris.bufsize_nominalBlockLength) {
-      nominal_block_len = *((int*) opt[index].value);
+      get_int_option(uris, opt[index], &nominal_block_len);
       //fprintf(stderr, "SAMPLER nominal block len: %i\n", nominal_block_len);
     }
     ++index;    
@@ -148,91 +170,117 @@ static void connect_port(LV2_Handle instance, uint32_t port, void* data) {
     case SAMPLER_CONTROL:
       sampler->control_port = static_cast<const LV2_Atom_Sequence*>(data);
       break;
+    // ports drive the first part; the others are set from the ui
     case SAMPLER_VOLUME:
-      sampler->volume = (float*) data;
+      sampler->parts[0].volume = (float*) data;
       break;
     case SAMPLER_CHANNEL:
-      sampler->channel = (float*) data;
+      sampler->parts[0].channel = (float*) data;
       break;
     case SAMPLER_NOTIFY:
       sampler->notify_port = static_cast<LV2_Atom_Sequence*>(data);
       break;
-    case SAMPLER_OUT_L:
-      sampler->out1 = (float*) data;
-      break;
-    case SAMPLER_OUT_R:
-      sampler->out2 = (float*) data;
-      break;
     default:
+      if (port >= SAMPLER_OUT_L && port < SAMPLER_OUT_L + 2 * LV2_OUTPUTS)
+        sampler->outs[port - SAMPLER_OUT_L] = (float*) data;
       break;
   }
 }
 
-static LV2_Worker_Status work(LV2_Handle instance, LV2_Worker_Respond_Function respond,
-    LV2_Worker_Respond_Handle handle, uint32_t, const void* data) {
+static LV2_Worker_Status work(LV2_Handle instance, LV2_Worker_Respond_Function,
+    LV2_Worker_Respond_Handle, uint32_t, const void* data) {
   LV2Sampler* sampler = static_cast<LV2Sampler*>(instance);
 
   const worker_msg* msg = static_cast<const worker_msg*>(data);
   if (msg->type == WORKER_LOAD_PATCH) {
-    //fprintf(stderr, "SAMPLER: work loading patch: %s\n", sampler->patch_path);
-    sampler->load_patch(sampler->patch_path);
-
-    respond(handle, sizeof(worker_msg), msg); 
-  }
-
-  return LV2_WORKER_SUCCESS;
-}
-
-static LV2_Worker_Status work_response(LV2_Handle instance, uint32_t, const void* data) {
-  LV2Sampler* sampler = static_cast<LV2Sampler*>(instance);
-  const worker_msg* msg = static_cast<const worker_msg*>(data);
-
-  if (msg->type == WORKER_LOAD_PATCH) {
-    //fprintf(stderr, "SAMPLER load patch response!! num regions: %i\n", (int) sampler->patch.regions.size());
-
-    if (sampler->fout) {
-       fprintf(sampler->fout, "clear_zones\n");
-       fflush(sampler->fout);
+    //fprintf(stderr, "SAMPLER: work loading patch: %s\n", msg->path);
+    // zones are published to the engine and ui as the load goes; nothing to respond with
+    try {
+      sampler->load_patch(msg->part, msg->path);
     }
-
-    std::map<std::string, SFZValue>::iterator c_it =sampler->patch.control.find("jm_vol");
-    if (c_it != sampler->patch.control.end()) {
-      //sampler->send_update_vol(c_it->second.get_double());
-      //sampler->send_update_chan(sampler->patch.control["jm_chan"].get_int() - 1);
-      *sampler->volume = c_it->second.get_double();
-      *sampler->channel =  sampler->patch.control["jm_chan"].get_int() - 1;
+    catch (std::runtime_error& e) {
+      fprintf(stderr, "SAMPLER: failed to load patch: %s\n", e.what());
     }
-    else {
-      //sampler->send_update_vol(0.f);
-      //sampler->send_update_chan(0);
-      *sampler->volume = 0;
-      *sampler->channel = 0;
+  }
+  // free patches and buffers the audio thread let go of, build larger ones
+  else if (msg->type == WORKER_COLLECT)
+    sampler->collect_garbage();
+  // waves are read here; the edited patch reaches the audio thread as a
+  // finished copy through the control queue
+  else {
+    try {
+      if (msg->type == WORKER_ADD_ZONE)
+        sampler->add_zone_from_wave(msg->part, msg->index, msg->path);
+      else if (msg->type == WORKER_DUP_ZONE)
+        sampler->duplicate_zone(msg->part, msg->index);
+      else if (msg->type == WORKER_REMOVE_ZONE)
+        sampler->remove_zone(msg->part, msg->index);
+      else if (msg->type == WORKER_UPDATE_ZONE)
+        sampler->update_zone(msg->part, msg->index, msg->key, msg->path);
+      else if (msg->type == WORKER_RELOAD_WAVES)
+        sampler->reload_waves(msg->part);
     }
-
-    if (sampler->fout) {
-        fprintf(sampler->fout, "update_vol:%f\n", *sampler->volume);
-        fflush(sampler->fout);
-
-        fprintf(sampler->fout, "update_chan:%i\n", (int) *sampler->channel);
-        fflush(sampler->fout);
-
-        int num_zones = sampler->zones.size();
-
-        for (int i = 0; i < num_zones; ++i)
-          sampler->send_add_zone(i);
+    catch (std::runtime_error& e) {
+      fprintf(stderr, "SAMPLER: zone edit failed: %s\n", e.what());
     }
   }
 
   return LV2_WORKER_SUCCESS;
 }
 
+static LV2_Worker_Status work_response(LV2_Handle, uint32_t, const void*) {
+  return LV2_WORKER_SUCCESS;
+}
+
+// hand a zone edit from the ui to the worker; edits run in the order sent
+static void schedule_zone_edit(LV2Sampler* sampler, const LV2_Atom_Object* obj) {
+  LV2_Atom* part = NULL;
+  LV2_Atom* index = NULL;
+  LV2_Atom* key = NULL;
+  LV2_Atom* val = NULL;
+
+  lv2_atom_object_get(obj, sampler->uris.jm_part, &part, sampler->uris.jm_index, &index,
+    sampler->uris.jm_key, &key, sampler->uris.jm_params, &val, 0);
+
+  worker_msg msg;
+  if (obj->body.otype == sampler->uris.jm_addZone)
+    msg.type = WORKER_ADD_ZONE;
+  else if (obj->body.otype == sampler->uris.jm_dupZone)
+    msg.type = WORKER_DUP_ZONE;
+  else if (obj->body.otype == sampler->uris.jm_removeZone)
+    msg.type = WORKER_REMOVE_ZONE;
+  else if (obj->body.otype == sampler->uris.jm_updateZone)
+    msg.type = WORKER_UPDATE_ZONE;
+  else
+    msg.type = WORKER_RELOAD_WAVES;
+
+  msg.part = part != NULL ? ((LV2_Atom_Int*) part)->body : 0;
+  if (msg.part < 0 || msg.part >= NUM_PARTS)
+    return;
+  msg.index = index != NULL ? ((LV2_Atom_Int*) index)->body : 0;
+  msg.key = key != NULL ? ((LV2_Atom_Int*) key)->body : 0;
+  msg.path[0] = '\0';
+  if (val != NULL) {
+    strncpy(msg.path, (const char*) (val + 1), MAX_PATH - 1);
+    msg.path[MAX_PATH - 1] = '\0';
+  }
+  sampler->schedule->schedule_work(sampler->schedule->handle, sizeof(worker_msg), &msg);
+}
+
 // later most of this opaque logic should be moved to member funs
 // consider everything in common w/ stand alone jack audio callback when we re-implement that version
 static void run(LV2_Handle instance, uint32_t n_samples) {
   LV2Sampler* sampler = static_cast<LV2Sampler*>(instance);
+  sampler->begin_cycle();
 
-  memset(sampler->out1, 0, sizeof(float) * n_samples);
-  memset(sampler->out2, 0, sizeof(float) * n_samples);
+  for (int i = 0; i < 2 * LV2_OUTPUTS; ++i) {
+    if (sampler->outs[i] != NULL) {
+      memset(sampler->outs[i], 0, sizeof(float) * n_samples);
+      sampler->mix_outs[i] = sampler->outs[i];
+    }
+    else
+      sampler->mix_outs[i] = sampler->outs[i % 2];
+  }
 
   // Set up forge to write directly to notify output port.
   const uint32_t notify_capacity = sampler->notify_port->atom.size;
@@ -243,6 +291,18 @@ static void run(LV2_Handle instance, uint32_t n_samples) {
   //lv2_atom_forge_sequence_head(&sampler->forge, &seq_frame, 0);
   lv2_atom_forge_sequence_head(&sampler->forge, &sampler->seq_frame, 0);
 
+  // loads restore left for us; the worker may run them inline, which is
+  // why restore itself doesn't
+  for (int i = 0; i < NUM_PARTS; ++i) {
+    if (sampler->restore_pending[i].exchange(false)) {
+      worker_msg msg;
+      msg.type = WORKER_LOAD_PATCH;
+      msg.part = i;
+      strcpy(msg.path, sampler->patch_path[i]);
+      sampler->schedule->schedule_work(sampler->schedule->handle, sizeof(worker_msg), &msg);
+    }
+  }
+
   // we used to handle ui messages here
   // but now they will be in the same atom list as midi
 
@@ -254,44 +314,80 @@ static void run(LV2_Handle instance, uint32_t n_samples) {
       if (obj->body.otype == sampler->uris.jm_loadPatch) {
         //fprintf(stderr, "SAMPLER: load patch received!!\n");
         LV2_Atom* params = NULL;
+        LV2_Atom* part = NULL;
+
+        lv2_atom_object_get(obj, sampler->uris.jm_params, &params, sampler->uris.jm_part, &part, 0);
+        if (params == NULL)
+          continue;
+        // unterminated, or too long to keep and save with the session
+        const char* path = (const char*)(params + 1);
+        size_t len = strnlen(path, params->size);
+        if (len == params->size || len >= MAX_PATH)
+          continue;
 
-        lv2_atom_object_get(obj, sampler->uris.jm_params, &params, 0);
-        char* path = (char*)(params + 1);
         worker_msg msg;
         msg.type =  WORKER_LOAD_PATCH;
-        strcpy(sampler->patch_path, path);
+        msg.part = part != NULL ? ((LV2_Atom_Int*) part)->body : 0;
+        if (msg.part < 0 || msg.part >= NUM_PARTS)
+          msg.part = 0;
+        memcpy(msg.path, path, len + 1);
+        memcpy(sampler->patch_path[msg.part], path, len + 1);
+        // drop whatever load is still going on the part; this one replaces it
+        sampler->parts[msg.part].cancel_load = true;
         sampler->schedule->schedule_work(sampler->schedule->handle, sizeof(worker_msg), &msg);
       }
+      else if (obj->body.otype == sampler->uris.jm_addZone
+          || obj->body.otype == sampler->uris.jm_dupZone
+          || obj->body.otype == sampler->uris.jm_removeZone
+          || obj->body.otype == sampler->uris.jm_updateZone
+          || obj->body.otype == sampler->uris.jm_reloadWaves)
+        schedule_zone_edit(sampler, obj);
     }
   }
 
-  sampler->pre_process(n_samples);
+  // run as blocks the voice buffers can hold; only more than one until
+  // buffers for a larger bufsz:maxBlockLength are swapped in
+  size_t block = sampler->block_frames();
+  uint32_t start = 0;
+  size_t len = 0;
 
   LV2_Atom_Event* ev = lv2_atom_sequence_begin(&sampler->control_port->body);
 
   // loop over frames in this callback window
   for (uint32_t n = 0; n < n_samples; ++n) {
+    if (n == start + len) {
+      for (int i = 0; i < 2 * LV2_OUTPUTS; ++i)
+        sampler->mix_outs[i] += len;
+      start = n;
+      len = n_samples - n < block ? n_samples - n: block;
+      sampler->pre_process(len);
+    }
+
     if (!lv2_atom_sequence_is_end(&sampler->control_port->body, sampler->control_port->atom.size, ev)) {
       // procces next event if it applies to current time (frame)
       while (n == ev->time.frames) {
         if (ev->body.type == sampler->uris.midi_Event) {
           const uint8_t* const msg = (const uint8_t*)(ev + 1);
-          // only consider events from current channel
-          if ((msg[0] & 0x0f) == (int) *sampler->channel) {
-            // process note on
-            if (lv2_midi_message_type(msg) == LV2_MIDI_MSG_NOTE_ON) {
-              sampler->handle_note_on(msg, n_samples, n);
-            }
-            // process note off
-            else if (lv2_midi_message_type(msg) == LV2_MIDI_MSG_NOTE_OFF)
-              sampler->handle_note_off(msg);
-            // process sustain pedal
-            else if (lv2_midi_message_type(msg) == LV2_MIDI_MSG_CONTROLLER && msg[1] == LV2_MIDI_CTL_SUSTAIN)
-              sampler->handle_sustain(msg);
-            // just print messages we don't currently handle
-            //else if (lv2_midi_message_type(msg) != LV2_MIDI_MSG_ACTIVE_SENSE)
-            //  fprintf(stderr, "event: 0x%x\n", msg[0]);
+          // parts pick out their own channels
+          // process note on
+          if (lv2_midi_message_type(msg) == LV2_MIDI_MSG_NOTE_ON) {
+            sampler->handle_note_on(msg, len, n - start);
           }
+          // process note off
+          else if (lv2_midi_message_type(msg) == LV2_MIDI_MSG_NOTE_OFF)
+            sampler->handle_note_off(msg, len, n - start);
+          // process sustain pedal
+          else if (lv2_midi_message_type(msg) == LV2_MIDI_MSG_CONTROLLER && msg[1] == LV2_MIDI_CTL_SUSTAIN)
+            sampler->handle_sustain(msg, len, n - start);
+          // volume, expression and pan
+          else if (lv2_midi_message_type(msg) == LV2_MIDI_MSG_CONTROLLER)
+            sampler->handle_control(msg);
+          // process pitch bend
+          else if (lv2_midi_message_type(msg) == LV2_MIDI_MSG_BENDER)
+            sampler->handle_pitch_bend(msg);
+          // just print messages we don't currently handle
+          //else if (lv2_midi_message_type(msg) != LV2_MIDI_MSG_ACTIVE_SENSE)
+          //  fprintf(stderr, "event: 0x%x\n", msg[0]);
         }
         // get next midi event or break if none left
         ev = lv2_atom_sequence_next(ev);
@@ -300,20 +396,50 @@ static void run(LV2_Handle instance, uint32_t n_samples) {
       }
     }
 
-    sampler->process_frame(n, sampler->out1, sampler->out2);
+    sampler->process_frame(n - start, sampler->mix_outs);
   }
 
+  if (sampler->take_retired()) {
+    worker_msg msg;
+    msg.type = WORKER_COLLECT;
+    sampler->schedule->schedule_work(sampler->schedule->handle, sizeof(worker_msg), &msg);
+  }
+
+  sampler->end_cycle(n_samples);
+
   //lv2_atom_forge_pop(&sampler->forge, &seq_frame);
   //lv2_atom_forge_pop(&sampler->forge, &sampler->seq_frame);
 }
 
+// first part keeps the original key so older sessions still restore
+static LV2_URID part_file_urid(LV2Sampler* sampler, int part) {
+  if (part == 0)
+    return sampler->uris.jm_patchFile;
+
+  char uri[256];
+  sprintf(uri, "%s%i", JM_SAMPLER__patchFile, part + 1);
+  return sampler->map->map(sampler->map->handle, uri);
+}
+
+// map_path hands back strings the host allocated; give them back the way it
+// asks, or with free() from hosts too old to say
+static void free_path(const LV2_Feature* const* features, char* path) {
+#ifdef LV2_STATE__freePath
+  for (int i = 0; features[i]; ++i) {
+    if (!strcmp(features[i]->URI, LV2_STATE__freePath)) {
+      LV2_State_Free_Path* free_path = static_cast<LV2_State_Free_Path*>(features[i]->data);
+      free_path->free_path(free_path->handle, path);
+      return;
+    }
+  }
+#endif
+  free(path);
+}
+
 static LV2_State_Status save(LV2_Handle instance, LV2_State_Store_Function store,
     LV2_State_Handle handle, uint32_t, const LV2_Feature* const* features) {
   LV2Sampler* sampler = static_cast<LV2Sampler*>(instance);
 
-  if (sampler->patch_path[0] == '\0')
-    return LV2_STATE_SUCCESS;
-
   LV2_State_Map_Path* map_path = NULL;
 
   for (int i = 0; features[i]; ++i) {
@@ -324,16 +450,24 @@ static LV2_State_Status save(LV2_Handle instance, LV2_State_Store_Function store
   if (map_path == NULL)
     return LV2_STATE_ERR_NO_FEATURE;
 
-  char* apath = map_path->abstract_path(map_path->handle, sampler->patch_path);
+  for (int i = 0; i < NUM_PARTS; ++i) {
+    if (sampler->patch_path[i][0] == '\0')
+      continue;
 
-  store(handle, sampler->uris.jm_patchFile, apath, strlen(apath) + 1,
-    sampler->uris.atom_String, LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+    char* apath = map_path->abstract_path(map_path->handle, sampler->patch_path[i]);
 
-  delete apath;
+    store(handle, part_file_urid(sampler, i), apath, strlen(apath) + 1,
+      sampler->uris.atom_String, LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+
+    free_path(features, apath);
+  }
 
   return LV2_STATE_SUCCESS;
 }
 
+// only records the paths; the next run hands them to the worker like any
+// other patch load, so restoring doesn't hold up the host and many
+// instances load side by side
 static LV2_State_Status restore(LV2_Handle instance, LV2_State_Retrieve_Function retrieve,
     LV2_State_Handle handle, uint32_t, const LV2_Feature* const* features) {
   LV2Sampler* sampler = static_cast<LV2Sampler*>(instance);
@@ -341,11 +475,7 @@ static LV2_State_Status restore(LV2_Handle instance, LV2_State_Retrieve_Function
   size_t   size;
   uint32_t type;
   uint32_t valflags;
-  const void* value = retrieve(handle, sampler->uris.jm_patchFile, &size, &type, &valflags);
 
-  if (value == NULL)
-    return LV2_STATE_SUCCESS;
-    
   LV2_State_Map_Path* map_path = NULL;
 
   for (int i = 0; features[i]; ++i) {
@@ -356,24 +486,65 @@ static LV2_State_Status restore(LV2_Handle instance, LV2_State_Retrieve_Function
   if (map_path == NULL)
     return LV2_STATE_ERR_NO_FEATURE;
 
-  const char* apath = static_cast<const char*>(value);
-  char* path = map_path->absolute_path(map_path->handle, apath);
+  for (int i = 0; i < NUM_PARTS; ++i) {
+    const void* value = retrieve(handle, part_file_urid(sampler, i), &size, &type, &valflags);
+
+    if (value == NULL)
+      continue;
+
+    const char* apath = static_cast<const char*>(value);
+    char* path = map_path->absolute_path(map_path->handle, apath);
 
-  strcpy(sampler->patch_path, path);
-  delete path;
+    if (strlen(path) >= sizeof(sampler->patch_path[i])) {
+      fprintf(stderr, "SAMPLER: patch path too long to restore: %s\n", path);
+      free_path(features, path);
+      continue;
+    }
+    strcpy(sampler->patch_path[i], path);
+    free_path(features, path);
 
-  sampler->load_patch(sampler->patch_path);
+    // drop whatever load is still going on the part; this one replaces it
+    sampler->parts[i].cancel_load = true;
+    sampler->restore_pending[i] = true;
+  }
 
   return LV2_STATE_SUCCESS;
 }
 
+static uint32_t options_get(LV2_Handle, LV2_Options_Option*) {
+  return LV2_OPTIONS_ERR_UNKNOWN;
+}
+
+// only records the new length; run has the worker build larger buffers
+static uint32_t options_set(LV2_Handle instance, const LV2_Options_Option* options) {
+  LV2Sampler* sampler = static_cast<LV2Sampler*>(instance);
+
+  uint32_t status = LV2_OPTIONS_SUCCESS;
+  for (int i = 0; options[i].key != 0; ++i) {
+    if (options[i].key == sampler->uris.bufsize_maxBlockLength) {
+      int max_block_len;
+      if (get_int_option(sampler->uris, options[i], &max_block_len))
+        sampler->set_buffer_size(max_block_len);
+      else
+        status |= LV2_OPTIONS_ERR_BAD_VALUE;
+    }
+    else if (options[i].key != sampler->uris.bufsize_nominalBlockLength)
+      status |= LV2_OPTIONS_ERR_BAD_KEY;
+  }
+
+  return status;
+}
+
 static const void* extension_data(const char* uri) {
   static const LV2_Worker_Interface worker = { work, work_response, NULL };
   static const LV2_State_Interface state = { save, restore };
+  static const LV2_Options_Interface options = { options_get, options_set };
   if (!strcmp(uri, LV2_WORKER__interface))
     return &worker;
   if (!strcmp(uri, LV2_STATE__interface))
     return &state;
+  if (!strcmp(uri, LV2_OPTIONS__interface))
+    return &options;
 
   return NULL;
 }
@@ -21,6 +21,7 @@
 #include <cstddef>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <cstdio>
 #include <cstring>
@@ -47,9 +48,10 @@ using std::endl;
 #include <lib/lv2_uris.h>
 #include <lib/jmsampler.h>
 #include <lib/lv2sampler.h>
+#include <lib/uimsg.h>
 #include "lv2_external_ui.h"
 
-#define BUF_SIZE 513
+#define BUF_SIZE 4096
 #define SAMPLE_RATE 44100
 
 #define JM_SAMPLER_UI_URI JM_SAMPLER_URI "#ui"
@@ -67,8 +69,8 @@ struct jm_sampler_ui {
   // because we need non-blocking io
   int fdin; 
   pid_t pid;
-  int tot_read;
   char buf[BUF_SIZE];
+  jm::msg_buffer in;
   char title[256];
   bool spawned;
   float volume;
@@ -84,17 +86,6 @@ struct jm_sampler_ui {
 }
 */
 
-// like strcpy but can destructively overlap
-static void strmov(char* dest, char* source) {
-  size_t i;
-
-  for (i = 0; source[i] != '\0'; ++i)
-    dest[i] = source[i];
-
-  // don't forget to update null
-  dest[i] = '\0';
-}
-
 static int ui_show(jm_sampler_ui* ui) {
   if (ui->spawned)
     return 0;
@@ -133,19 +124,16 @@ static int ui_show(jm_sampler_ui* ui) {
   fcntl(to_child_pipe[1], F_SETFD, FD_CLOEXEC); 
 
   ui->fdin = from_child_pipe[0];
-  ui->sampler->fout = fdopen(to_child_pipe[1], "w");
   ui->pid = pid;
-  ui->tot_read = 0;
 
-  fprintf(ui->sampler->fout, "set_sample_rate:%i\n", ui->sampler->sample_rate);
-  fflush(ui->sampler->fout);
+  // the worker may be mid load and publishing zones; the rate has to go first
+  pthread_mutex_lock(&ui->sampler->zone_lock);
+  ui->sampler->set_ui(fdopen(to_child_pipe[1], "w"));
+  ui->sampler->send_sample_rate();
+  pthread_mutex_unlock(&ui->sampler->zone_lock);
 
-  fprintf(ui->sampler->fout, "update_vol:%f\n", ui->volume);
-  fprintf(ui->sampler->fout, "update_chan:%f\n", ui->channel);
-  fflush(ui->sampler->fout);
-
-  for (int i = 0; i < ui->sampler->zones.size(); ++i)
-    ui->sampler->send_add_zone(i);
+  // sends vol, chan and zones of whichever part was last edited
+  ui->sampler->select_part(ui->sampler->edit_part);
 
   ui->spawned = true;
 
@@ -153,95 +141,115 @@ static int ui_show(jm_sampler_ui* ui) {
   return 0;
 }
 
+// a zone edit for the worker on edit_part; val may be NULL
+static void send_zone_edit(jm_sampler_ui* ui, LV2_URID type, int index, int key, const char* val) {
+  uint8_t buf[512 + MAX_PATH];
+  lv2_atom_forge_set_buffer(&ui->forge, buf, sizeof(buf));
+  LV2_Atom_Forge_Frame obj_frame;
+  LV2_Atom* obj = lv2_atom_forge_deref(&ui->forge, lv2_atom_forge_object(&ui->forge, &obj_frame, 0, type));
+  lv2_atom_forge_key(&ui->forge, ui->uris.jm_part);
+  lv2_atom_forge_int(&ui->forge, ui->sampler->edit_part);
+  lv2_atom_forge_key(&ui->forge, ui->uris.jm_index);
+  lv2_atom_forge_int(&ui->forge, index);
+  lv2_atom_forge_key(&ui->forge, ui->uris.jm_key);
+  lv2_atom_forge_int(&ui->forge, key);
+  if (val != NULL) {
+    lv2_atom_forge_key(&ui->forge, ui->uris.jm_params);
+    lv2_atom_forge_string(&ui->forge, val, strlen(val));
+  }
+  lv2_atom_forge_pop(&ui->forge, &obj_frame);
+  ui->write(ui->controller, 0, lv2_atom_total_size(obj), ui->uris.atom_eventTransfer, obj);
+}
+
 static int ui_run(jm_sampler_ui* ui) {
   int num_read;
-  while ((num_read = read(ui->fdin, ui->buf + ui->tot_read, BUF_SIZE - 1 - ui->tot_read)) > 0) {
-    // add null char
-    ui->buf[ui->tot_read + num_read] = '\0';
-    char* new_line;
-    while ((new_line = strchr(ui->buf, '\n')) != NULL) {
-      *new_line = '\0';
-
-      if (!strncmp(ui->buf, "update_vol:", 11)) {
-        float val = atof(ui->buf + 11);
-        ui->write(ui->controller, 1, sizeof(float), 0, &val);
+  while ((num_read = read(ui->fdin, ui->buf, BUF_SIZE)) > 0) {
+    ui->in.append(ui->buf, num_read);
+
+    uint32_t type;
+    const char* body;
+    size_t len;
+    while (ui->in.next(&type, &body, &len)) {
+      jm::msg_reader msg(body, len);
+
+      // only the first part has ports; the rest go through the engine's control queue
+      if (type == jm::MSG_UPDATE_VOL) {
+        float val = msg.get_float();
+        if (ui->sampler->edit_part == 0)
+          ui->write(ui->controller, 1, sizeof(float), 0, &val);
+        else
+          ui->sampler->set_volume(ui->sampler->edit_part, val);
       }
-      else if (!strncmp(ui->buf, "update_chan:", 12)) {
-        float val = atof(ui->buf + 12);
-        ui->write(ui->controller, 2, sizeof(float), 0, &val);
+      else if (type == jm::MSG_UPDATE_CHAN) {
+        float val = msg.get_int();
+        if (ui->sampler->edit_part == 0)
+          ui->write(ui->controller, 2, sizeof(float), 0, &val);
+        else
+          ui->sampler->set_channel(ui->sampler->edit_part, val);
       }
-      else if (!strncmp(ui->buf, "update_zone:", 12)) {
-          char* p = strtok(ui->buf + 12, ",");
-          int index = atoi(p);
-          p = strtok(NULL, ",");
-          int key = atoi(p);
-
-          p = strtok(NULL, ",");
-
-          // special case, update wave
-          if (key == jm::ZONE_PATH) {
-            if (ui->sampler->waves.find(p) == ui->sampler->waves.end()) {
-              ui->sampler->waves[p] = jm::parse_wave(p);
-            }
-          }
-
-          ui->sampler->update_zone(index, key, p);
+      else if (type == jm::MSG_SELECT_PART) {
+        ui->sampler->select_part(msg.get_int());
       }
-      else if (!strncmp(ui->buf, "remove_zone:", 12)) {
-        int index = atoi(ui->buf + 12);
-        ui->sampler->remove_zone(index);
-
-        fprintf(ui->sampler->fout, "remove_zone:%i\n", index);
-        fflush(ui->sampler->fout);
+      else if (type == jm::MSG_UPDATE_POLY) {
+        ui->sampler->set_polyphony(ui->sampler->edit_part, msg.get_int());
       }
-      else if (!strncmp(ui->buf, "add_zone:", 9)) {
-        char* p = strtok(ui->buf + 9, ",");
-        int index = atoi(p);
-        p = strtok(NULL, ",");
-
-        if (ui->sampler->waves.find(p) == ui->sampler->waves.end()) {
-          ui->sampler->waves[p] = jm::parse_wave(p);
-        }
+      // anything that reads waves or reshapes the zone list runs on the
+      // plugin's worker, in the order sent
+      else if (type == jm::MSG_UPDATE_ZONE) {
+        int index = msg.get_int();
+        int key = msg.get_int();
+        char val[MAX_PATH];
+        msg.get_str(val, MAX_PATH);
+
+        send_zone_edit(ui, ui->uris.jm_updateZone, index, key, val);
+      }
+      else if (type == jm::MSG_REMOVE_ZONE) {
+        send_zone_edit(ui, ui->uris.jm_removeZone, msg.get_int(), 0, NULL);
+      }
+      else if (type == jm::MSG_NEW_ZONE) {
+        int index = msg.get_int();
+        char path[MAX_PATH];
+        msg.get_str(path, MAX_PATH);
 
-        ui->sampler->add_zone_from_wave(index, p);
+        send_zone_edit(ui, ui->uris.jm_addZone, index, 0, path);
       }
-      else if (!strncmp(ui->buf, "dup_zone:", 9)) {
-        char* p = strtok(ui->buf + 9, ",");
-        int index = atoi(p);
-        ui->sampler->duplicate_zone(index);
+      else if (type == jm::MSG_DUP_ZONE) {
+        send_zone_edit(ui, ui->uris.jm_dupZone, msg.get_int(), 0, NULL);
       }
-      else if (!strncmp(ui->buf, "save_patch:", 11)) {
-        ui->sampler->save_patch(ui->buf + 11);
+      else if (type == jm::MSG_SAVE_PATCH) {
+        ui->sampler->save_patch(msg.get_str().c_str());
       }
-      else if (!strncmp(ui->buf, "refresh", 7)) {
-        ui->sampler->reload_waves();
+      else if (type == jm::MSG_REFRESH) {
+        send_zone_edit(ui, ui->uris.jm_reloadWaves, 0, 0, NULL);
       }
-      else {
-         uint8_t buf[128];
-         lv2_atom_forge_set_buffer(&ui->forge, buf, 128);
-         //cerr << "UI: ui stdout message: " << ui->buf << endl;
-         LV2_Atom* obj;
-
-        if (!strncmp(ui->buf, "load_patch:", 11)) {
-          LV2_Atom_Forge_Frame obj_frame;
-          obj = (LV2_Atom*) lv2_atom_forge_object(&ui->forge, &obj_frame, 0, ui->uris.jm_loadPatch);
-          lv2_atom_forge_key(&ui->forge, ui->uris.jm_params);
-          lv2_atom_forge_string(&ui->forge, ui->buf + 11, strlen(ui->buf + 11));
-          lv2_atom_forge_pop(&ui->forge, &obj_frame);
-        }
+      else if (type == jm::MSG_LOAD_PATCH) {
+        char path[MAX_PATH];
+        msg.get_str(path, MAX_PATH);
+
+        uint8_t buf[512];
+        lv2_atom_forge_set_buffer(&ui->forge, buf, 512);
+        LV2_Atom_Forge_Frame obj_frame;
+        LV2_Atom* obj = lv2_atom_forge_deref(&ui->forge, lv2_atom_forge_object(&ui->forge, &obj_frame, 0, ui->uris.jm_loadPatch));
+        lv2_atom_forge_key(&ui->forge, ui->uris.jm_params);
+        lv2_atom_forge_string(&ui->forge, path, strlen(path));
+        lv2_atom_forge_key(&ui->forge, ui->uris.jm_part);
+        lv2_atom_forge_int(&ui->forge, ui->sampler->edit_part);
+        lv2_atom_forge_pop(&ui->forge, &obj_frame);
         ui->write(ui->controller, 0, lv2_atom_total_size(obj), ui->uris.atom_eventTransfer, obj);
       }
-      // shift left to prepare next value
-      strmov(ui->buf, new_line + 1);
-      // correct for shift
-      ui->tot_read -= new_line + 1 - ui->buf;
     }
-    ui->tot_read += num_read;
+
+    // a garbled stream from the child is treated as it going away
+    if (!ui->in.ok) {
+      kill(ui->pid, SIGTERM);
+      num_read = 0;
+      break;
+    }
   }
 
   // if exactly 0 the child stream is closed due to exiting
   if (num_read == 0) {
-    fclose(ui->sampler->fout);
+    fclose(ui->sampler->set_ui(NULL));
     waitpid(ui->pid, NULL, 0);
 
     ui->spawned = false;
@@ -390,19 +398,16 @@ static void port_event(LV2UI_Handle handle, uint32_t port_index,
 
   // store vals in case vol or chan sent before show called
   if (format == 0) {
+    // ports belong to the first part; don't clobber another part's controls
     if (port_index == 1) {
       ui->volume = *(float*) buffer;
-      if (ui->spawned) {
-        fprintf(ui->sampler->fout, "update_vol:%f\n", ui->volume);
-        fflush(ui->sampler->fout);
-      }
+      if (ui->spawned && ui->sampler->edit_part == 0)
+        ui->sampler->send_update_vol(ui->volume);
     }
     else if (port_index == 2) {
       ui->channel = *(float*) buffer;
-      if (ui->spawned) {
-        fprintf(ui->sampler->fout, "update_chan:%f\n", ui->channel);
-        fflush(ui->sampler->fout);
-      }
+      if (ui->spawned && ui->sampler->edit_part == 0)
+        ui->sampler->send_update_chan((int) ui->channel);
     }
   }
 }
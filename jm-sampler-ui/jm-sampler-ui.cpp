@@ -19,116 +19,99 @@
 
 #include <iostream>
 #include <string>
-#include <sstream>
 #include <QtWidgets>
 #include <cmath>
 #include <cstring>
+#include <cerrno>
+#include <unistd.h>
 
 #include <lib/zone.h>
+#include <lib/uimsg.h>
 #include "components.h"
 #include "zonegrid.h"
 
 #include "jm-sampler-ui.h"
 
-void InputThread::run() {
-  //char input[256];
-  std::string input;
+// a zone as the table keeps it; check states are qt's and long tail is ui only
+static void read_zone(jm::msg_reader* msg, jm::zone* z, int sample_rate) {
+  jm::get_zone(msg, z);
+  z->mute = z->mute ? Qt::Checked: Qt::Unchecked;
+  z->solo = z->solo ? Qt::Checked: Qt::Unchecked;
+  z->long_tail = z->decay > 2 * sample_rate || z->release > 2 * sample_rate ? Qt::Checked: Qt::Unchecked;
+}
 
-  while (true) {
-    std::getline(std::cin, input);
-    if (std::cin.eof())
+void InputThread::run() {
+  char buf[4096];
+  jm::msg_buffer in;
+  ssize_t n;
+
+  while ((n = read(0, buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
       break;
-
-    if (!input.compare(0, 16, "set_sample_rate:")) {
-      sample_rate = atoi(input.substr(16).c_str());
-      emit receivedSampleRate(sample_rate);
     }
-    else if (!input.compare(0, 9, "add_zone:")) {
-      jm::zone z;
-      std::istringstream sin(input.substr(9));
-      std::string field;
-      std::getline(sin, field, ',');
-      int index = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      z.wave_length = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      strcpy(z.name, field.c_str());
-      std::getline(sin, field, ',');
-      z.amp = atof(field.c_str());
-      std::getline(sin, field, ',');
-      z.mute = atoi(field.c_str()) ? Qt::Checked: Qt::Unchecked;
-      std::getline(sin, field, ',');
-      z.solo = atoi(field.c_str()) ? Qt::Checked: Qt::Unchecked;
-      std::getline(sin, field, ',');
-      z.origin = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      z.low_key = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      z.high_key = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      z.low_vel = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      z.high_vel = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      z.pitch_corr = atof(field.c_str());
-      std::getline(sin, field, ',');
-      z.start = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      z.left = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      z.right = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      z.loop_mode = (jm::loop_mode) atoi(field.c_str());
-      std::getline(sin, field, ',');
-      z.crossfade = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      z.group = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      z.off_group = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      z.attack = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      z.hold = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      z.decay = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      z.sustain = atof(field.c_str());
-      std::getline(sin, field, ',');
-      z.release = atoi(field.c_str());
-
-      z.long_tail = z.decay > 2 * sample_rate || z.release > 2 * sample_rate ? Qt::Checked: Qt::Unchecked;
-
-      std::getline(sin, field, ',');
-      strcpy(z.path, field.c_str());
-
-      emit receivedAddZone(index, z);
+    in.append(buf, n);
+
+    uint32_t type;
+    const char* body;
+    size_t len;
+    while (in.next(&type, &body, &len)) {
+      jm::msg_reader msg(body, len);
+
+      if (type == jm::MSG_SAMPLE_RATE) {
+        sample_rate = msg.get_int();
+        emit receivedSampleRate(sample_rate);
+      }
+      else if (type == jm::MSG_ZONES) {
+        std::vector<jm::zone> zones(msg.get_int());
+        for (size_t i = 0; i < zones.size() && msg.ok; ++i)
+          read_zone(&msg, &zones[i], sample_rate);
+
+        if (msg.ok)
+          emit receivedZones(zones);
+      }
+      else if (type == jm::MSG_ADD_ZONE) {
+        jm::zone z;
+        int index = msg.get_int();
+        read_zone(&msg, &z, sample_rate);
+
+        if (msg.ok)
+          emit receivedAddZone(index, z);
+      }
+      else if (type == jm::MSG_UPDATE_WAVE) {
+        int index = msg.get_int();
+        QString path = QString::fromStdString(msg.get_str());
+        int wave_length = msg.get_int();
+        int start = msg.get_int();
+        int left = msg.get_int();
+        int right = msg.get_int();
+        int loop_mode = msg.get_int();
+
+        emit receivedUpdateWave(index, path, wave_length, start, left, right, loop_mode);
+      }
+      else if (type == jm::MSG_LOAD_PROGRESS) {
+        int loaded = msg.get_int();
+        int total = msg.get_int();
+
+        emit receivedLoadProgress(loaded, total);
+      }
+      else if (type == jm::MSG_REMOVE_ZONE)
+        emit receivedRemoveZone(msg.get_int());
+      else if (type == jm::MSG_UPDATE_VOL)
+        emit receivedUpdateVol(msg.get_float());
+      else if (type == jm::MSG_UPDATE_CHAN)
+        emit receivedUpdateChan(msg.get_int());
+      else if (type == jm::MSG_UPDATE_PART) {
+        int index = msg.get_int();
+        int polyphony = msg.get_int();
+
+        emit receivedUpdatePart(index, polyphony);
+      }
     }
-    else if (!input.compare(0, 12, "update_wave:")) {
-      std::istringstream sin(input.substr(12));
-      std::string field;
-      std::getline(sin, field, ',');
-      int index = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      QString path = QString::fromStdString(field);
-      std::getline(sin, field, ',');
-      int wave_length = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      int start = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      int left = atoi(field.c_str());
-      std::getline(sin, field, ',');
-      int right = atoi(field.c_str());
-
-      emit receivedUpdateWave(index, path, wave_length, start, left, right);
-    }
-    else if (!input.compare(0, 12, "remove_zone:"))
-      emit receivedRemoveZone(atoi(input.substr(12).c_str()));
-    else if (!input.compare(0, 11, "clear_zones"))
-      emit receivedClearZones();
-    else if (!input.compare(0, 11, "update_vol:"))
-      emit receivedUpdateVol(atof(input.substr(11).c_str()));
-    else if (!input.compare(0, 12, "update_chan:"))
-      emit receivedUpdateChan(atoi(input.substr(12).c_str()));
+
+    if (!in.ok)
+      break;
   }
 }
 
@@ -149,10 +132,28 @@ SamplerUI::SamplerUI() {
   connect(refresh_button, &QAbstractButton::clicked, this, &SamplerUI::sendRefresh);
   h_layout->addWidget(refresh_button);
   h_layout->addStretch();
+  // waves still decoding after a patch load
+  load_progress = new QProgressBar;
+  load_progress->setFormat(tr("loading %v/%m"));
+  load_progress->hide();
+  h_layout->addWidget(load_progress);
   v_layout->addLayout(h_layout);
 
   h_layout = new QHBoxLayout;
   QLabel* label = new QLabel;
+  label->setText(tr("Part:"));
+  h_layout->addWidget(label);
+
+  // which of the multi-timbral parts the controls below edit
+  part_combo = new QComboBox;
+  part_combo->setFocusPolicy(Qt::NoFocus);
+  for (int i = 1; i <= 16; ++i)
+    part_combo->addItem(QString::number(i));
+  connect(part_combo, static_cast<void(QComboBox::*)(int)>(&QComboBox::activated), this, &SamplerUI::sendSelectPart);
+
+  h_layout->addWidget(part_combo);
+
+  label = new QLabel;
   label->setText(tr("Vol:"));
   h_layout->addWidget(label);
 
@@ -174,6 +175,17 @@ SamplerUI::SamplerUI() {
 
   h_layout->addWidget(chan_combo);
 
+  label = new QLabel;
+  label->setText(tr("Poly:"));
+  h_layout->addWidget(label);
+
+  poly_spin = new QSpinBox;
+  poly_spin->setFocusPolicy(Qt::NoFocus);
+  poly_spin->setRange(1, 64);
+  connect(poly_spin, static_cast<void(QSpinBox::*)(int)>(&QSpinBox::valueChanged), this, &SamplerUI::sendUpdatePoly);
+
+  h_layout->addWidget(poly_spin);
+
   h_layout->addStretch();
 
   v_layout->addLayout(h_layout);
@@ -194,13 +206,16 @@ SamplerUI::SamplerUI() {
 
   InputThread* in_thread = new InputThread;
   qRegisterMetaType<jm::zone>();
+  qRegisterMetaType<std::vector<jm::zone> >();
   connect(in_thread, &InputThread::receivedSampleRate, &zone_model, &ZoneTableModel::setSampleRate);
   connect(in_thread, &InputThread::receivedAddZone, &zone_model, &ZoneTableModel::addNewZone);
   connect(in_thread, &InputThread::receivedUpdateWave, &zone_model, &ZoneTableModel::updateWave);
   connect(in_thread, &InputThread::receivedRemoveZone, &zone_model, &ZoneTableModel::removeZone);
-  connect(in_thread, &InputThread::receivedClearZones, &zone_model, &ZoneTableModel::clearZones);
+  connect(in_thread, &InputThread::receivedZones, &zone_model, &ZoneTableModel::setZones);
   connect(in_thread, &InputThread::receivedUpdateVol, this, &SamplerUI::checkAndUpdateVol);
   connect(in_thread, &InputThread::receivedUpdateChan, this, &SamplerUI::checkAndUpdateChan);
+  connect(in_thread, &InputThread::receivedUpdatePart, this, &SamplerUI::checkAndUpdatePart);
+  connect(in_thread, &InputThread::receivedLoadProgress, this, &SamplerUI::updateLoadProgress);
   connect(in_thread, &QThread::finished, in_thread, &QObject::deleteLater);
   connect(in_thread, &QThread::finished, this, &QWidget::close);
   connect(in_thread, &QThread::finished, &QApplication::quit);
@@ -223,38 +238,97 @@ void SamplerUI::checkAndUpdateChan(int index) {
     chan_combo->setCurrentIndex(index);
 }
 
+void SamplerUI::checkAndUpdatePart(int index, int polyphony) {
+  // only set if different
+  if (part_combo->currentIndex() != index)
+    part_combo->setCurrentIndex(index);
+
+  // don't echo the engine's own value back to it
+  if (poly_spin->value() != polyphony) {
+    poly_spin->blockSignals(true);
+    poly_spin->setValue(polyphony);
+    poly_spin->blockSignals(false);
+  }
+}
+
+void SamplerUI::updateLoadProgress(int loaded, int total) {
+  load_progress->setMaximum(total);
+  load_progress->setValue(loaded);
+  load_progress->setVisible(loaded < total);
+}
+
 void SamplerUI::sendAddZone() {
   QString path = QFileDialog::getOpenFileName(this, tr("Open a fucking WAV already!!"), "", tr("Sound Files (*.wav *.WAV *.aiff *.flac)"));
   if (!path.isNull()) {
-    std::cout << "add_zone:-1," << path.toStdString() << std::endl;
+    jm::msg_writer out;
+    out.begin(jm::MSG_NEW_ZONE);
+    out.put_int(-1);
+    out.put_str(path.toStdString().c_str());
+    out.end();
+    send_msg(out);
     setWindowModified(true);
   }
 }
 
 void SamplerUI::sendLoadPatch() {
-  QString path = QFileDialog::getOpenFileName(this, tr("Open a fucking PATCH already!!"), "", tr("Patch Files (*.sfz *.jmz);;SFZ (*.sfz);;JMZ (*.jmz)"));
+  QString path = QFileDialog::getOpenFileName(this, tr("Open a fucking PATCH already!!"), "", tr("Patch Files (*.sfz *.jmz *.jmzb);;SFZ (*.sfz);;JMZ (*.jmz);;Compiled JMZ (*.jmzb)"));
   if (!path.isNull()) {
-    std::cout << "load_patch:" << path.toStdString() << std::endl;
+    jm::msg_writer out;
+    out.begin(jm::MSG_LOAD_PATCH);
+    out.put_str(path.toStdString().c_str());
+    out.end();
+    send_msg(out);
     setWindowModified(false);
   }
 }
 
 void SamplerUI::sendSavePatch() {
-  QString path = QFileDialog::getSaveFileName(this, tr("Save a fucking PATCH already!!"), "", tr("Patch Files (*.sfz *.jmz);;SFZ (*.sfz);;JMZ (*.jmz)"));
+  QString path = QFileDialog::getSaveFileName(this, tr("Save a fucking PATCH already!!"), "", tr("Patch Files (*.sfz *.jmz *.jmzb);;SFZ (*.sfz);;JMZ (*.jmz);;Compiled JMZ (*.jmzb)"));
   if (!path.isNull()) {
-    std::cout << "save_patch:" << path.toStdString() << std::endl;
+    jm::msg_writer out;
+    out.begin(jm::MSG_SAVE_PATCH);
+    out.put_str(path.toStdString().c_str());
+    out.end();
+    send_msg(out);
     setWindowModified(false);
   }
 }
 
 void SamplerUI::sendRefresh() {
-  std::cout << "refresh" << std::endl;
+  jm::msg_writer out;
+  out.begin(jm::MSG_REFRESH);
+  out.end();
+  send_msg(out);
 }
 
 void SamplerUI::sendUpdateVol(double val) {
-  std::cout << "update_vol:" << val << std::endl;
+  jm::msg_writer out;
+  out.begin(jm::MSG_UPDATE_VOL);
+  out.put_float(val);
+  out.end();
+  send_msg(out);
 }
 
 void SamplerUI::sendUpdateChan(int index) {
-  std::cout << "update_chan:" << index << std::endl;
+  jm::msg_writer out;
+  out.begin(jm::MSG_UPDATE_CHAN);
+  out.put_int(index);
+  out.end();
+  send_msg(out);
+}
+
+void SamplerUI::sendSelectPart(int index) {
+  jm::msg_writer out;
+  out.begin(jm::MSG_SELECT_PART);
+  out.put_int(index);
+  out.end();
+  send_msg(out);
+}
+
+void SamplerUI::sendUpdatePoly(int polyphony) {
+  jm::msg_writer out;
+  out.begin(jm::MSG_UPDATE_POLY);
+  out.put_int(polyphony);
+  out.end();
+  send_msg(out);
 }
@@ -21,14 +21,18 @@
 #define JM_SAMPLER_UI
 
 #include <QWidget>
+#include <vector>
 
 #include <lib/zone.h>
 #include "zonegrid.h"
 
 class HVolumeSlider;
 class QComboBox;
+class QProgressBar;
+class QSpinBox;
 
 Q_DECLARE_METATYPE(jm::zone)
+Q_DECLARE_METATYPE(std::vector<jm::zone>)
 
 class InputThread: public QThread {
   Q_OBJECT
@@ -41,19 +45,24 @@ class InputThread: public QThread {
     //void receivedValue(int val);
     void receivedSampleRate(int sample_rate);
     void receivedAddZone(int i, const jm::zone& z);
-    void receivedUpdateWave(int i, const QString& path, int wave_length, int start, int left, int right);
+    void receivedUpdateWave(int i, const QString& path, int wave_length, int start, int left, int right, int loop_mode);
     void receivedRemoveZone(int i);
-    void receivedClearZones();
+    void receivedZones(const std::vector<jm::zone>& zones);
     void receivedUpdateVol(double val);
     void receivedUpdateChan(int index);
+    void receivedLoadProgress(int loaded, int total);
+    void receivedUpdatePart(int index, int polyphony);
 };
 
 class SamplerUI: public QWidget {
   Q_OBJECT
 
   private:
+    QComboBox* part_combo;
+    QSpinBox* poly_spin;
     HVolumeSlider* vol_slider;
     QComboBox* chan_combo;
+    QProgressBar* load_progress;
     ZoneTableModel zone_model;
 
   public:
@@ -63,12 +72,16 @@ class SamplerUI: public QWidget {
     void handleUserUpdate();
     void checkAndUpdateVol(double val);
     void checkAndUpdateChan(int index);
+    void checkAndUpdatePart(int index, int polyphony);
+    void updateLoadProgress(int loaded, int total);
     void sendAddZone();
     void sendLoadPatch();
     void sendSavePatch();
     void sendRefresh();
     void sendUpdateVol(double val);
     void sendUpdateChan(int index);
+    void sendSelectPart(int index);
+    void sendUpdatePoly(int polyphony);
 };
 
 #endif
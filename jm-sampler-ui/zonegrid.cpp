@@ -18,12 +18,15 @@
 *****************************************************************************/
 
 #include <iostream>
+#include <sstream>
+#include <string>
 #include <cstring>
 #include <cmath>
 #include <QtWidgets>
 #include <libgen.h>
 
 #include <lib/zone.h>
+#include <lib/uimsg.h>
 #include "components.h"
 #include "zonegrid.h"
 
@@ -98,6 +101,21 @@ int string_to_note(const QString& str) {
   return -1;
 }
 
+void send_msg(const jm::msg_writer& msg) {
+  std::cout.write(msg.data(), msg.size());
+  std::cout.flush();
+}
+
+void send_update_zone(int index, int key, const std::string& val) {
+  jm::msg_writer out;
+  out.begin(jm::MSG_UPDATE_ZONE);
+  out.put_int(index);
+  out.put_int(key);
+  out.put_str(val.c_str());
+  out.end();
+  send_msg(out);
+}
+
 /************
 *
 * MouseHandleView
@@ -284,6 +302,7 @@ ZoneTableView::ZoneTableView(QAbstractItemModel* model) {
   setColumnWidth(jm::ZONE_CROSSFADE, 55);
   setColumnWidth(jm::ZONE_GROUP, 65);
   setColumnWidth(jm::ZONE_OFF_GROUP, 65);
+  setColumnWidth(jm::ZONE_OUTPUT, 55);
   setColumnWidth(jm::ZONE_ATTACK, 65);
   setColumnWidth(jm::ZONE_HOLD, 65);
   setColumnWidth(jm::ZONE_DECAY, 65);
@@ -356,18 +375,31 @@ void ZoneTableView::handleVertHeaderClick(const QPoint& pos) {
   QAction* action = menu.exec(verticalHeader()->mapToGlobal(pos));
   if (action != 0) {
     if (action->text() == "delete") {
-      std::cout << "remove_zone:" << verticalHeader()->logicalIndexAt(pos) << std::endl;
+      jm::msg_writer out;
+      out.begin(jm::MSG_REMOVE_ZONE);
+      out.put_int(verticalHeader()->logicalIndexAt(pos));
+      out.end();
+      send_msg(out);
       emit userUpdate();
     }
     else if (action->text() == "new zone before") {
       QString path = QFileDialog::getOpenFileName(this, tr("Open a fucking WAV already!!"), "", tr("Sound Files (*.wav *.WAV *.aiff *.flac)"));
       if (!path.isNull()) {
-        std::cout << "add_zone:" << verticalHeader()->logicalIndexAt(pos) << "," << path.toStdString() << std::endl;
+        jm::msg_writer out;
+        out.begin(jm::MSG_NEW_ZONE);
+        out.put_int(verticalHeader()->logicalIndexAt(pos));
+        out.put_str(path.toStdString().c_str());
+        out.end();
+        send_msg(out);
         emit userUpdate();
       }
     }
     else if (action->text() == "duplicate") {
-      std::cout << "dup_zone:" << verticalHeader()->logicalIndexAt(pos) << std::endl;
+      jm::msg_writer out;
+      out.begin(jm::MSG_DUP_ZONE);
+      out.put_int(verticalHeader()->logicalIndexAt(pos));
+      out.end();
+      send_msg(out);
       emit userUpdate();
     }
   }
@@ -435,6 +467,13 @@ QWidget* ZoneTableDelegate::createEditor(QWidget* parent, const QStyleOptionView
       for (int i = 1; i <= 16; ++i)
         combo->addItem(QString::number(i));
 
+      connect(combo, static_cast<void (QComboBox::*)(int)>(&QComboBox::activated), this, &ZoneTableDelegate::commitAndCloseEditor);
+      return combo;
+    case jm::ZONE_OUTPUT:
+      combo = new QComboBox(parent);
+      for (int i = 1; i <= MAX_OUTPUTS; ++i)
+        combo->addItem(QString::number(i));
+
       connect(combo, static_cast<void (QComboBox::*)(int)>(&QComboBox::activated), this, &ZoneTableDelegate::commitAndCloseEditor);
       return combo;
     case jm::ZONE_CROSSFADE:
@@ -508,7 +547,8 @@ void ZoneTableDelegate::updateEditorGeometry(QWidget* editor,
     }
     case jm::ZONE_LOOP_MODE:
     case jm::ZONE_GROUP:
-    case jm::ZONE_OFF_GROUP: {
+    case jm::ZONE_OFF_GROUP:
+    case jm::ZONE_OUTPUT: {
       QComboBox* combo = static_cast<QComboBox*>(editor);
       // base new y off centers since current cell may have been resized
       int y = option.rect.y() + (option.rect.height() - combo->height()) / 2;
@@ -559,7 +599,8 @@ void ZoneTableDelegate::setEditorData(QWidget* editor, const QModelIndex& index)
     }
     case jm::ZONE_LOOP_MODE:
     case jm::ZONE_GROUP:
-    case jm::ZONE_OFF_GROUP: {
+    case jm::ZONE_OFF_GROUP:
+    case jm::ZONE_OUTPUT: {
       QComboBox* combo = static_cast<QComboBox*>(editor);
       combo->setCurrentText(index.data(Qt::EditRole).toString());
       // must show popup here instead of update geometry because it
@@ -616,7 +657,8 @@ void ZoneTableDelegate::setModelData(QWidget* editor, QAbstractItemModel* model,
     }
     case jm::ZONE_LOOP_MODE:
     case jm::ZONE_GROUP:
-    case jm::ZONE_OFF_GROUP: {
+    case jm::ZONE_OFF_GROUP:
+    case jm::ZONE_OUTPUT: {
       QComboBox* combo = static_cast<QComboBox*>(editor);
       model->setData(index, combo->currentText(), Qt::EditRole);
       break;
@@ -751,6 +793,8 @@ QVariant ZoneTableModel::headerData(int section, Qt::Orientation orientation, in
           return "Group";
         case jm::ZONE_OFF_GROUP:
           return "Off Grp";
+        case jm::ZONE_OUTPUT:
+          return "Out";
         case jm::ZONE_ATTACK:
           return "Attack";
         case jm::ZONE_HOLD:
@@ -875,6 +919,8 @@ QVariant ZoneTableModel::data(const QModelIndex &index, int role) const {
         return zones[index.row()].group == 0 ? "none": QString::number(zones[index.row()].group);
       case jm::ZONE_OFF_GROUP:
         return zones[index.row()].off_group == 0 ? "none": QString::number(zones[index.row()].off_group);
+      case jm::ZONE_OUTPUT:
+        return QString::number(zones[index.row()].output + 1);
       case jm::ZONE_ATTACK:
         return (float) zones[index.row()].attack / sample_rate;
       case jm::ZONE_HOLD:
@@ -898,11 +944,11 @@ bool ZoneTableModel::setData(const QModelIndex &index, const QVariant &value, in
     switch (index.column()) {
       case jm::ZONE_MUTE:
         zones[index.row()].mute = value.toInt();
-        std::cout << "update_zone:" << index.row() << "," << index.column() << "," << zones[index.row()].mute << std::endl;
+        send_update_zone(index.row(), index.column(), std::to_string(zones[index.row()].mute));
         break;
       case jm::ZONE_SOLO:
         zones[index.row()].solo = value.toInt();
-        std::cout << "update_zone:" << index.row() << "," << index.column() << "," << zones[index.row()].solo << std::endl;
+        send_update_zone(index.row(), index.column(), std::to_string(zones[index.row()].solo));
         break;
       // long tail special case; used for UI only, don't send a message out
       case jm::ZONE_LONG_TAIL:
@@ -913,51 +959,51 @@ bool ZoneTableModel::setData(const QModelIndex &index, const QVariant &value, in
     return true;
   }
   else if (index.isValid() && role == Qt::EditRole) {
-    std::cout << "update_zone:" << index.row() << "," << index.column() << ",";
+    std::ostringstream val;
     switch (index.column()) {
       case jm::ZONE_NAME:
-        strcpy(zones[index.row()].name, value.toString().toStdString().c_str());
-        std::cout << value.toString().toStdString();
+        jm::copy_str(zones[index.row()].name, value.toString().toStdString().c_str(), MAX_NAME);
+        val << value.toString().toStdString();
         break;
       case jm::ZONE_AMP:
         zones[index.row()].amp = powf(10.f, value.toFloat() / 20.f);
-        std::cout << zones[index.row()].amp;
+        val << zones[index.row()].amp;
         break;
       case jm::ZONE_ORIGIN:
         zones[index.row()].origin = string_to_note(value.toString());
-        std::cout << zones[index.row()].origin;
+        val << zones[index.row()].origin;
         break;
       case jm::ZONE_LOW_KEY:
         zones[index.row()].low_key = string_to_note(value.toString());
-        std::cout << zones[index.row()].low_key;
+        val << zones[index.row()].low_key;
         break;
       case jm::ZONE_HIGH_KEY:
         zones[index.row()].high_key = string_to_note(value.toString());
-        std::cout << zones[index.row()].high_key;
+        val << zones[index.row()].high_key;
         break;
       case jm::ZONE_LOW_VEL:
         zones[index.row()].low_vel = value.toInt();
-        std::cout << value.toInt();
+        val << value.toInt();
         break;
       case jm::ZONE_HIGH_VEL:
         zones[index.row()].high_vel = value.toInt();
-        std::cout << value.toInt();
+        val << value.toInt();
         break;
       case jm::ZONE_PITCH:
         zones[index.row()].pitch_corr = value.toDouble();
-        std::cout << value.toDouble();
+        val << value.toDouble();
         break;
       case jm::ZONE_START:
         zones[index.row()].start = (int) (value.toFloat() * sample_rate);
-        std::cout << zones[index.row()].start;
+        val << zones[index.row()].start;
         break;
       case jm::ZONE_LEFT:
         zones[index.row()].left = (int) (value.toFloat() * sample_rate);
-        std::cout << zones[index.row()].left;
+        val << zones[index.row()].left;
         break;
       case jm::ZONE_RIGHT:
         zones[index.row()].right = (int) (value.toFloat() * sample_rate);
-        std::cout << zones[index.row()].right;
+        val << zones[index.row()].right;
         break;
       case jm::ZONE_LOOP_MODE:
         if (value.toString() == "off")
@@ -967,11 +1013,11 @@ bool ZoneTableModel::setData(const QModelIndex &index, const QVariant &value, in
         else if (value.toString() == "one shot")
           zones[index.row()].loop_mode = jm::LOOP_ONE_SHOT;
 
-        std::cout << zones[index.row()].loop_mode;
+        val << zones[index.row()].loop_mode;
         break;
       case jm::ZONE_CROSSFADE:
         zones[index.row()].crossfade = (int) (value.toInt() * sample_rate / 1000.);
-        std::cout << zones[index.row()].crossfade;
+        val << zones[index.row()].crossfade;
         break;
       case jm::ZONE_GROUP:
         if (value.toString() == "none")
@@ -979,7 +1025,7 @@ bool ZoneTableModel::setData(const QModelIndex &index, const QVariant &value, in
         else
           zones[index.row()].group = value.toString().toInt();
         
-        std::cout << zones[index.row()].group;
+        val << zones[index.row()].group;
         break;
       case jm::ZONE_OFF_GROUP:
         if (value.toString() == "none")
@@ -987,34 +1033,38 @@ bool ZoneTableModel::setData(const QModelIndex &index, const QVariant &value, in
         else
           zones[index.row()].off_group = value.toString().toInt();
         
-        std::cout << zones[index.row()].off_group;
+        val << zones[index.row()].off_group;
+        break;
+      case jm::ZONE_OUTPUT:
+        zones[index.row()].output = value.toString().toInt() - 1;
+        val << zones[index.row()].output;
         break;
       case jm::ZONE_ATTACK:
         zones[index.row()].attack = value.toFloat() * sample_rate;
-        std::cout << zones[index.row()].attack;
+        val << zones[index.row()].attack;
         break;
       case jm::ZONE_HOLD:
         zones[index.row()].hold = value.toFloat() * sample_rate;
-        std::cout << zones[index.row()].hold;
+        val << zones[index.row()].hold;
         break;
       case jm::ZONE_DECAY:
         zones[index.row()].decay = value.toFloat() * sample_rate;
-        std::cout << zones[index.row()].decay;
+        val << zones[index.row()].decay;
         break;
       case jm::ZONE_SUSTAIN:
         zones[index.row()].sustain = value.toFloat();
-        std::cout << zones[index.row()].sustain;
+        val << zones[index.row()].sustain;
         break;
       case jm::ZONE_RELEASE:
         zones[index.row()].release = value.toFloat() * sample_rate;
-        std::cout << zones[index.row()].release;
+        val << zones[index.row()].release;
         break;
       case jm::ZONE_PATH:
-        strcpy(zones[index.row()].path, value.toString().toStdString().c_str());
-        std::cout << value.toString().toStdString();
+        jm::copy_str(zones[index.row()].path, value.toString().toStdString().c_str(), MAX_PATH);
+        val << value.toString().toStdString();
         break;
     }
-    std::cout << std::endl;
+    send_update_zone(index.row(), index.column(), val.str());
 
     emit dataChanged(index, index);
     return true;
@@ -1028,19 +1078,23 @@ void ZoneTableModel::addNewZone(int i, const jm::zone& z) {
   emit dataChanged(index(i, 0), index(i, NUM_ZONE_ATTRS - 1));
 }
 
-void ZoneTableModel::updateWave(int i, const QString& path, int wave_length, int start, int left, int right) {
-  strcpy(zones[i].path, path.toStdString().c_str());
+void ZoneTableModel::updateWave(int i, const QString& path, int wave_length, int start, int left, int right, int loop_mode) {
+  jm::copy_str(zones[i].path, path.toStdString().c_str(), MAX_PATH);
   zones[i].wave_length = wave_length;
   zones[i].start = start;
   zones[i].left = left;
   zones[i].right = right;
+  zones[i].loop_mode = (jm::loop_mode) loop_mode;
+  emit dataChanged(index(i, 0), index(i, NUM_ZONE_ATTRS - 1));
 }
 
 void ZoneTableModel::removeZone(int i) {
   removeRows(i, 1);
 }
 
-void ZoneTableModel::clearZones() {
-  removeRows(0, rowCount());
+void ZoneTableModel::setZones(const std::vector<jm::zone>& zones) {
+  beginResetModel();
+  this->zones = zones;
+  endResetModel();
 }
 
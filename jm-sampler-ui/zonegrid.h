@@ -24,12 +24,18 @@
 #include <QTableView>
 #include <QStyledItemDelegate>
 #include <QAbstractTableModel>
+#include <string>
+#include <vector>
 
 #include <lib/zone.h>
 
 class QString;
 
-#define NUM_ZONE_ATTRS 24
+namespace jm {
+  class msg_writer;
+};
+
+#define NUM_ZONE_ATTRS 25
 
 enum roles {
   MAX_ROLE = Qt::UserRole
@@ -38,6 +44,9 @@ enum roles {
 // some helper functions
 QString note_to_string(int note);
 int string_to_note(const QString& str);
+// to the engine on stdout
+void send_msg(const jm::msg_writer& msg);
+void send_update_zone(int index, int key, const std::string& val);
 
 class MouseHandleView: public QTableView {
   Q_OBJECT
@@ -118,9 +127,9 @@ class ZoneTableModel: public QAbstractTableModel {
   public slots:
     void setSampleRate(int sample_rate) {this->sample_rate = sample_rate;}
     void addNewZone(int i, const jm::zone& z);
-    void updateWave(int i, const QString& path, int wave_length, int start, int left, int right);
+    void updateWave(int i, const QString& path, int wave_length, int start, int left, int right, int loop_mode);
     void removeZone(int i);
-    void clearZones();
+    void setZones(const std::vector<jm::zone>& zones);
 };
 
 #endif
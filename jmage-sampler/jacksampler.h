@@ -23,7 +23,10 @@
 #include <cstdio>
 #include <vector>
 #include <map>
+#include <string>
+#include <atomic>
 #include <pthread.h>
+#include <semaphore.h>
 
 #include <jack/types.h>
 
@@ -33,35 +36,66 @@
 #include <lib/sfzparser.h>
 #include <lib/jmsampler.h>
 
-enum msg_type {
-MT_VOLUME,
-MT_CHANNEL
+class JackSampler;
+
+enum loader_state {
+  LOADER_LOADING,
+  LOADER_REFRESH,
+  LOADER_DONE
 };
 
-#define MSG_Q_SIZE 32
+// patches load in the background so the ui loop keeps going; one per part
+struct part_loader {
+  JackSampler* sampler;
+  int part;
+  pthread_t thread;
+  bool running;
+  // empty when the thread only refreshes waves
+  std::string path;
+  // LOADER_REFRESH asks for the part's waves to be reloaded once the load is
+  // done; the thread sets LOADER_DONE when it has checked
+  std::atomic<int> state;
+};
 
-struct jm_msg {
-  msg_type type;
-  union {
-    int i;
-    float f;
-  } data;
+// a connection commands come in on: the ui's pipe or a control socket client.
+// the engine's messages go back out on out
+struct control_client {
+  JackSampler* sampler;
+  int fd;
+  FILE* out;
+  pthread_t thread;
+  // set by the client thread on its way out
+  std::atomic<bool> done;
 };
 
 class JackSampler: public JMSampler {
   public:
     jack_port_t* input_port;
-    jack_port_t* output_port1;
-    jack_port_t* output_port2;
-    float _volume;
-    float _channel;
-    JMQueue<jm_msg> msg_q;
+    // left and right port per output bus
+    std::vector<jack_port_t*> output_ports;
+    std::vector<float*> out_bufs;
+    part_loader loaders[NUM_PARTS];
+    // posted from the process callback when a replaced patch can be freed
+    sem_t collect_sem;
+    pthread_t collector;
+    std::atomic<bool> collector_quit;
+    // commands from all clients are handled one batch at a time
+    pthread_mutex_t cmd_lock;
 
-    JackSampler(int sample_rate, size_t in_nframes, size_t out_nframes):
-        JMSampler(sample_rate, in_nframes, out_nframes), _volume(0), _channel(0),
-        msg_q(MSG_Q_SIZE) {
-      volume = &_volume;
-      channel = &_channel;
+    JackSampler(int sample_rate, size_t in_nframes, size_t out_nframes, int num_outputs, int control_frames):
+        JMSampler(sample_rate, in_nframes, out_nframes, num_outputs, control_frames),
+        output_ports(2 * num_outputs), out_bufs(2 * num_outputs),
+        collector_quit(false) {
+      for (int i = 0; i < NUM_PARTS; ++i) {
+        loaders[i].sampler = this;
+        loaders[i].part = i;
+        loaders[i].running = false;
+        loaders[i].state = LOADER_DONE;
+      }
+      pthread_mutex_init(&cmd_lock, NULL);
+    }
+    ~JackSampler() {
+      pthread_mutex_destroy(&cmd_lock);
     }
 };
 
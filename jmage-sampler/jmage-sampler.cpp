@@ -22,16 +22,24 @@ using std::cerr;
 using std::endl;
 
 #include <vector>
+#include <list>
 #include <map>
 
 #include <cstring>
 #include <cstdlib>
 #include <cstdio>
 #include <cmath>
+#include <cerrno>
+#include <stdexcept>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <signal.h>
 #include <pthread.h>
+#include <semaphore.h>
 
 #include <jack/types.h>
 #include <jack/jack.h>
@@ -43,6 +51,7 @@ using std::endl;
 #include <lib/zone.h>
 #include <lib/collections.h>
 #include <lib/sfzparser.h>
+#include <lib/uimsg.h>
 
 #include "jacksampler.h"
 
@@ -50,26 +59,11 @@ typedef jack_default_audio_sample_t sample_t;
 
 int process_callback(jack_nframes_t nframes, void* arg) {
   JackSampler* sampler = static_cast<JackSampler*>(arg);
-  sample_t* buffer1 = (sample_t*) jack_port_get_buffer(sampler->output_port1, nframes);
-  sample_t* buffer2 = (sample_t*) jack_port_get_buffer(sampler->output_port2, nframes);
-  memset(buffer1, 0, sizeof(sample_t) * nframes);
-  memset(buffer2, 0, sizeof(sample_t) * nframes);
-
-  // handle any UI messages
-  while (!sampler->msg_q.empty()) {
-    jm_msg msg = sampler->msg_q.remove();
-    switch (msg.type) {
-      case MT_VOLUME:
-        *sampler->volume = msg.data.f;
-        break;
-      case MT_CHANNEL:
-        *sampler->channel = msg.data.i;
-        break;
-      default:
-        break;
-    }
+  sampler->begin_cycle();
+  for (size_t i = 0; i < sampler->output_ports.size(); ++i) {
+    sampler->out_bufs[i] = (sample_t*) jack_port_get_buffer(sampler->output_ports[i], nframes);
+    memset(sampler->out_bufs[i], 0, sizeof(sample_t) * nframes);
   }
-  sampler->pre_process(nframes);
 
   // capture midi event
   void* midi_buf = jack_port_get_buffer(sampler->input_port, nframes);
@@ -80,29 +74,49 @@ int process_callback(jack_nframes_t nframes, void* arg) {
   if (event_count > 0)
     jack_midi_event_get(&event, midi_buf, cur_event);
 
+  // run the window as blocks the voice buffers can hold; only longer than
+  // one until buffers for a new jack buffer size are swapped in
+  size_t block = sampler->block_frames();
+  jack_nframes_t start = 0;
+  size_t len = 0;
+
   // loop over frames in this callback window
   for (jack_nframes_t n = 0; n < nframes; ++n) {
+    if (n == start + len) {
+      for (size_t i = 0; i < sampler->out_bufs.size(); ++i)
+        sampler->out_bufs[i] += len;
+      start = n;
+      len = nframes - n < block ? nframes - n: block;
+      sampler->pre_process(len);
+    }
+
     if (cur_event < event_count) {
       // procces next midi event if it applies to current time (frame)
       while (n == event.time) {
-        // only consider events from current channel
-        if ((event.buffer[0] & 0x0f) == *sampler->channel) {
-          // process note on
-          if ((event.buffer[0] & 0xf0) == 0x90) {
-            sampler->handle_note_on(event.buffer, nframes, n);
-          }
-          // process note off
-          else if ((event.buffer[0] & 0xf0) == 0x80) {
-            sampler->handle_note_off(event.buffer);
-          }
-          // process sustain pedal
-          else if ((event.buffer[0] & 0xf0) == 0xb0 && event.buffer[1] == 0x40) {
-            sampler->handle_sustain(event.buffer);
-          }
-          // just print messages we don't currently handle
-          //else if (event.buffer[0] != 0xfe)
-          //  printf("event: 0x%x\n", event.buffer[0]);
+        // parts pick out their own channels
+        // process note on
+        if ((event.buffer[0] & 0xf0) == 0x90) {
+          sampler->handle_note_on(event.buffer, len, n - start);
+        }
+        // process note off
+        else if ((event.buffer[0] & 0xf0) == 0x80) {
+          sampler->handle_note_off(event.buffer, len, n - start);
+        }
+        // process sustain pedal
+        else if ((event.buffer[0] & 0xf0) == 0xb0 && event.buffer[1] == 0x40) {
+          sampler->handle_sustain(event.buffer, len, n - start);
         }
+        // volume, expression and pan
+        else if ((event.buffer[0] & 0xf0) == 0xb0) {
+          sampler->handle_control(event.buffer);
+        }
+        // process pitch bend
+        else if ((event.buffer[0] & 0xf0) == 0xe0) {
+          sampler->handle_pitch_bend(event.buffer);
+        }
+        // just print messages we don't currently handle
+        //else if (event.buffer[0] != 0xfe)
+        //  printf("event: 0x%x\n", event.buffer[0]);
         // get next midi event or break if none left
         ++cur_event;
         if (cur_event == event_count)
@@ -110,182 +124,541 @@ int process_callback(jack_nframes_t nframes, void* arg) {
         jack_midi_event_get(&event, midi_buf, cur_event);
       }
     }
-    sampler->process_frame(n, buffer1, buffer2);
+    sampler->process_frame(n - start, &sampler->out_bufs[0]);
   }
 
+  // sem_post is safe here; freeing is left to the collector thread
+  if (sampler->take_retired())
+    sem_post(&sampler->collect_sem);
+
+  sampler->end_cycle(nframes);
   return 0;
 }
 
-int main() {
-  jack_client_t* client;
+// may run on the process thread; only records the size and leaves
+// building larger voice buffers to the collector
+int buffer_size_callback(jack_nframes_t nframes, void* arg) {
+  JackSampler* sampler = static_cast<JackSampler*>(arg);
+  sampler->set_buffer_size(nframes);
+  return 0;
+}
 
-  // init jack
-  jack_status_t status;
-  if ((client = jack_client_open("jmage-sampler", JackNullOption, &status)) == NULL) {
-    cerr << "failed to open jack client" << endl;
-    return 1;
+// entering or leaving jack's freewheel mode for exports
+void freewheel_callback(int starting, void* arg) {
+  JackSampler* sampler = static_cast<JackSampler*>(arg);
+  sampler->set_freewheel(starting != 0);
+}
+
+// frees patches the audio thread is done with
+static void* collect_thread(void* arg) {
+  JackSampler* sampler = static_cast<JackSampler*>(arg);
+
+  while (!sampler->collector_quit) {
+    if (sem_wait(&sampler->collect_sem) == 0)
+      sampler->collect_garbage();
   }
 
-  int sample_rate = jack_get_sample_rate(client);
+  return NULL;
+}
 
-  // supposed to also implement jack_set_buffer_size_callback; for now assume rarely changes
-  jack_nframes_t jack_buf_size = jack_get_buffer_size(client);
-  JackSampler* sampler = new JackSampler(sample_rate, jack_buf_size, jack_buf_size);
+static void* load_thread(void* arg) {
+  part_loader* loader = static_cast<part_loader*>(arg);
 
-  jack_set_process_callback(client, process_callback, sampler);
-  sampler->input_port = jack_port_register(client, "midi_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
-  sampler->output_port1 = jack_port_register(client, "out1", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
-  sampler->output_port2 = jack_port_register(client, "out2", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+  if (!loader->path.empty()) {
+    try {
+      loader->sampler->load_patch(loader->part, loader->path.c_str());
+    }
+    catch (std::runtime_error& e) {
+      cerr << "failed to load patch: " << e.what() << endl;
+    }
+  }
 
-  if (jack_activate(client)) {
-    jack_port_unregister(client, sampler->input_port);
-    jack_port_unregister(client, sampler->output_port1);
-    jack_port_unregister(client, sampler->output_port2);
-    jack_client_close(client);
-    delete sampler;
-    cerr <<"cannot activate jack client" << endl;
-    return 1;
+  // a refresh asked for during the load; clients carry on meanwhile
+  if (loader->state.exchange(LOADER_DONE) == LOADER_REFRESH) {
+    try {
+      loader->sampler->reload_waves(loader->part);
+    }
+    catch (std::runtime_error& e) {
+      cerr << "failed to refresh waves: " << e.what() << endl;
+    }
   }
-  
-  int from_child_pipe[2];
-  int to_child_pipe[2];
 
-  pipe(from_child_pipe);
-  pipe(to_child_pipe);
+  return NULL;
+}
 
-  pid_t pid = fork();
+// wait for any load in progress, optionally asking it to give up first
+static void join_loader(JackSampler* sampler, int part, bool cancel) {
+  part_loader& loader = sampler->loaders[part];
+  if (!loader.running)
+    return;
 
-  // i'm the child
-  if (pid == 0) {
-    dup2(from_child_pipe[1], 1);
-    close(from_child_pipe[0]);
+  if (cancel)
+    sampler->parts[part].cancel_load = true;
+  pthread_join(loader.thread, NULL);
+  loader.running = false;
+}
 
-    dup2(to_child_pipe[0], 0);
-    close(to_child_pipe[1]);
+static void unregister_ports(jack_client_t* client, JackSampler* sampler) {
+  jack_port_unregister(client, sampler->input_port);
+  for (size_t i = 0; i < sampler->output_ports.size(); ++i)
+    jack_port_unregister(client, sampler->output_ports[i]);
+}
 
-    execl(CONFIG_INSTALL_PREFIX "/libexec/jm-sampler-ui", "jm-sampler-ui", NULL);
+// starts a background load of path into part, replacing any still going
+static void start_load(JackSampler* sampler, int part, const std::string& path) {
+  // zones and the loader keep paths in MAX_PATH buffers
+  if (path.size() >= MAX_PATH) {
+    cerr << "patch path too long: " << path << endl;
+    return;
   }
-  // i'm the parent
-  close(from_child_pipe[1]);
-  close(to_child_pipe[0]);
-
-  FILE* fin = fdopen(from_child_pipe[0], "r");
-  FILE* fout = fdopen(to_child_pipe[1], "w");
-  sampler->fout = fout;
 
-  char buf[256];
+  part_loader& loader = sampler->loaders[part];
+  // no point refreshing the patch being replaced
+  int refresh = LOADER_REFRESH;
+  loader.state.compare_exchange_strong(refresh, LOADER_LOADING);
+  join_loader(sampler, part, true);
+
+  loader.path = path;
+  loader.state = LOADER_LOADING;
+  if (pthread_create(&loader.thread, NULL, load_thread, &loader) == 0)
+    loader.running = true;
+  else
+    cerr << "failed to start patch loader" << endl;
+}
 
-  fprintf(fout, "set_sample_rate:%i\n", sampler->sample_rate);
-  fflush(fout);
+// reloads part's waves on its loader thread, after any load still going
+static void start_refresh(JackSampler* sampler, int part) {
+  part_loader& loader = sampler->loaders[part];
+  int state = LOADER_LOADING;
+  if (loader.running && (loader.state.compare_exchange_strong(state, LOADER_REFRESH) ||
+      state == LOADER_REFRESH))
+    return;
+
+  // the last thread is finished or at most refreshing already
+  join_loader(sampler, part, false);
+
+  loader.path.clear();
+  loader.state = LOADER_REFRESH;
+  if (pthread_create(&loader.thread, NULL, load_thread, &loader) == 0)
+    loader.running = true;
+  else
+    cerr << "failed to start wave refresh" << endl;
+}
 
-  fprintf(fout, "update_vol:%f\n", *sampler->volume);
-  fflush(fout);
+// one command from a client; caller holds cmd_lock
+static void handle_msg(JackSampler* sampler, uint32_t type, jm::msg_reader& msg) {
+  //cerr << "UI: " << type << endl;
+  if (type == jm::MSG_UPDATE_VOL) {
+    sampler->set_volume(sampler->edit_part, msg.get_float());
+  }
+  else if (type == jm::MSG_UPDATE_CHAN) {
+    sampler->set_channel(sampler->edit_part, msg.get_int());
+  }
+  else if (type == jm::MSG_SELECT_PART) {
+    sampler->select_part(msg.get_int());
+  }
+  else if (type == jm::MSG_UPDATE_POLY) {
+    sampler->set_polyphony(sampler->edit_part, msg.get_int());
+  }
+  else if (type == jm::MSG_NEW_ZONE) {
+    int index = msg.get_int();
+    char path[MAX_PATH];
+    msg.get_str(path, MAX_PATH);
 
-  fprintf(fout, "update_chan:%i\n", (int) *sampler->channel);
-  fflush(fout);
+    sampler->add_zone_from_wave(sampler->edit_part, index, path);
+  }
+  else if (type == jm::MSG_DUP_ZONE) {
+    sampler->duplicate_zone(sampler->edit_part, msg.get_int());
+  }
+  else if (type == jm::MSG_REMOVE_ZONE) {
+    sampler->remove_zone(sampler->edit_part, msg.get_int());
+  }
+  else if (type == jm::MSG_UPDATE_ZONE) {
+    int index = msg.get_int();
+    int key = msg.get_int();
+    char val[MAX_PATH];
+    msg.get_str(val, MAX_PATH);
 
-  while (fgets(buf, 256, fin) != NULL) {
-    // kill newline char
-    buf[strlen(buf) - 1] = '\0';
-    //cerr << "UI: " << buf << endl;
-    if (!strncmp(buf, "update_vol:", 11)) {
-      jm_msg msg;
-      msg.type = MT_VOLUME;
-      msg.data.f = atof(buf + 11);
+    sampler->update_zone(sampler->edit_part, index, key, val);
+  }
+  else if (type == jm::MSG_LOAD_PATCH) {
+    start_load(sampler, sampler->edit_part, msg.get_str());
+  }
+  else if (type == jm::MSG_SAVE_PATCH) {
+    sampler->save_patch(msg.get_str().c_str());
+  }
+  else if (type == jm::MSG_REFRESH) {
+    // waves can't be swapped out from under the loader, so it refreshes
+    // them itself once done
+    start_refresh(sampler, sampler->edit_part);
+  }
+}
 
-      sampler->msg_q.add(msg);
+// reads batches of commands until the client goes away
+static void* client_thread(void* arg) {
+  control_client* client = static_cast<control_client*>(arg);
+  JackSampler* sampler = client->sampler;
+
+  // the newcomer needs the rate and the part being edited; anyone
+  // else attached just sees the part again
+  pthread_mutex_lock(&sampler->cmd_lock);
+  sampler->add_ui(client->out);
+  sampler->send_sample_rate();
+  sampler->select_part(sampler->edit_part);
+  pthread_mutex_unlock(&sampler->cmd_lock);
+
+  char buf[4096];
+  jm::msg_buffer in;
+
+  ssize_t n;
+  while ((n = read(client->fd, buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
     }
-    else if (!strncmp(buf, "update_chan:", 12)) {
-      jm_msg msg;
-      msg.type = MT_CHANNEL;
-      msg.data.i = atoi(buf + 12);
-
-      sampler->msg_q.add(msg);
+    in.append(buf, n);
+
+    // whatever arrived together is handled before another client's commands
+    uint32_t type;
+    const char* body;
+    size_t len;
+    pthread_mutex_lock(&sampler->cmd_lock);
+    while (in.next(&type, &body, &len)) {
+      jm::msg_reader msg(body, len);
+      // a bad wave or an unwritable patch fails the one command, not the daemon
+      try {
+        handle_msg(sampler, type, msg);
+      }
+      catch (std::runtime_error& e) {
+        cerr << "command failed: " << e.what() << endl;
+      }
     }
-    else if (!strncmp(buf, "add_zone:", 9)) {
-      char* p = strtok(buf + 9, ",");
-      int index = atoi(p);
-      p = strtok(NULL, ",");
+    pthread_mutex_unlock(&sampler->cmd_lock);
 
-      if (sampler->waves.find(p) == sampler->waves.end()) {
-        sampler->waves[p] = jm::parse_wave(p);
-      }
+    if (!in.ok)
+      break;
+  }
+
+  sampler->remove_ui(client->out);
+  client->done = true;
+
+  return NULL;
+}
+
+static control_client* start_client(JackSampler* sampler, int fd, FILE* out) {
+  control_client* client = new control_client;
+  client->sampler = sampler;
+  client->fd = fd;
+  client->out = out;
+  client->done = false;
+  if (pthread_create(&client->thread, NULL, client_thread, client) != 0) {
+    delete client;
+    return NULL;
+  }
+
+  return client;
+}
+
+// waits for the client thread to finish and closes its streams
+static void close_client(control_client* client) {
+  pthread_join(client->thread, NULL);
+  fclose(client->out);
+  close(client->fd);
+  delete client;
+}
+
+struct control_server {
+  JackSampler* sampler;
+  int fd;
+  std::list<control_client*> clients;
+};
+
+static int open_control_socket(const char* path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    cerr << "socket path too long: " << path << endl;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
 
-      sampler->add_zone_from_wave(index, p);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  // left over from a daemon that didn't get to clean up
+  unlink(path);
+  // anyone who can connect can load and write files as us; the socket is
+  // created owner only so there's no window before a chmod
+  mode_t old_mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+  int ret = bind(fd, (sockaddr*) &addr, sizeof(addr));
+  umask(old_mask);
+  if (ret != 0 || listen(fd, 8) != 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// closes clients that went away; all of them if all is set
+static void reap_clients(control_server* server, bool all) {
+  std::list<control_client*>::iterator it = server->clients.begin();
+  while (it != server->clients.end()) {
+    if (all)
+      shutdown((*it)->fd, SHUT_RDWR);
+    if (all || (*it)->done) {
+      close_client(*it);
+      it = server->clients.erase(it);
     }
-    else if (!strncmp(buf, "dup_zone:", 9)) {
-      char* p = strtok(buf + 9, ",");
-      int index = atoi(p);
-      sampler->duplicate_zone(index);
+    else
+      ++it;
+  }
+}
+
+// takes control clients until the listening socket is shut down
+static void* accept_thread(void* arg) {
+  control_server* server = static_cast<control_server*>(arg);
+
+  while (true) {
+    int fd = accept4(server->fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      break;
     }
-    else if (!strncmp(buf, "remove_zone:", 12)) {
-      int index = atoi(buf + 12);
-      sampler->remove_zone(index);
 
-      fprintf(fout, "remove_zone:%i\n", index);
-      fflush(fout);
+    reap_clients(server, false);
+
+    int out_fd = dup(fd);
+    FILE* out = out_fd >= 0 ? fdopen(out_fd, "w"): NULL;
+    control_client* client = out != NULL ? start_client(server->sampler, fd, out): NULL;
+    if (client == NULL) {
+      cerr << "failed to start control client" << endl;
+      if (out != NULL)
+        fclose(out);
+      else if (out_fd >= 0)
+        close(out_fd);
+      close(fd);
+      continue;
     }
-    else if (!strncmp(buf, "update_zone:", 12)) {
-      char* p = strtok(buf + 12, ",");
-      int index = atoi(p);
-      p = strtok(NULL, ",");
-      int key = atoi(p);
-
-      p = strtok(NULL, ",");
-
-      // special case, update wave
-      if (key == jm::ZONE_PATH) {
-        if (sampler->waves.find(p) == sampler->waves.end()) {
-          sampler->waves[p] = jm::parse_wave(p);
+    server->clients.push_back(client);
+  }
+
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  jack_client_t* client;
+
+  // number of stereo output buses zones can be routed to
+  int num_outputs = 1;
+  // frames between modulation updates; lower is smoother, higher is cheaper
+  int control_frames = CONTROL_FRAMES;
+  // convert waves to the jack rate as they load
+  bool convert_waves = false;
+  // where control clients connect, if anywhere
+  const char* socket_path = NULL;
+  // run without the ui
+  bool headless = false;
+  // trade voices for headroom when callbacks run long
+  bool governor = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:c:rs:ng")) != -1) {
+    switch (opt) {
+      case 'o':
+        num_outputs = atoi(optarg);
+        if (num_outputs < 1 || num_outputs > MAX_OUTPUTS) {
+          cerr << "outputs must be between 1 and " << MAX_OUTPUTS << endl;
+          return 1;
         }
-      }
+        break;
+      case 'c':
+        control_frames = atoi(optarg);
+        if (control_frames < 1 || control_frames > 256) {
+          cerr << "control frames must be between 1 and 256" << endl;
+          return 1;
+        }
+        break;
+      case 'r':
+        convert_waves = true;
+        break;
+      case 's':
+        socket_path = optarg;
+        break;
+      case 'n':
+        headless = true;
+        break;
+      case 'g':
+        governor = true;
+        break;
+      default:
+        cerr << "usage: " << argv[0] << " [-o outputs] [-c control_frames] [-r] [-s socket] [-n] [-g] [patch]" << endl;
+        return 1;
+    }
+  }
+  // loaded into the first part at startup
+  const char* patch_path = optind < argc ? argv[optind]: NULL;
+
+  // a client or ui that goes away mid write shouldn't take the engine with it
+  signal(SIGPIPE, SIG_IGN);
+
+  // as a daemon the engine runs until told to stop rather than until the ui
+  // exits; every thread started from here on leaves these to sigwait
+  bool as_daemon = socket_path != NULL || headless;
+  sigset_t stop_sigs;
+  sigemptyset(&stop_sigs);
+  sigaddset(&stop_sigs, SIGINT);
+  sigaddset(&stop_sigs, SIGTERM);
+  if (as_daemon)
+    pthread_sigmask(SIG_BLOCK, &stop_sigs, NULL);
+
+  control_server server;
+  server.fd = -1;
+  if (socket_path != NULL && (server.fd = open_control_socket(socket_path)) < 0)
+    return 1;
 
-      sampler->update_zone(index, key, p);
+  // init jack
+  jack_status_t status;
+  if ((client = jack_client_open("jmage-sampler", JackNullOption, &status)) == NULL) {
+    cerr << "failed to open jack client" << endl;
+    if (server.fd >= 0) {
+      close(server.fd);
+      unlink(socket_path);
     }
-    else if (!strncmp(buf, "load_patch:", 11)) {
-      sampler->load_patch(buf + 11);
+    return 1;
+  }
+  int sample_rate = jack_get_sample_rate(client);
 
-      fprintf(fout, "clear_zones\n");
-      fflush(fout);
+  jack_nframes_t jack_buf_size = jack_get_buffer_size(client);
+  JackSampler* sampler = new JackSampler(sample_rate, jack_buf_size, jack_buf_size, num_outputs, control_frames);
+  sampler->convert_waves = convert_waves;
+  sampler->set_governor(governor);
 
-      std::map<std::string, SFZValue>::iterator c_it = sampler->patch.control.find("jm_vol");
-      if (c_it != sampler->patch.control.end()) {
-        *sampler->volume = c_it->second.get_double();
-        *sampler->channel =  sampler->patch.control["jm_chan"].get_int() - 1;
-      }
-      else {
-        *sampler->volume = 0;
-        *sampler->channel = 0;
-      }
+  sem_init(&sampler->collect_sem, 0, 0);
+  pthread_create(&sampler->collector, NULL, collect_thread, sampler);
 
-      fprintf(fout, "update_vol:%f\n", *sampler->volume);
-      fflush(fout);
+  jack_set_process_callback(client, process_callback, sampler);
+  jack_set_buffer_size_callback(client, buffer_size_callback, sampler);
+  jack_set_freewheel_callback(client, freewheel_callback, sampler);
+  sampler->input_port = jack_port_register(client, "midi_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+  // bus n is out(2n + 1) and out(2n + 2) so the first keeps its old names
+  for (size_t i = 0; i < sampler->output_ports.size(); ++i) {
+    char name[16];
+    sprintf(name, "out%i", (int) i + 1);
+    sampler->output_ports[i] = jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+  }
 
-      fprintf(fout, "update_chan:%i\n", (int) *sampler->channel);
-      fflush(fout);
+  if (jack_activate(client)) {
+    unregister_ports(client, sampler);
+    jack_client_close(client);
+    sampler->collector_quit = true;
+    sem_post(&sampler->collect_sem);
+    pthread_join(sampler->collector, NULL);
+    sem_destroy(&sampler->collect_sem);
+    delete sampler;
+    cerr <<"cannot activate jack client" << endl;
+    if (server.fd >= 0) {
+      close(server.fd);
+      unlink(socket_path);
+    }
+    return 1;
+  }
+  
+  control_client* ui_client = NULL;
+  pid_t pid = -1;
 
-      int num_zones = sampler->zones.size();
+  if (!headless) {
+    int from_child_pipe[2];
+    int to_child_pipe[2];
 
-      for (int i = 0; i < num_zones; ++i)
-        sampler->send_add_zone(i);
-    }
-    else if (!strncmp(buf, "save_patch:", 11)) {
-      sampler->save_patch(buf + 11);
-    }
-    else if (!strncmp(buf, "refresh", 7)) {
-      sampler->reload_waves();
+    pipe(from_child_pipe);
+    pipe(to_child_pipe);
+
+    pid = fork();
+
+    // i'm the child
+    if (pid == 0) {
+      dup2(from_child_pipe[1], 1);
+      close(from_child_pipe[0]);
+
+      dup2(to_child_pipe[0], 0);
+      close(to_child_pipe[1]);
+
+      // exec keeps both of these
+      pthread_sigmask(SIG_UNBLOCK, &stop_sigs, NULL);
+      signal(SIGPIPE, SIG_DFL);
+
+      execl(CONFIG_INSTALL_PREFIX "/libexec/jm-sampler-ui", "jm-sampler-ui", NULL);
+      _exit(1);
     }
+    // i'm the parent
+    close(from_child_pipe[1]);
+    close(to_child_pipe[0]);
+
+    ui_client = start_client(sampler, from_child_pipe[0], fdopen(to_child_pipe[1], "w"));
+    if (ui_client == NULL)
+      cerr << "failed to start ui client" << endl;
+  }
+
+  if (patch_path != NULL) {
+    pthread_mutex_lock(&sampler->cmd_lock);
+    start_load(sampler, 0, patch_path);
+    pthread_mutex_unlock(&sampler->cmd_lock);
   }
 
-  fclose(fout);
-  waitpid(pid, NULL, 0);
+  pthread_t acceptor;
+  bool accepting = false;
+  if (server.fd >= 0) {
+    server.sampler = sampler;
+    accepting = pthread_create(&acceptor, NULL, accept_thread, &server) == 0;
+    if (!accepting)
+      cerr << "failed to start control socket" << endl;
+  }
+
+  // the ui alone keeps the old behavior of exiting along with it
+  if (as_daemon) {
+    int sig;
+    sigwait(&stop_sigs, &sig);
+  }
+  else if (ui_client != NULL)
+    pthread_join(ui_client->thread, NULL);
+
+  if (server.fd >= 0) {
+    // wakes accept up
+    shutdown(server.fd, SHUT_RDWR);
+    if (accepting)
+      pthread_join(acceptor, NULL);
+    close(server.fd);
+    unlink(socket_path);
+    reap_clients(&server, true);
+  }
+
+  if (ui_client != NULL) {
+    if (!ui_client->done)
+      kill(pid, SIGTERM);
+    close_client(ui_client);
+  }
+  if (pid > 0)
+    waitpid(pid, NULL, 0);
+
+  for (int i = 0; i < NUM_PARTS; ++i)
+    join_loader(sampler, i, true);
 
   jack_deactivate(client);
-  jack_port_unregister(client, sampler->input_port);
-  jack_port_unregister(client, sampler->output_port1);
-  jack_port_unregister(client, sampler->output_port2);
+  unregister_ports(client, sampler);
   jack_client_close(client);
 
+  sampler->collector_quit = true;
+  sem_post(&sampler->collect_sem);
+  pthread_join(sampler->collector, NULL);
+  sem_destroy(&sampler->collect_sem);
+
   delete sampler;
 
   return 0;
@@ -23,6 +23,10 @@
 #include <typeinfo>
 #include <iostream>
 #include <stdexcept>
+#include <atomic>
+
+// keeps the indices of JMRing on separate cache lines
+#define CACHE_LINE 64
 
 template<class T> class JMStack {
   private:
@@ -60,61 +64,63 @@ template<class T> size_t JMStack<T>::size() {
   return head + 1;
 }
 
-template<class T> class JMQueue {
+// single producer, single consumer ring; neither side ever waits on the other.
+// the producer publishes a slot with a release store of tail and the consumer
+// hands it back with a release store of head
+template<class T> class JMRing {
   private:
-    volatile size_t head;
-    volatile size_t tail;
     size_t length;
     T* arr;
+    char pad0[CACHE_LINE];
+    // consumer side
+    std::atomic<size_t> head;
+    char pad1[CACHE_LINE - sizeof(std::atomic<size_t>)];
+    // producer side
+    std::atomic<size_t> tail;
+    char pad2[CACHE_LINE - sizeof(std::atomic<size_t>)];
 
   public:
-    JMQueue(size_t length);
-    void add(const T& item);
-    T remove();
-    T* get_head_ptr();
-    T* inc_ptr(T const * p);
+    JMRing(size_t length);
+    ~JMRing();
+    // false if full
+    bool push(const T& item);
+    // false if empty
+    bool pop(T* item);
     bool empty();
-    ~JMQueue();
 };
 
-template<class T> JMQueue<T>::JMQueue(size_t length):
-  head(0), tail(0), length(length + 1) {
+template<class T> JMRing<T>::JMRing(size_t length):
+    length(length + 1), head(0), tail(0) {
   arr = new T[this->length];
 }
 
-template<class T> JMQueue<T>::~JMQueue() {
+template<class T> JMRing<T>::~JMRing() {
   delete [] arr;
 }
 
-template<class T> void JMQueue<T>::add(const T& item) {
-  arr[tail] = item;
-  tail = (tail + 1) % length;
-}
-
-template<class T> T JMQueue<T>::remove() {
-  if (head == tail)
-    throw std::runtime_error("empty queue!");
+template<class T> bool JMRing<T>::push(const T& item) {
+  size_t t = tail.load(std::memory_order_relaxed);
+  size_t next = (t + 1) % length;
+  if (next == head.load(std::memory_order_acquire))
+    return false;
 
-  T& item = arr[head];
-  head = (head + 1) % length;
-  return item;
+  arr[t] = item;
+  tail.store(next, std::memory_order_release);
+  return true;
 }
 
-template<class T> T* JMQueue<T>::get_head_ptr() {
-  if (head == tail)
-    return NULL;
-  return arr + head;
-}
+template<class T> bool JMRing<T>::pop(T* item) {
+  size_t h = head.load(std::memory_order_relaxed);
+  if (h == tail.load(std::memory_order_acquire))
+    return false;
 
-template<class T> T* JMQueue<T>::inc_ptr(T const * p) {
-  size_t new_off = (p - arr + 1) % length;
-  if (new_off == tail)
-    return NULL;
-  return arr + new_off;
+  *item = arr[h];
+  head.store((h + 1) % length, std::memory_order_release);
+  return true;
 }
 
-template<class T> bool JMQueue<T>::empty() {
-  return head == tail;
+template<class T> bool JMRing<T>::empty() {
+  return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
 }
 
 #endif
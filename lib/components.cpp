@@ -21,6 +21,7 @@
 #include <climits>
 #include <cmath>
 #include <cstring>
+#include <algorithm>
 
 #include <samplerate.h>
 
@@ -32,18 +33,24 @@
 //#define VELOCITY_BOOST 1.2f
 #define VELOCITY_BOOST 1.0f
 
-void AudioStream::init(const jm::zone& zone) {
+void AudioStream::init(const jm::zone& zone, int level) {
   loop_on = (zone.loop_mode == jm::LOOP_CONTINUOUS) ? true : false;
   crossfading = false;
   cf_timer = 0;
-  wave = zone.wave;
-  wave_length = zone.wave_length;
+  // zone offsets are in file frames; scale them to the wave as loaded,
+  // then shrink them with the level's rate
+  wave = level == 0 ? zone.wave: zone.mips[level - 1];
+  wave_length = zone.play_length >> level;
   num_channels = zone.num_channels;  
-  cur_frame = zone.start;
-  start = zone.start;
-  left = zone.left;
-  right = zone.right;
-  crossfade = zone.crossfade;
+  start = (int) (zone.start * zone.frame_scale) >> level;
+  left = (int) (zone.left * zone.frame_scale) >> level;
+  right = (int) (zone.right * zone.frame_scale) >> level;
+  if (right > wave_length)
+    right = wave_length;
+  if (start > right)
+    start = right;
+  cur_frame = start;
+  crossfade = zone.crossfade >> level;
 }
 
 int AudioStream::read(float* buf, int nframes) {
@@ -140,30 +147,63 @@ crossfading:
 
 Playhead::Playhead(JMStack<Playhead*>& playhead_pool, int sample_rate, size_t in_nframes, size_t out_nframes):
     playhead_pool(playhead_pool), sample_rate(sample_rate), in_nframes(in_nframes) {
+  keep_frames = in_nframes + QUALITY_HISTORY_FRAMES;
+  // reads go in after what was played until the end; then all but the
+  // last keep_frames are dropped
+  buf_frames = 2 * keep_frames + in_nframes;
   // buf size * 2 to make room for stereo
-  in_buf = new float[in_nframes * 2];
+  in_buf = new float[buf_frames * 2];
   out_buf = new float[out_nframes * 2];
+  xf_in_buf = new float[buf_frames * 2];
   int error;
   // have to always make it stereo since they are allocated in advance
-  //resampler = src_new(SRC_SINC_FASTEST, 2, &error);
-  //resampler = src_new(SRC_ZERO_ORDER_HOLD, 2, &error);
-  resampler = src_new(SRC_LINEAR, 2, &error);
+  resamplers[jm::QUALITY_LOW] = src_new(SRC_ZERO_ORDER_HOLD, 2, &error);
+  resamplers[jm::QUALITY_MID] = src_new(SRC_LINEAR, 2, &error);
+  resamplers[jm::QUALITY_HIGH] = src_new(SRC_SINC_FASTEST, 2, &error);
+  resamplers[jm::QUALITY_BEST] = NULL;
+  quality = wanted_quality = jm::QUALITY_MID;
+  src = resamplers[quality];
 }
 
 Playhead::~Playhead() {
-  src_delete(resampler);
+  for (int i = 0; i < jm::QUALITY_LEVELS; ++i) {
+    if (resamplers[i] != NULL)
+      src_delete(resamplers[i]);
+  }
   delete [] in_buf;
   delete [] out_buf;
+  delete [] xf_in_buf;
+}
+
+void Playhead::alloc_best() {
+  if (resamplers[jm::QUALITY_BEST] != NULL)
+    return;
+  int error;
+  resamplers[jm::QUALITY_BEST] = src_new(SRC_SINC_BEST_QUALITY, 2, &error);
 }
 
-void Playhead::init(const jm::zone& zone, int pitch) {
-  src_ratio = sample_rate / (double) zone.sample_rate;
+void Playhead::init(const jm::zone& zone, int pitch, int quality) {
   SoundGenerator::init(zone, pitch);
-  as.init(zone);
+  base_speed = pow(2, (pitch + zone.pitch_corr - zone.origin) / 12.);
+  // an octave or more up, read a decimated copy so the resampler keeps
+  // its ratio under 2 and pulls half as many frames per level
+  int level = 0;
+  while (level < zone.num_mips && base_speed >= 2. * (1 << level))
+    ++level;
+  src_ratio = sample_rate * (double) (1 << level) / zone.sample_rate;
+  as.init(zone, level);
   num_channels = zone.num_channels;
   state = PLAYING;
-  speed = pow(2, (pitch + zone.pitch_corr - zone.origin) / 12.);
+  speed = base_speed;
+  bend_up = zone.bend_up;
+  bend_down = zone.bend_down;
+  bend = 0.f;
+  pitch_mod = NULL;
+  control_frames = CONTROL_FRAMES;
+  copying = true;
   in_offset = 0;
+  src_pos = 0.;
+  last_ratio = 0.;
 
   num_read = as.read(in_buf, in_nframes);
   // if mono, just duplicate and interleave values
@@ -179,7 +219,12 @@ void Playhead::init(const jm::zone& zone, int pitch) {
   }
 
   last_iteration = false;
-  src_reset(resampler);
+  if (resamplers[quality] == NULL)
+    quality = jm::QUALITY_MID;
+  this->quality = wanted_quality = quality;
+  quality_frames = 0;
+  src = resamplers[quality];
+  src_reset(src);
 }
 
 void Playhead::pre_process(size_t nframes) {
@@ -187,8 +232,151 @@ void Playhead::pre_process(size_t nframes) {
 
   out_offset = 0;
 
+  double ratio = 1 / speed * src_ratio;
+  bool was_copying = copying;
+  // once off 1 the converter takes over for good
+  if (ratio != 1. || pitch_mod != NULL)
+    copying = false;
+
+  bool switching = wanted_quality != quality && resamplers[wanted_quality] != NULL
+    && (was_copying || quality_frames >= (size_t) (QUALITY_HOLD_MS * sample_rate / 1000));
+  if (switching && !was_copying)
+    change_quality(nframes, ratio);
+  else {
+    // nothing has gone through the converter yet, so there is nothing to fade
+    if (switching) {
+      quality = wanted_quality;
+      src = resamplers[quality];
+    }
+    // picks up exactly where the copy left off
+    if (was_copying && !copying)
+      prime(src_pos, pitch_mod == NULL ? ratio: ratio / pow(2, pitch_mod[0] / 1200.), nframes);
+    render_block(nframes, ratio);
+  }
+  if (switching)
+    quality_frames = 0;
+
+  quality_frames += nframes;
+  cur_frame = 0;
+}
+
+void Playhead::render_block(size_t nframes, double ratio) {
+  if (pitch_mod == NULL)
+    render(nframes, ratio);
+  else {
+    // one ratio per control period; src_process glides from each to the next
+    for (int t = 0; out_offset < nframes && !last_iteration; ++t) {
+      size_t end = (t + 1) * control_frames;
+      render(end < nframes ? end: nframes, ratio / pow(2, pitch_mod[t] / 1200.));
+    }
+  }
+}
+
+// frames the converter's output trails the input by, past its filter;
+// linear and hold look back to the frame before
+static int latency(int quality) {
+  return quality == jm::QUALITY_LOW || quality == jm::QUALITY_MID ? 1: 0;
+}
+
+// input frames the converter stepped over making made of wanted frames.
+// libsamplerate ramps from the ratio it last used to the new one across
+// the frames asked for, and carries on from wherever the ramp got to
+double Playhead::advance(long wanted, long made, double ratio) {
+  double from = last_ratio > 0. ? last_ratio: ratio;
+  last_ratio = from;
+  if (made == 0)
+    return 0.;
+  if (fabs(from - ratio) < 1e-10) {
+    last_ratio = ratio;
+    return made / ratio;
+  }
+
+  double step = (ratio - from) / wanted;
+  last_ratio = from + (made - 1) * step;
+  // sum of 1 / (from + k * step) for k < made, by the midpoint rule
+  return log((from + (made - .5) * step) / (from - .5 * step)) / step;
+}
+
+// reset src and run it over what was played before input time at, throwing
+// away what it makes of that, so its next frame is the one at at with its
+// filter already full. it's left stepping at ratio, for the next block to
+// ramp from as the last converter would have
+void Playhead::prime(double at, double ratio, size_t nframes) {
+  src_reset(src);
+  last_ratio = 0.;
+  // the stream is done; nothing left to line up
+  if (last_iteration) {
+    src_pos = in_offset;
+    return;
+  }
+
+  int from = (int) floor(at) - QUALITY_PRIME_FRAMES;
+  if (from < 0)
+    from = 0;
+  in_offset = from;
+  src_pos = from;
+
+  // stepping at just over or under ratio so the frames thrown away end
+  // exactly on at, then on at ratio proper
+  double span = at + latency(quality) - from;
+  long drop = (long) ceil(span * ratio - 1e-9);
+  if (drop <= 0)
+    return;
+
+  double prime_ratio = drop / span;
+  while (drop > 0 && !last_iteration) {
+    out_offset = 0;
+    render(drop < (long) nframes ? drop: nframes, prime_ratio);
+    drop -= out_offset;
+  }
+  out_offset = 0;
+  src_set_ratio(src, ratio);
+  last_ratio = ratio;
+}
+
+// the old converter plays the block from where the stream is, then the
+// stream is rewound and the new one is run up to the same spot and plays
+// the block and carries on; the two are faded across the start. the old
+// one plays all of it, not just the fade, so a bend ramps the same in both
+void Playhead::change_quality(size_t nframes, double ratio) {
+  size_t xf_frames = nframes < QUALITY_XF_FRAMES ? nframes: QUALITY_XF_FRAMES;
+  AudioStream saved_as = as;
+  memcpy(xf_in_buf, in_buf, 2 * num_read * sizeof(float));
+  int saved_read = num_read;
+  int saved_offset = in_offset;
+  bool saved_last = last_iteration;
+  double saved_pos = src_pos;
+  double saved_ratio = last_ratio;
+
+  render_block(nframes, ratio);
+  size_t old_frames = out_offset < xf_frames ? out_offset: xf_frames;
+  memcpy(xf_out_buf, out_buf, 2 * xf_frames * sizeof(float));
+
+  as = saved_as;
+  memcpy(in_buf, xf_in_buf, 2 * saved_read * sizeof(float));
+  num_read = saved_read;
+  in_offset = saved_offset;
+  last_iteration = saved_last;
+  memset(out_buf, 0, 2 * nframes * sizeof(float));
+  out_offset = 0;
+
+  double at = saved_pos - latency(quality);
+  quality = wanted_quality;
+  src = resamplers[quality];
+  prime(at, saved_ratio > 0. ? saved_ratio: ratio, nframes);
+  render_block(nframes, ratio);
+
+  for (size_t i = 0; i < old_frames; ++i) {
+    float t = (i + 1) / (float) (xf_frames + 1);
+    out_buf[2 * i] = (1.f - t) * xf_out_buf[2 * i] + t * out_buf[2 * i];
+    out_buf[2 * i + 1] = (1.f - t) * xf_out_buf[2 * i + 1] + t * out_buf[2 * i + 1];
+  }
+}
+
+// resample into out_buf until nframes have been produced or the wave ran out
+void Playhead::render(size_t nframes, double ratio) {
   SRC_DATA data;
-  data.src_ratio = 1 / speed * src_ratio;
+  data.src_ratio = ratio;
   //data.src_ratio = 1 / speed;
   data.end_of_input = 0;
 
@@ -198,37 +386,58 @@ void Playhead::pre_process(size_t nframes) {
     data.data_out = out_buf + 2 * out_offset;
     data.output_frames = nframes - out_offset;
 
-    src_process(resampler, &data);
-    out_offset += data.output_frames_gen;
-    in_offset += data.input_frames_used;
-
-    /* replace above 3 lines with this to compare pitch shift against pass through
-    int to_read = data.input_frames < data.output_frames ? data.input_frames : data.output_frames;
-    memcpy(data.data_out, data.data_in, 2 * to_read * sizeof(float));
-    out_offset += to_read;
-    in_offset += to_read;
-    */
+    if (copying) {
+      int to_read = data.input_frames < data.output_frames ? data.input_frames : data.output_frames;
+      memcpy(data.data_out, data.data_in, 2 * to_read * sizeof(float));
+      out_offset += to_read;
+      in_offset += to_read;
+      src_pos = in_offset;
+    }
+    else {
+      src_process(src, &data);
+      out_offset += data.output_frames_gen;
+      in_offset += data.input_frames_used;
+      src_pos += advance(data.output_frames, data.output_frames_gen, data.src_ratio);
+    }
 
     if (in_offset >= num_read) {
-      num_read = as.read(in_buf, in_nframes);
+      if (num_read + (int) in_nframes > buf_frames) {
+        int shift = num_read - keep_frames;
+        memmove(in_buf, in_buf + 2 * shift, 2 * keep_frames * sizeof(float));
+        num_read = keep_frames;
+        in_offset -= shift;
+        src_pos -= shift;
+      }
+
+      float* buf = in_buf + 2 * num_read;
+      int n = as.read(buf, in_nframes);
 
-      if (num_read == 0) {
+      if (n == 0) {
         last_iteration = true;
         break;
       }
       // if mono, just duplicate and interleave values
       // note above read is still valid, for mono we just read half the buffer
       if (num_channels == 1) {
-        for (int i = 0; i < num_read; ++i) {
-          in_buf[2 * (num_read - 1 - i)] = in_buf[num_read - 1 - i];
-          in_buf[2 * (num_read - 1 - i) + 1] = in_buf[num_read - 1 - i];
+        for (int i = 0; i < n; ++i) {
+          buf[2 * (n - 1 - i)] = buf[n - 1 - i];
+          buf[2 * (n - 1 - i) + 1] = buf[n - 1 - i];
         }
       }
 
-      in_offset = 0;
+      num_read += n;
     }
   }
-  cur_frame = 0;
+}
+
+void Playhead::set_bend(float bend) {
+  if (bend == this->bend)
+    return;
+  this->bend = bend;
+  // new ratio is picked up by the next src_process, which ramps to it
+  // across the block; the converter is never reset
+  float cents = bend >= 0.f ? bend * bend_up: -bend * bend_down;
+  speed = base_speed * pow(2, cents / 1200.);
 }
 
 void Playhead::inc() {
@@ -243,7 +452,7 @@ void Playhead::get_values(float* values) {
   values[1] = out_buf[2 * cur_frame + 1];
 }
 
-void AmpEnvGenerator::init(SoundGenerator* sg, const jm::zone& zone, int pitch, int velocity) {
+void AmpEnvGenerator::init(SoundGenerator* sg, const jm::zone& zone, int pitch, int velocity, float xf_gain) {
   SoundGenerator::init(zone, pitch);
   this->sg = sg;
   state = ATTACK;
@@ -255,7 +464,7 @@ void AmpEnvGenerator::init(SoundGenerator* sg, const jm::zone& zone, int pitch,
   timer = 0;
   env_rel_val = zone.sustain;
   float calc_amp = zone.amp * VELOCITY_BOOST * velocity / (float) MAX_VELOCITY;
-  amp = calc_amp > 1.0f ? 1.0f : calc_amp;
+  amp = (calc_amp > 1.0f ? 1.0f : calc_amp) * xf_gain;
 }
 
 void AmpEnvGenerator::inc() {
@@ -368,6 +577,303 @@ void AmpEnvGenerator::set_release() {
   state = RELEASE;
 }
 
+FilterBank::FilterBank(int sample_rate, size_t slots, int control_frames):
+    sample_rate(sample_rate), slots(slots), control_frames(control_frames), free_slots(slots), end(0) {
+  used = new bool[slots];
+  ctl = new control[slots];
+  a1 = new float[slots];
+  a2 = new float[slots];
+  a3 = new float[slots];
+  m0 = new float[slots];
+  m1 = new float[slots];
+  m2 = new float[slots];
+  for (int c = 0; c < 2; ++c) {
+    ic1eq[c] = new float[slots];
+    ic2eq[c] = new float[slots];
+    in[c] = new float[slots];
+    out[c] = new float[slots];
+  }
+
+  // pop lowest slots first so the active range stays short
+  for (int i = slots - 1; i >= 0; --i) {
+    used[i] = false;
+    free(i);
+  }
+}
+
+FilterBank::~FilterBank() {
+  delete [] used;
+  delete [] ctl;
+  delete [] a1;
+  delete [] a2;
+  delete [] a3;
+  delete [] m0;
+  delete [] m1;
+  delete [] m2;
+  for (int c = 0; c < 2; ++c) {
+    delete [] ic1eq[c];
+    delete [] ic2eq[c];
+    delete [] in[c];
+    delete [] out[c];
+  }
+}
+
+int FilterBank::alloc(const jm::zone& zone, int velocity) {
+  if (zone.cutoff <= 0.f || free_slots.size() == 0)
+    return -1;
+
+  int slot = free_slots.pop();
+  used[slot] = true;
+  if (slot >= end)
+    end = slot + 1;
+
+  control& c = ctl[slot];
+  c.cutoff = zone.cutoff * powf(2.f, zone.fil_veltrack * velocity / (127.f * 1200.f));
+  // 0 db resonance is butterworth
+  c.k = 1.f / (.70710678f * powf(10.f, zone.resonance / 20.f));
+  c.depth = zone.fileg_depth;
+  c.attack = zone.fileg_attack;
+  c.hold = zone.fileg_hold;
+  c.decay = zone.fileg_decay;
+  c.sustain = zone.fileg_sustain;
+  c.release = zone.fileg_release;
+  c.stage = ATTACK;
+  c.timer = 0;
+  c.level = 0.f;
+  c.rel_level = 0.f;
+  c.mod_cents = 0.f;
+
+  // out = m0 * in + m1 * band + m2 * low
+  m0[slot] = m1[slot] = m2[slot] = 0.f;
+  switch (zone.fil_type) {
+    case jm::FILTER_LPF_2P:
+      m2[slot] = 1.f;
+      break;
+    case jm::FILTER_HPF_2P:
+      m0[slot] = 1.f;
+      m1[slot] = -c.k;
+      m2[slot] = -1.f;
+      break;
+    case jm::FILTER_BPF_2P:
+      m1[slot] = c.k;
+      break;
+    case jm::FILTER_BRF_2P:
+      m0[slot] = 1.f;
+      m1[slot] = -c.k;
+      break;
+  }
+
+  for (int ch = 0; ch < 2; ++ch) {
+    ic1eq[ch][slot] = 0.f;
+    ic2eq[ch][slot] = 0.f;
+  }
+  set_cutoff(slot, c.cutoff);
+  update(slot, false);
+  return slot;
+}
+
+void FilterBank::free(int slot) {
+  used[slot] = false;
+  // idle slots inside the active range still run; keep them silent
+  for (int c = 0; c < 2; ++c) {
+    in[c][slot] = 0.f;
+    ic1eq[c][slot] = 0.f;
+    ic2eq[c][slot] = 0.f;
+  }
+  free_slots.push(slot);
+
+  while (end > 0 && !used[end - 1])
+    --end;
+}
+
+void FilterBank::set_cutoff(int slot, float cutoff) {
+  float max = .45f * sample_rate;
+  if (cutoff > max)
+    cutoff = max;
+  else if (cutoff < 10.f)
+    cutoff = 10.f;
+
+  float g = tanf(M_PI * cutoff / sample_rate);
+  a1[slot] = 1.f / (1.f + g * (g + ctl[slot].k));
+  a2[slot] = g * a1[slot];
+  a3[slot] = g * a2[slot];
+}
+
+void FilterBank::update(int slot, bool released, float mod_cents) {
+  control& c = ctl[slot];
+  // without envelope depth or modulation the coefficients never move
+  if (c.depth == 0 && mod_cents == c.mod_cents)
+    return;
+  c.mod_cents = mod_cents;
+
+  if (released && c.stage != RELEASE) {
+    c.rel_level = c.level;
+    c.stage = RELEASE;
+    c.timer = 0;
+  }
+
+  // fall through every stage whose time ran out
+  if (c.stage == ATTACK && c.timer >= c.attack) {
+    c.timer -= c.attack;
+    c.stage = HOLD;
+  }
+  if (c.stage == HOLD && c.timer >= c.hold) {
+    c.timer -= c.hold;
+    c.stage = DECAY;
+  }
+  if (c.stage == DECAY && c.timer >= c.decay)
+    c.stage = SUSTAIN;
+
+  switch (c.stage) {
+    case ATTACK:
+      c.level = c.timer / (float) c.attack;
+      break;
+    case HOLD:
+      c.level = 1.f;
+      break;
+    case DECAY:
+      c.level = 1.f - (1.f - c.sustain) * c.timer / (float) c.decay;
+      break;
+    case SUSTAIN:
+      c.level = c.sustain;
+      break;
+    case RELEASE:
+      c.level = c.timer >= c.release ? 0.f: c.rel_level * (1.f - c.timer / (float) c.release);
+      break;
+  }
+  c.timer += control_frames;
+
+  set_cutoff(slot, c.cutoff * powf(2.f, (c.depth * c.level + mod_cents) / 1200.f));
+}
+
+void FilterBank::process() {
+  // trapezoidal state variable filter, one slot per voice
+  for (int c = 0; c < 2; ++c) {
+    const float* x = in[c];
+    float* y = out[c];
+    float* s1 = ic1eq[c];
+    float* s2 = ic2eq[c];
+    for (int i = 0; i < end; ++i) {
+      float v3 = x[i] - s2[i];
+      float v1 = a1[i] * s1[i] + a2[i] * v3;
+      float v2 = s2[i] + a2[i] * s1[i] + a3[i] * v3;
+      s1[i] = 2.f * v1 - s1[i];
+      s2[i] = 2.f * v2 - s2[i];
+      y[i] = m0[i] * x[i] + m1[i] * v1 + m2[i] * v2;
+    }
+  }
+}
+
+ModBank::ModBank(int sample_rate, int control_frames, size_t max_nframes, size_t slots):
+    sample_rate(sample_rate), control_frames(control_frames),
+    stride(max_nframes / control_frames + 2), slots(slots), free_slots(slots) {
+  ctl = new control[slots];
+  alloc_arrays(max_nframes, &pitch, &amp, &cutoff);
+  offset = new size_t[slots];
+  for (int i = slots - 1; i >= 0; --i)
+    free_slots.push(i);
+}
+
+ModBank::~ModBank() {
+  delete [] ctl;
+  delete [] pitch;
+  delete [] amp;
+  delete [] cutoff;
+  delete [] offset;
+}
+
+void ModBank::alloc_arrays(size_t max_nframes, float** pitch, float** amp, float** cutoff) const {
+  size_t len = slots * (max_nframes / control_frames + 2);
+  *pitch = new float[len];
+  *amp = new float[len];
+  *cutoff = new float[len];
+}
+
+void ModBank::swap_arrays(float** pitch, float** amp, float** cutoff, size_t max_nframes) {
+  std::swap(this->pitch, *pitch);
+  std::swap(this->amp, *amp);
+  std::swap(this->cutoff, *cutoff);
+  stride = max_nframes / control_frames + 2;
+}
+
+int ModBank::alloc(const jm::zone& zone, int velocity) {
+  bool amplfo = zone.amplfo.freq > 0.f && (zone.amplfo.depth != 0.f || zone.amplfo.depthcc1 != 0.f);
+  bool pitchlfo = zone.pitchlfo.freq > 0.f && (zone.pitchlfo.depth != 0.f || zone.pitchlfo.depthcc1 != 0.f);
+  bool fillfo = zone.fillfo.freq > 0.f && (zone.fillfo.depth != 0.f || zone.fillfo.depthcc1 != 0.f);
+  bool pitcheg = zone.pitcheg.depth != 0 || zone.pitcheg.vel2depth != 0;
+  if (!(amplfo || pitchlfo || fillfo || pitcheg) || free_slots.size() == 0)
+    return -1;
+
+  int slot = free_slots.pop();
+  control& c = ctl[slot];
+  c.amplfo = zone.amplfo;
+  c.pitchlfo = zone.pitchlfo;
+  c.fillfo = zone.fillfo;
+  c.pitcheg = zone.pitcheg;
+  c.velocity = velocity;
+  c.time = 0;
+  c.rel_time = -1;
+  c.rel_level = 0.f;
+  return slot;
+}
+
+float ModBank::lfo(const jm::lfo_params& lfo, int time) {
+  if (lfo.freq <= 0.f || time < lfo.delay)
+    return 0.f;
+  double phase = lfo.freq * (time - lfo.delay) / sample_rate;
+  return sinf(2. * M_PI * (phase - floor(phase)));
+}
+
+// linear envelope as a function of voice time
+float ModBank::eg(const control& c, int time) {
+  const jm::eg_params& e = c.pitcheg;
+  if (c.rel_time >= 0 && time >= c.rel_time) {
+    int t = time - c.rel_time;
+    return t >= e.release ? 0.f: c.rel_level * (1.f - t / (float) e.release);
+  }
+  if (time < e.attack)
+    return time / (float) e.attack;
+  time -= e.attack;
+  if (time < e.hold)
+    return 1.f;
+  time -= e.hold;
+  if (time < e.decay)
+    return 1.f - (1.f - e.sustain) * time / (float) e.decay;
+  return e.sustain;
+}
+
+void ModBank::run(int slot, size_t nframes, size_t offset, float mod_wheel, bool released) {
+  control& c = ctl[slot];
+  if (released && c.rel_time < 0) {
+    c.rel_level = eg(c, c.time);
+    c.rel_time = c.time;
+  }
+
+  this->offset[slot] = offset;
+  size_t len = nframes - offset;
+  size_t ticks = (len + control_frames - 1) / control_frames;
+  if (ticks > stride - 1)
+    ticks = stride - 1;
+
+  float amp_depth = c.amplfo.depth + c.amplfo.depthcc1 * mod_wheel;
+  float pitch_depth = c.pitchlfo.depth + c.pitchlfo.depthcc1 * mod_wheel;
+  float fil_depth = c.fillfo.depth + c.fillfo.depthcc1 * mod_wheel;
+  float eg_depth = c.pitcheg.depth + c.pitcheg.vel2depth * c.velocity / 127.f;
+  float* p = pitch + slot * stride;
+  float* a = amp + slot * stride;
+  float* f = cutoff + slot * stride;
+  // every tick plus the point the block ends on, so amp can interpolate up to it
+  for (size_t t = 0; t <= ticks; ++t) {
+    int time = c.time + t * control_frames;
+    p[t] = pitch_depth * lfo(c.pitchlfo, time);
+    if (eg_depth != 0.f)
+      p[t] += eg_depth * eg(c, time);
+    a[t] = amp_depth != 0.f ? powf(10.f, amp_depth * lfo(c.amplfo, time) / 20.f): 1.f;
+    f[t] = fil_depth * lfo(c.fillfo, time);
+  }
+  c.time += len;
+}
+
 SoundGenList::SoundGenList(size_t length): 
   head(NULL), tail(NULL), length(length), m_size(0), unused(length) {
 
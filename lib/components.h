@@ -25,6 +25,32 @@
 #include "zone.h"
 #include "collections.h"
 
+// default frames between evaluations of modulation, filter envelopes and coefficients
+#define CONTROL_FRAMES 32
+// a voice changing converters fades from the old to the new over this many frames
+#define QUALITY_XF_FRAMES 64
+// and keeps the new one at least this long
+#define QUALITY_HOLD_MS 50
+// played frames a voice keeps, past a block's worth a converter may have
+// read ahead, for a new converter to run up over
+#define QUALITY_HISTORY_FRAMES 1024
+// how far behind where it takes over a new converter starts; enough to
+// fill the sinc filters at ordinary ratios
+#define QUALITY_PRIME_FRAMES 256
+
+namespace jm {
+  struct patch;
+
+  // converters a voice can play through, cheapest first
+  enum quality {
+    QUALITY_LOW, // zero order hold
+    QUALITY_MID, // linear
+    QUALITY_HIGH, // fastest sinc
+    QUALITY_BEST, // best sinc, for rendering off line
+    QUALITY_LEVELS
+  };
+};
+
 class AudioStream {
   private:
     bool loop_on;
@@ -45,7 +71,8 @@ class AudioStream {
     int crossfade;
 
   public:
-    void init(const jm::zone& zone);
+    // level 0 plays the wave itself, n plays mips[n - 1]
+    void init(const jm::zone& zone, int level = 0);
     int read(float* buf, int nframes);
 };
 
@@ -53,19 +80,44 @@ class SoundGenerator {
   public:
     bool note_off;
     bool one_shot;
+    // started by note off; counted against the release reserve
+    bool release_trigger;
     int pitch;
     int off_group;
+    // patch and part the voice was started from
+    jm::patch* patch;
+    int part;
+    // stereo bus the voice mixes into
+    int output;
+    // slot in the filter bank or -1 if unfiltered
+    int filter;
+    // slot in the mod bank or -1 if unmodulated
+    int mod;
     virtual ~SoundGenerator(){}
     void init(const jm::zone& zone, int pitch) {
       note_off = false;
-      one_shot = (zone.loop_mode == jm::LOOP_ONE_SHOT) ? true : false;
+      release_trigger = zone.trigger == jm::TRIGGER_RELEASE;
+      // the key is already up for a release sample, so note off never applies
+      one_shot = (zone.loop_mode == jm::LOOP_ONE_SHOT || release_trigger) ? true : false;
       off_group = zone.off_group;
       this->pitch = pitch;
     }
     virtual void pre_process(size_t /*nframes*/){}
+    // bend in [-1, 1]; takes effect from the next pre_process
+    virtual void set_bend(float /*bend*/){}
+    // cents per control period of the coming block, from the mod bank; NULL for none
+    virtual void set_pitch_mod(const float* /*cents*/, int /*control_frames*/){}
+    // converter to play through from the next pre_process, see jm::quality
+    virtual void set_quality(int /*quality*/){}
     virtual void inc() = 0;
     virtual void get_values(float* values) = 0;
     virtual void set_release() = 0;
+    // quick release regardless of envelope settings
+    virtual void fade_out(int /*nframes*/) {set_release();}
+    virtual bool is_released() {return false;}
+    // rough gain, counting a voice still rising as already at its peak; for
+    // picking the least audible voice to cut or to play cheaply
+    virtual float level() {return 1.f;}
     virtual bool is_finished() = 0;
     virtual void release_resources() = 0;
 };
@@ -81,27 +133,77 @@ class Playhead: public SoundGenerator {
     int sample_rate;
     size_t in_nframes;
     AudioStream as;
-    SRC_STATE* resampler;
+    // one per jm::quality; the best is NULL until alloc_best
+    SRC_STATE* resamplers[jm::QUALITY_LEVELS];
+    // whichever this voice plays through
+    SRC_STATE* src;
+    int quality;
+    int wanted_quality;
+    // frames played since the converter last changed
+    size_t quality_frames;
+    // input as read; frames already played stay in front of in_offset, at
+    // least keep_frames of them once the stream has got that far
     float* in_buf;
+    int buf_frames;
+    int keep_frames;
     float* out_buf;
+    // where the stream was and what the old converter made of the start of
+    // the block, while fading to another
+    float* xf_in_buf;
+    // in_buf frame the converter's next output is taken at, before its
+    // latency, and the ratio it last stepped at; kept as libsamplerate
+    // keeps them so a new converter can be lined up with the old
+    double src_pos;
+    double last_ratio;
+    float xf_out_buf[2 * QUALITY_XF_FRAMES];
     double speed;
+    // speed at no bend
+    double base_speed;
+    int bend_up;
+    int bend_down;
+    float bend;
     int num_channels; // only implemented to handle 1 or 2 channels
     int in_offset;
     int num_read;
     size_t out_offset;
     bool last_iteration;
     size_t cur_frame;
+    const float* pitch_mod;
+    int control_frames;
+    // plain copy while the ratio has stayed at 1 since note on
+    bool copying;
+
+    void render(size_t nframes, double ratio);
+    void render_block(size_t nframes, double ratio);
+    double advance(long wanted, long made, double ratio);
+    void prime(double at, double ratio, size_t nframes);
+    void change_quality(size_t nframes, double ratio);
 
   public:
     Playhead(JMStack<Playhead*>& playhead_pool, int sample_rate, size_t in_nframes, size_t out_nframes);
     ~Playhead();
-    void init(const jm::zone& zone, int pitch);
+    // QUALITY_BEST falls back to linear if alloc_best wasn't called
+    void init(const jm::zone& zone, int pitch, int quality = jm::QUALITY_MID);
+    // large; not for the audio thread
+    void alloc_best();
     void pre_process(size_t nframes);
+    void set_bend(float bend);
+    void set_pitch_mod(const float* cents, int control_frames) {
+      pitch_mod = cents;
+      this->control_frames = control_frames;
+    }
+    void set_quality(int quality) {wanted_quality = quality;}
     void inc();
     void get_values(float* values);
     void set_release() {state = FINISHED;}
     bool is_finished(){return state == FINISHED;}
     void release_resources() {playhead_pool.push(this);}
+    // hand over a stereo output buffer for longer blocks; returns the old one
+    float* swap_out_buf(float* buf) {
+      float* old = out_buf;
+      out_buf = buf;
+      return old;
+    }
 };
 
 class AmpEnvGenerator: public SoundGenerator {
@@ -128,15 +230,140 @@ class AmpEnvGenerator: public SoundGenerator {
     float get_env_val();
   public:
     AmpEnvGenerator(JMStack<AmpEnvGenerator*>& amp_gen_pool): amp_gen_pool(amp_gen_pool) {}
-    void init(SoundGenerator* sg, const jm::zone& zone, int pitch, int velocity);
+    // xf_gain is the zone's crossfade gain at this key and velocity
+    void init(SoundGenerator* sg, const jm::zone& zone, int pitch, int velocity, float xf_gain = 1.f);
     void pre_process(size_t nframes) {sg->pre_process(nframes);}
+    void set_bend(float bend) {sg->set_bend(bend);}
+    void set_pitch_mod(const float* cents, int control_frames) {sg->set_pitch_mod(cents, control_frames);}
+    void set_quality(int quality) {sg->set_quality(quality);}
     void inc();
     void get_values(float* values);
     void set_release();
+    void fade_out(int nframes) {set_release(); release = nframes;}
+    bool is_released() {return state == RELEASE || state == FINISHED;}
+    float level() {return state < DECAY ? amp: amp * get_env_val();}
     bool is_finished(){return state == FINISHED;}
     void release_resources() {sg->release_resources(); amp_gen_pool.push(this);}
 };
 
+// state variable filters of every voice, kept as structure of arrays so
+// process runs all of them in one loop over slots the compiler can vectorize
+class FilterBank {
+  private:
+    enum Stage {
+      ATTACK,
+      HOLD,
+      DECAY,
+      SUSTAIN,
+      RELEASE
+    };
+    // per voice control state, only touched at control rate
+    struct control {
+      float cutoff;
+      float k;
+      int depth;
+      int attack;
+      int hold;
+      int decay;
+      float sustain;
+      int release;
+      Stage stage;
+      int timer;
+      float level;
+      float rel_level;
+      float mod_cents;
+    };
+    int sample_rate;
+    size_t slots;
+    int control_frames;
+    JMStack<int> free_slots;
+    bool* used;
+    control* ctl;
+    // integrator state per channel
+    float* ic1eq[2];
+    float* ic2eq[2];
+    // coefficients and output mix per slot
+    float* a1;
+    float* a2;
+    float* a3;
+    float* m0;
+    float* m1;
+    float* m2;
+
+    void set_cutoff(int slot, float cutoff);
+  public:
+    // voices write their input here and read their output back after process
+    float* in[2];
+    float* out[2];
+    // slots from here on are idle; process stops at it
+    int end;
+    FilterBank(int sample_rate, size_t slots, int control_frames);
+    ~FilterBank();
+    // returns -1 if the zone is unfiltered
+    int alloc(const jm::zone& zone, int velocity);
+    void free(int slot);
+    // control rate; advance the envelope and recompute coefficients.
+    // mod_cents is the cutoff shift from the mod bank
+    void update(int slot, bool released, float mod_cents = 0.f);
+    void process();
+};
+
+// lfos and the pitch envelope of every voice. run evaluates a voice's
+// sources once per control period of a block into plain arrays that the
+// playhead, mixer and filter bank read; nothing here runs per sample
+class ModBank {
+  private:
+    struct control {
+      jm::lfo_params amplfo;
+      jm::lfo_params pitchlfo;
+      jm::lfo_params fillfo;
+      jm::eg_params pitcheg;
+      int velocity;
+      // frames since the voice started and when it was released, or -1
+      int time;
+      int rel_time;
+      float rel_level;
+    };
+    int sample_rate;
+    int control_frames;
+    // values per slot; one per control period of the longest block plus the end point
+    size_t stride;
+    size_t slots;
+    JMStack<int> free_slots;
+    control* ctl;
+
+    float lfo(const jm::lfo_params& lfo, int time);
+    float eg(const control& c, int time);
+  public:
+    float* pitch;
+    float* amp;
+    float* cutoff;
+    // block frame the slot's values start at
+    size_t* offset;
+    ModBank(int sample_rate, int control_frames, size_t max_nframes, size_t slots);
+    ~ModBank();
+    // returns -1 if the zone has no modulation
+    int alloc(const jm::zone& zone, int velocity);
+    void free(int slot) {free_slots.push(slot);}
+    // evaluate the block from block frame offset to nframes; mod_wheel in [0, 1]
+    void run(int slot, size_t nframes, size_t offset, float mod_wheel, bool released);
+    const float* pitch_of(int slot) {return pitch + slot * stride;}
+    // arrays sized for blocks of max_nframes; safe off the audio thread
+    void alloc_arrays(size_t max_nframes, float** pitch, float** amp, float** cutoff) const;
+    // audio thread only; hands the old arrays back through the arguments.
+    // voices must refetch pitch_of afterwards
+    void swap_arrays(float** pitch, float** amp, float** cutoff, size_t max_nframes);
+    // index of the control period block frame falls in
+    size_t tick(int slot, size_t frame) {return (frame - offset[slot]) / control_frames;}
+    // amp interpolated between control periods
+    float amp_at(int slot, size_t frame) {
+      size_t local = frame - offset[slot];
+      const float* a = amp + slot * stride + local / control_frames;
+      return a[0] + (a[1] - a[0]) * (local % control_frames) / control_frames;
+    }
+    float cutoff_at(int slot, size_t frame) {return cutoff[slot * stride + tick(slot, frame)];}
+};
+
 struct sg_list_el {
   SoundGenerator* sg;
   sg_list_el* next;
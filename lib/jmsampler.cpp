@@ -17,12 +17,19 @@
 
 *****************************************************************************/
 
+#include <algorithm>
 #include <vector>
+#include <map>
+#include <set>
+#include <string>
 #include <fstream>
 
 #include <cmath>
 #include <cstdlib>
 #include <cstdio>
+#include <cerrno>
+#include <climits>
+#include <ctime>
 #include <iostream>
 using std::cerr;
 using std::endl;
@@ -30,39 +37,248 @@ using std::endl;
 #include <stdexcept> 
 
 #include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
 
 #include "zone.h"
 #include "wave.h"
 #include "sfzparser.h"
+#include "jmzb.h"
 #include "collections.h"
 #include "components.h"
 #include "jmsampler.h"
 
-JMSampler::JMSampler(int sample_rate, size_t in_nframes, size_t out_nframes):
-    zone_number(1),
-    sustain_on(false),
-    solo_count(0),
+// set between begin_cycle and end_cycle on the thread running the callback;
+// a worker the host runs inline from there can't wait on the control queue
+static thread_local bool in_cycle = false;
+
+static jm::patch* new_patch() {
+  jm::patch* p = new jm::patch;
+  p->solo_count = 0;
+  p->voices = 0;
+  p->dead = false;
+  return p;
+}
+
+// the number after the highest "Zone N" name zones were given, so new
+// zones don't repeat one
+static int next_zone_number(const std::vector<jm::zone>& zones) {
+  int next = 1;
+  std::vector<jm::zone>::const_iterator it;
+  for (it = zones.begin(); it != zones.end(); ++it) {
+    int n;
+    char rest;
+    if (sscanf(it->name, "Zone %d%c", &n, &rest) == 1 && n >= next)
+      next = n + 1;
+  }
+  return next;
+}
+
+// scalar fields of a zone edit; the same on the ui's patch and the audio thread's
+static void edit_zone(jm::patch* patch, const jm::ctl_msg& msg) {
+  if (msg.index < 0 || msg.index >= (int) patch->zones.size())
+    return;
+
+  jm::zone& zone = patch->zones[msg.index];
+  switch (msg.key) {
+    case jm::ZONE_AMP:
+      zone.amp = msg.data.d;
+      break;
+    case jm::ZONE_MUTE:
+      zone.mute = msg.data.i;
+      break;
+    case jm::ZONE_SOLO:
+      if ((zone.solo != 0) != (msg.data.i != 0))
+        msg.data.i ? ++patch->solo_count: --patch->solo_count;
+      zone.solo = msg.data.i;
+      break;
+    case jm::ZONE_ORIGIN:
+      zone.origin = msg.data.i;
+      break;
+    case jm::ZONE_LOW_KEY:
+      zone.low_key = msg.data.i;
+      break;
+    case jm::ZONE_HIGH_KEY:
+      zone.high_key = msg.data.i;
+      break;
+    case jm::ZONE_LOW_VEL:
+      zone.low_vel = msg.data.i;
+      break;
+    case jm::ZONE_HIGH_VEL:
+      zone.high_vel = msg.data.i;
+      break;
+    case jm::ZONE_PITCH:
+      zone.pitch_corr = msg.data.d;
+      break;
+    case jm::ZONE_START:
+      zone.start = msg.data.i;
+      break;
+    case jm::ZONE_LEFT:
+      zone.left = msg.data.i;
+      break;
+    case jm::ZONE_RIGHT:
+      zone.right = msg.data.i;
+      break;
+    case jm::ZONE_LOOP_MODE:
+      zone.loop_mode = (jm::loop_mode) msg.data.i;
+      break;
+    case jm::ZONE_CROSSFADE:
+      zone.crossfade = msg.data.i;
+      break;
+    case jm::ZONE_GROUP:
+      zone.group = msg.data.i;
+      break;
+    case jm::ZONE_OFF_GROUP:
+      zone.off_group = msg.data.i;
+      break;
+    case jm::ZONE_OUTPUT:
+      zone.output = msg.data.i;
+      break;
+    case jm::ZONE_ATTACK:
+      zone.attack = msg.data.i;
+      break;
+    case jm::ZONE_HOLD:
+      zone.hold = msg.data.i;
+      break;
+    case jm::ZONE_DECAY:
+      zone.decay = msg.data.i;
+      break;
+    case jm::ZONE_SUSTAIN:
+      zone.sustain = msg.data.d;
+      break;
+    case jm::ZONE_RELEASE:
+      zone.release = msg.data.i;
+      break;
+  }
+}
+
+JMSampler::JMSampler(int sample_rate, size_t in_nframes, size_t out_nframes, int num_outputs,
+    int control_frames):
     sound_gens(POLYPHONY),
+    filters(sample_rate, POLYPHONY, control_frames),
+    mods(sample_rate, control_frames, out_nframes, POLYPHONY),
+    retired(false),
+    block_time(0),
+    next_block_time(0),
+    release_voices(0),
+    last_nframes(0),
+    max_nframes(out_nframes),
+    wanted_nframes(out_nframes),
+    built_nframes(out_nframes),
+    growing(false),
+    pending_scratch(NULL),
+    old_scratch(NULL),
+    wanted_freewheel(false),
+    freewheel(false),
+    load_avg(0.f),
+    load_peak(0.f),
+    peak_frames(0),
+    cap_frames(0),
+    voice_cap(POLYPHONY),
+    steals(0),
+    high_level(0.f),
+    mid_level(0.f),
+    governor(false),
+    pub_load(0.f),
+    pub_peak(0.f),
+    pub_voices(0),
+    pub_cap(POLYPHONY),
+    pub_steals(0),
+    cycles(0),
+    ctl_q(CTL_QUEUE_SIZE),
+    ui_q(UI_QUEUE_SIZE),
+    ui_quit(false),
+    ui_gen(0),
     playhead_pool(POLYPHONY),
     amp_gen_pool(POLYPHONY),
-    fout(NULL),
-    sample_rate(sample_rate) {
-  // pre-allocate vector to prevent allocations later in RT thread
-  zones.reserve(100);
+    decode_quit(false),
+    sample_rate(sample_rate),
+    num_outputs(num_outputs),
+    control_frames(control_frames),
+    convert_waves(false),
+    edit_part(0) {
+  // instances started together should still vary; xorshift must not start at 0
+  rand_state = (uint32_t) time(NULL) ^ (uint32_t) (uintptr_t) this;
+  if (rand_state == 0)
+    rand_state = 1;
+
+  // start every part from an empty patch so the audio thread always has one
+  for (int i = 0; i < NUM_PARTS; ++i) {
+    jm::part& part = parts[i];
+    part.patch = new_patch();
+    jm::build_zone_index(&part.patch->index, part.patch->zones);
+    patches.push_back(part.patch);
+    part.playing = new_patch();
+    jm::build_zone_index(&part.playing->index, part.playing->zones);
+    patches.push_back(part.playing);
+    part.sent = part.playing;
+    part.vol_val = 0.f;
+    // part n listens on channel n by default
+    part.chan_val = i;
+    part.volume = &part.vol_val;
+    part.channel = &part.chan_val;
+    part.polyphony = PART_POLYPHONY;
+    part.voice_limit = PART_POLYPHONY;
+    part.zone_number = 1;
+    part.cancel_load = false;
+    part.sustain_on = false;
+    part.voices = 0;
+    memset(part.seq_counters, 0, sizeof(part.seq_counters));
+    memset(part.key_vel, 0, sizeof(part.key_vel));
+    memset(part.key_on_time, 0, sizeof(part.key_on_time));
+    memset(part.key_rand, 0, sizeof(part.key_rand));
+    memset(part.release_pending, 0, sizeof(part.release_pending));
+    part.gain[0] = part.gain[1] = 1.f;
+    part.gain_step[0] = part.gain_step[1] = 0.f;
+    part.bend = 0.f;
+    part.bend_smooth = 0.f;
+    part.cc_volume = 1.f;
+    part.cc_expression = 1.f;
+    part.cc_pan = .5f;
+    part.cc_mod = 0.f;
+  }
+
   pthread_mutex_init(&zone_lock, NULL);
+  pthread_mutex_init(&wave_lock, NULL);
+  pthread_mutex_init(&fout_lock, NULL);
+  pthread_mutex_init(&mip_lock, NULL);
+  pthread_mutex_init(&ctl_q_lock, NULL);
+  pthread_mutex_init(&ui_q_lock, NULL);
+  sem_init(&ui_sem, 0, 0);
+  pthread_mutex_init(&decode_lock, NULL);
+  pthread_cond_init(&decode_cond, NULL);
+  pthread_cond_init(&decoded_cond, NULL);
 
   for (size_t i = 0; i < POLYPHONY; ++i) {
     amp_gen_pool.push(new AmpEnvGenerator(amp_gen_pool));
-    playhead_pool.push(new Playhead(playhead_pool, sample_rate, in_nframes, out_nframes));
+    playheads.push_back(new Playhead(playhead_pool, sample_rate, in_nframes, out_nframes));
+    playhead_pool.push(playheads.back());
   }
+
+  for (int i = 0; i < DECODE_THREADS; ++i)
+    pthread_create(&decoders[i], NULL, decode_thread, this);
+  pthread_create(&ui_writer, NULL, ui_thread, this);
 }
 
 JMSampler::~JMSampler() {
+  pthread_mutex_lock(&decode_lock);
+  decode_quit = true;
+  pthread_cond_broadcast(&decode_cond);
+  pthread_mutex_unlock(&decode_lock);
+
+  for (int i = 0; i < DECODE_THREADS; ++i)
+    pthread_join(decoders[i], NULL);
+
+  ui_quit = true;
+  sem_post(&ui_sem);
+  pthread_join(ui_writer, NULL);
+  jm::ui_msg msg;
+  while (ui_q.pop(&msg))
+    delete[] msg.data;
+
   // clean up whatever is left in sg list
-  while (sound_gens.size() > 0) {
-    sound_gens.get_tail_ptr()->sg->release_resources();
-    sound_gens.remove_last();
-  }
+  while (sound_gens.size() > 0)
+    free_voice(sound_gens.get_tail_ptr());
 
   // then de-allocate sound generators
   while (playhead_pool.size() > 0)
@@ -71,253 +287,1420 @@ JMSampler::~JMSampler() {
   while (amp_gen_pool.size() > 0)
     delete amp_gen_pool.pop();
 
-  std::map<std::string, jm::wave>::iterator it;
-  for (it = waves.begin(); it != waves.end(); ++it)
-    jm::free_wave(it->second);
-
+  // patches drop the last refs so this frees every wave too
+  std::vector<jm::patch*>::iterator it;
+  for (it = patches.begin(); it != patches.end(); ++it)
+    (*it)->dead = true;
+  collect_garbage();
+  jm::scratch* s = pending_scratch.exchange(NULL);
+  if (s != NULL)
+    free_scratch(s);
+
+  pthread_cond_destroy(&decoded_cond);
+  pthread_cond_destroy(&decode_cond);
+  pthread_mutex_destroy(&decode_lock);
+  sem_destroy(&ui_sem);
+  pthread_mutex_destroy(&ui_q_lock);
+  pthread_mutex_destroy(&ctl_q_lock);
+  pthread_mutex_destroy(&mip_lock);
+  pthread_mutex_destroy(&fout_lock);
+  pthread_mutex_destroy(&wave_lock);
   pthread_mutex_destroy(&zone_lock);
 }
 
+void* JMSampler::decode_thread(void* arg) {
+  JMSampler* sampler = static_cast<JMSampler*>(arg);
+
+  pthread_mutex_lock(&sampler->decode_lock);
+  while (true) {
+    while (sampler->decode_q.empty() && !sampler->decode_quit)
+      pthread_cond_wait(&sampler->decode_cond, &sampler->decode_lock);
+
+    if (sampler->decode_quit)
+      break;
+
+    jm::decode_job* job = sampler->decode_q.front();
+    sampler->decode_q.pop_front();
+    pthread_mutex_unlock(&sampler->decode_lock);
+
+    jm::cached_wave* cw = NULL;
+    std::string error;
+    try {
+      cw = sampler->ref_wave(job->path.c_str(), job->mips);
+    }
+    catch (std::runtime_error& e) {
+      error = e.what();
+    }
+
+    pthread_mutex_lock(&sampler->decode_lock);
+    job->cw = cw;
+    job->error = error;
+    job->done = true;
+    pthread_cond_broadcast(&sampler->decoded_cond);
+  }
+  pthread_mutex_unlock(&sampler->decode_lock);
+
+  return NULL;
+}
+
+// writes queued messages to the ui. whatever piled up while a write blocked
+// goes out as one batch with one flush, and records a later one replaces are skipped
+void* JMSampler::ui_thread(void* arg) {
+  JMSampler* sampler = static_cast<JMSampler*>(arg);
+  std::vector<jm::ui_msg> batch;
+
+  // metrics go out on their own timer, between queued messages
+  jm::msg_writer metrics;
+  unsigned int reported = 0;
+  timespec next_report;
+  clock_gettime(CLOCK_REALTIME, &next_report);
+
+  while (true) {
+    if (sem_timedwait(&sampler->ui_sem, &next_report) != 0 && errno != ETIMEDOUT)
+      continue;
+    if (sampler->ui_quit)
+      break;
+
+    batch.clear();
+    jm::ui_msg msg;
+    while (sampler->ui_q.pop(&msg)) {
+      if (msg.key != jm::UI_ORDERED) {
+        for (size_t i = batch.size(); i-- > 0 && batch[i].key != jm::UI_ORDERED;) {
+          if (batch[i].key == msg.key) {
+            batch[i].key = -1;
+            break;
+          }
+        }
+      }
+      batch.push_back(msg);
+    }
+
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    metrics.clear();
+    if (now.tv_sec > next_report.tv_sec
+        || (now.tv_sec == next_report.tv_sec && now.tv_nsec >= next_report.tv_nsec)) {
+      next_report = now;
+      next_report.tv_nsec += METRICS_MS * 1000000L;
+      if (next_report.tv_nsec >= 1000000000L) {
+        ++next_report.tv_sec;
+        next_report.tv_nsec -= 1000000000L;
+      }
+      // nothing new while the host isn't running callbacks
+      unsigned int cycles = sampler->cycles;
+      if (cycles != reported) {
+        reported = cycles;
+        jm::metrics m;
+        sampler->get_metrics(&m);
+        metrics.begin(jm::MSG_METRICS);
+        metrics.put_float(m.load);
+        metrics.put_float(m.peak);
+        metrics.put_int(m.voices);
+        metrics.put_int(m.voice_cap);
+        metrics.put_int(m.steals);
+        metrics.end();
+      }
+    }
+    if (batch.empty() && metrics.size() == 0)
+      continue;
+
+    pthread_mutex_lock(&sampler->fout_lock);
+    std::vector<jm::ui_out>::iterator out;
+    for (out = sampler->fouts.begin(); out != sampler->fouts.end(); ++out) {
+      // gone; left for its owner to remove
+      if (ferror(out->f))
+        continue;
+
+      std::vector<jm::ui_msg>::iterator it;
+      for (it = batch.begin(); it != batch.end(); ++it) {
+        if (it->key >= 0 && it->gen >= out->gen)
+          fwrite(it->data, 1, it->len, out->f);
+      }
+      if (metrics.size() > 0)
+        fwrite(metrics.data(), 1, metrics.size(), out->f);
+      fflush(out->f);
+    }
+    pthread_mutex_unlock(&sampler->fout_lock);
+
+    std::vector<jm::ui_msg>::iterator it;
+    for (it = batch.begin(); it != batch.end(); ++it)
+      delete[] it->data;
+  }
+
+  return NULL;
+}
+
+void JMSampler::wait_decode(jm::decode_job* job) {
+  pthread_mutex_lock(&decode_lock);
+  while (!job->done)
+    pthread_cond_wait(&decoded_cond, &decode_lock);
+  pthread_mutex_unlock(&decode_lock);
+}
+
+// pull jobs[from..] off the queue, wait out any being decoded and let go of their waves
+void JMSampler::drop_decodes(std::vector<jm::decode_job>& jobs, size_t from) {
+  if (from >= jobs.size())
+    return;
+
+  pthread_mutex_lock(&decode_lock);
+  std::deque<jm::decode_job*>::iterator it = decode_q.begin();
+  while (it != decode_q.end()) {
+    if (*it >= &jobs[from] && *it <= &jobs.back()) {
+      (*it)->done = true;
+      it = decode_q.erase(it);
+    }
+    else
+      ++it;
+  }
+
+  for (size_t i = from; i < jobs.size(); ++i) {
+    while (!jobs[i].done)
+      pthread_cond_wait(&decoded_cond, &decode_lock);
+  }
+  pthread_mutex_unlock(&decode_lock);
+
+  for (size_t i = from; i < jobs.size(); ++i) {
+    if (jobs[i].cw != NULL)
+      unref_wave(jobs[i].cw);
+  }
+}
+
+// queue messages for the writer thread; only waits if the queue is full
+void JMSampler::send(int key, const jm::msg_writer& out) {
+  jm::ui_msg msg;
+  msg.key = key;
+  msg.len = out.size();
+  msg.data = new char[msg.len];
+  memcpy(msg.data, out.data(), msg.len);
+
+  pthread_mutex_lock(&ui_q_lock);
+  msg.gen = ui_gen;
+  while (!ui_q.push(msg)) {
+    sem_post(&ui_sem);
+    usleep(1000);
+  }
+  pthread_mutex_unlock(&ui_q_lock);
+  sem_post(&ui_sem);
+}
+
+FILE* JMSampler::set_ui(FILE* f) {
+  // waits out a write in progress; senders only wait for the bump
+  pthread_mutex_lock(&fout_lock);
+  pthread_mutex_lock(&ui_q_lock);
+  ++ui_gen;
+  pthread_mutex_unlock(&ui_q_lock);
+  FILE* old = fouts.empty() ? NULL: fouts[0].f;
+  fouts.clear();
+  if (f != NULL) {
+    jm::ui_out out = {f, ui_gen};
+    fouts.push_back(out);
+  }
+  pthread_mutex_unlock(&fout_lock);
+  return old;
+}
+
+void JMSampler::add_ui(FILE* f) {
+  pthread_mutex_lock(&fout_lock);
+  pthread_mutex_lock(&ui_q_lock);
+  ++ui_gen;
+  pthread_mutex_unlock(&ui_q_lock);
+  jm::ui_out out = {f, ui_gen};
+  fouts.push_back(out);
+  pthread_mutex_unlock(&fout_lock);
+}
+
+void JMSampler::remove_ui(FILE* f) {
+  pthread_mutex_lock(&fout_lock);
+  std::vector<jm::ui_out>::iterator it;
+  for (it = fouts.begin(); it != fouts.end(); ++it) {
+    if (it->f == f) {
+      fouts.erase(it);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&fout_lock);
+}
+
+void JMSampler::send_sample_rate() {
+  jm::msg_writer out;
+  out.begin(jm::MSG_SAMPLE_RATE);
+  out.put_int(sample_rate);
+  out.end();
+  send(jm::UI_ORDERED, out);
+}
+
+// these two need zone_lock held
 void JMSampler::send_add_zone(int index) {
-  char outstr[256];
-  char* p = outstr;
-  sprintf(p, "add_zone:");
-  p += strlen(p);
-  jm::build_zone_str(p, zones, index);
-  fprintf(fout, outstr);
-  fflush(fout);
+  jm::msg_writer out;
+  out.begin(jm::MSG_ADD_ZONE);
+  out.put_int(index);
+  jm::put_zone(&out, parts[edit_part].patch->zones[index]);
+  out.end();
+  send(jm::UI_ORDERED, out);
 
   //fprintf(stderr, "SAMPLER: add zone sent!! %i: %s\n", index, zones[index].name);
 }
 
 void JMSampler::send_update_wave(int index) {
-  char outstr[256];
-  char* p = outstr;
-  sprintf(p, "update_wave:");
-  // index
-  p += strlen(p);
-  sprintf(p, "%i,", index);
-  // path
-  p += strlen(p);
-  sprintf(p, "%s,", zones[index].path);
-  // wave length
-  p += strlen(p);
-  sprintf(p, "%i,", zones[index].wave_length);
-  // start
-  p += strlen(p);
-  sprintf(p, "%i,", zones[index].start);
-  // left
-  p += strlen(p);
-  sprintf(p, "%i,", zones[index].left);
-  // right
-  p += strlen(p);
-  sprintf(p, "%i\n", zones[index].right);
-  fprintf(fout, outstr);
-  fflush(fout);
-
-  //fprintf(stderr, "SAMPLER: update wave sent!! %i: %s\n", index, zones[index].path);
-}
-
-void JMSampler::add_zone_from_wave(int index, const char* path) {
-  jm::wave& wav = waves[path];
-  jm::zone zone;
-  jm::init_zone(&zone);
-  zone.wave = wav.wave;
-  zone.num_channels = wav.num_channels;
-  zone.sample_rate = wav.sample_rate;
-  zone.wave_length = wav.length;
-  zone.left = wav.left;
-  zone.right = wav.length;
-  if (wav.has_loop)
-    zone.loop_mode = jm::LOOP_CONTINUOUS;
-  sprintf(zone.name, "Zone %i", zone_number++);
-  strcpy(zone.path, path);
-  if (index >= 0) {
-    pthread_mutex_lock(&zone_lock);
-    zones.insert(zones.begin() + index, zone);
+  const jm::zone& zone = parts[edit_part].patch->zones[index];
+  jm::msg_writer out;
+  out.begin(jm::MSG_UPDATE_WAVE);
+  out.put_int(index);
+  out.put_str(zone.path);
+  out.put_int(zone.wave_length);
+  out.put_int(zone.start);
+  out.put_int(zone.left);
+  out.put_int(zone.right);
+  // may only be known once the wave is read
+  out.put_int(zone.loop_mode);
+  out.end();
+  send(jm::UI_WAVE + index, out);
+
+  //fprintf(stderr, "SAMPLER: update wave sent!! %i: %s\n", index, zone.path);
+}
+
+void JMSampler::send_remove_zone(int index) {
+  jm::msg_writer out;
+  out.begin(jm::MSG_REMOVE_ZONE);
+  out.put_int(index);
+  out.end();
+  send(jm::UI_ORDERED, out);
+}
+
+void JMSampler::send_update_vol(float val) {
+  jm::msg_writer out;
+  out.begin(jm::MSG_UPDATE_VOL);
+  out.put_float(val);
+  out.end();
+  send(jm::UI_VOL, out);
+}
+
+void JMSampler::send_update_chan(int val) {
+  jm::msg_writer out;
+  out.begin(jm::MSG_UPDATE_CHAN);
+  out.put_int(val);
+  out.end();
+  send(jm::UI_CHAN, out);
+}
+
+void JMSampler::send_load_progress(int loaded, int total) {
+  jm::msg_writer out;
+  out.begin(jm::MSG_LOAD_PROGRESS);
+  out.put_int(loaded);
+  out.put_int(total);
+  out.end();
+  send(jm::UI_PROGRESS, out);
+}
+
+jm::cached_wave* JMSampler::ref_wave(const char* path, int mips) {
+  pthread_mutex_lock(&wave_lock);
+  std::map<std::string, jm::cached_wave*>::iterator it = waves.find(path);
+  if (it != waves.end()) {
+    jm::cached_wave* cw = it->second;
+    ++cw->refs;
+    pthread_mutex_unlock(&wave_lock);
+    // first decoded for zones that needed fewer levels
+    grow_mips(cw, mips);
+    return cw;
+  }
+  pthread_mutex_unlock(&wave_lock);
+
+  // decode unlocked; other threads may still need waves already loaded
+  jm::wave wav = jm::parse_wave(path, mips, convert_waves ? sample_rate: 0);
+  jm::cached_wave* cw = new jm::cached_wave;
+  cw->wav = wav;
+  cw->path = path;
+  cw->refs = 1;
+
+  pthread_mutex_lock(&wave_lock);
+  std::pair<std::map<std::string, jm::cached_wave*>::iterator, bool> res =
+    waves.insert(std::make_pair(cw->path, cw));
+  // somebody else loaded it in the meantime
+  if (!res.second) {
+    jm::free_wave(cw->wav);
+    delete cw;
+    cw = res.first->second;
+    ++cw->refs;
+    pthread_mutex_unlock(&wave_lock);
+    grow_mips(cw, mips);
+    return cw;
+  }
+  pthread_mutex_unlock(&wave_lock);
+
+  return cw;
+}
+
+// zones and the audio thread read the levels without a lock; see jm::add_mips
+void JMSampler::grow_mips(jm::cached_wave* cw, int mips) {
+  pthread_mutex_lock(&mip_lock);
+  jm::add_mips(&cw->wav, mips);
+  pthread_mutex_unlock(&mip_lock);
+}
+
+// a zone now reaching further above its origin may want levels its wave was
+// decoded without; build them and hand the zone the lot
+void JMSampler::refresh_mips(int part, int index) {
+  pthread_mutex_lock(&zone_lock);
+  jm::patch* patch = parts[part].patch;
+  if (index >= (int) patch->zones.size() || patch->zones[index].wave == NULL) {
     pthread_mutex_unlock(&zone_lock);
-    send_add_zone(index);
+    return;
   }
-  else {
-    pthread_mutex_lock(&zone_lock);
-    zones.push_back(zone);
+  const jm::zone& zone = patch->zones[index];
+  int mips = jm::mip_levels(zone);
+  if (mips <= zone.num_mips) {
     pthread_mutex_unlock(&zone_lock);
-    send_add_zone(zones.size() - 1);
+    return;
+  }
+
+  // the patch's own ref, not the cache: a refresh of another part may have
+  // replaced the cache entry for this path with a newer copy
+  jm::cached_wave* cw = NULL;
+  pthread_mutex_lock(&wave_lock);
+  std::set<jm::cached_wave*>::iterator it;
+  for (it = patch->waves.begin(); it != patch->waves.end(); ++it) {
+    if ((*it)->wav.wave == zone.wave) {
+      cw = *it;
+      ++cw->refs;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&wave_lock);
+  pthread_mutex_unlock(&zone_lock);
+  if (cw == NULL)
+    return;
+
+  grow_mips(cw, mips);
+
+  pthread_mutex_lock(&zone_lock);
+  patch = parts[part].patch;
+  bool changed = false;
+  std::vector<jm::zone>::iterator z_it;
+  for (z_it = patch->zones.begin(); z_it != patch->zones.end(); ++z_it) {
+    if (z_it->wave == cw->wav.wave && z_it->num_mips < cw->wav.num_mips) {
+      z_it->num_mips = cw->wav.num_mips;
+      for (int i = 0; i < cw->wav.num_mips; ++i)
+        z_it->mips[i] = cw->wav.mips[i];
+      changed = true;
+    }
+  }
+  if (changed)
+    send_copy(part, false);
+  pthread_mutex_unlock(&zone_lock);
+  unref_wave(cw);
+}
+
+void JMSampler::unref_wave_locked(jm::cached_wave* cw) {
+  if (--cw->refs > 0)
+    return;
+
+  // a refresh may have put a newer copy in its place already
+  std::map<std::string, jm::cached_wave*>::iterator it = waves.find(cw->path);
+  if (it != waves.end() && it->second == cw)
+    waves.erase(it);
+
+  jm::free_wave(cw->wav);
+  delete cw;
+}
+
+void JMSampler::unref_wave(jm::cached_wave* cw) {
+  pthread_mutex_lock(&wave_lock);
+  unref_wave_locked(cw);
+  pthread_mutex_unlock(&wave_lock);
+}
+
+// hand the caller's ref over to p; needs zone_lock
+void JMSampler::hold_wave(jm::patch* p, jm::cached_wave* cw) {
+  if (!p->waves.insert(cw).second)
+    unref_wave(cw);
+}
+
+// p takes a ref of its own; needs zone_lock
+void JMSampler::share_wave(jm::patch* p, jm::cached_wave* cw) {
+  pthread_mutex_lock(&wave_lock);
+  if (p->waves.insert(cw).second)
+    ++cw->refs;
+  pthread_mutex_unlock(&wave_lock);
+}
+
+// a patch for the audio thread holding its own wave refs
+jm::patch* JMSampler::copy_patch(const jm::patch* p) {
+  jm::patch* copy = new_patch();
+  copy->zones = p->zones;
+  copy->index = p->index;
+  copy->solo_count = p->solo_count;
+  copy->waves = p->waves;
+
+  pthread_mutex_lock(&wave_lock);
+  std::set<jm::cached_wave*>::iterator it;
+  for (it = copy->waves.begin(); it != copy->waves.end(); ++it)
+    ++(*it)->refs;
+  patches.push_back(copy);
+  pthread_mutex_unlock(&wave_lock);
+  return copy;
+}
+
+// hand the audio thread a copy of the part's patch; needs zone_lock
+void JMSampler::send_copy(int part, bool fade) {
+  jm::ctl_msg msg;
+  msg.type = jm::CTL_PATCH;
+  msg.part = part;
+  msg.patch = copy_patch(parts[part].patch);
+  msg.fade = fade;
+  parts[part].sent = msg.patch;
+  send_control(msg);
+}
+
+// only waits if the queue is full; messages addressed to parts[].sent
+// must be sent under zone_lock so they stay behind its CTL_PATCH
+void JMSampler::send_control(const jm::ctl_msg& msg) {
+  pthread_mutex_lock(&ctl_q_lock);
+  while (!ctl_q.push(msg)) {
+    // we are the audio thread; nobody else will drain it, so apply what's
+    // queued as the next block would have
+    if (in_cycle) {
+      jm::ctl_msg queued;
+      while (ctl_q.pop(&queued))
+        apply_control(queued);
+    }
+    else
+      usleep(1000);
   }
+  pthread_mutex_unlock(&ctl_q_lock);
+}
+
+void JMSampler::collect_garbage() {
+  pthread_mutex_lock(&wave_lock);
+  std::vector<jm::patch*>::iterator it = patches.begin();
+  while (it != patches.end()) {
+    if (!(*it)->dead) {
+      ++it;
+      continue;
+    }
+
+    std::set<jm::cached_wave*>::iterator w_it;
+    for (w_it = (*it)->waves.begin(); w_it != (*it)->waves.end(); ++w_it)
+      unref_wave_locked(*w_it);
+
+    delete *it;
+    it = patches.erase(it);
+  }
+
+  jm::scratch* s = old_scratch.exchange(NULL);
+  if (s != NULL)
+    free_scratch(s);
+
+  // build for the longest block asked for; an older build still waiting is dropped
+  size_t nframes = wanted_nframes;
+  if (nframes > built_nframes) {
+    s = new jm::scratch;
+    s->nframes = nframes;
+    for (int i = 0; i < POLYPHONY; ++i)
+      s->out_bufs[i] = new float[2 * nframes];
+    mods.alloc_arrays(nframes, &s->mod_pitch, &s->mod_amp, &s->mod_cutoff);
+    built_nframes = nframes;
+
+    s = pending_scratch.exchange(s);
+    if (s != NULL)
+      free_scratch(s);
+  }
+  pthread_mutex_unlock(&wave_lock);
+}
+
+bool JMSampler::take_retired() {
+  bool r = retired;
+  retired = false;
+  if (wanted_nframes > max_nframes && !growing) {
+    growing = true;
+    r = true;
+  }
+  return r;
+}
+
+void JMSampler::free_scratch(jm::scratch* s) {
+  for (int i = 0; i < POLYPHONY; ++i)
+    delete [] s->out_bufs[i];
+  delete [] s->mod_pitch;
+  delete [] s->mod_amp;
+  delete [] s->mod_cutoff;
+  delete s;
 }
 
-void JMSampler::update_zone_from_wave(int index, const char* path) {
-  jm::wave& wav = waves[path];
-  zones[index].wave = wav.wave;
-  zones[index].num_channels = wav.num_channels;
-  zones[index].sample_rate = wav.sample_rate;
-  zones[index].wave_length = wav.length;
+// audio thread
+void JMSampler::apply_control(const jm::ctl_msg& msg) {
+  jm::part& part = parts[msg.part];
+  switch (msg.type) {
+    case jm::CTL_VOLUME:
+      *part.volume = msg.data.d;
+      break;
+    case jm::CTL_CHANNEL:
+      *part.channel = msg.data.i;
+      break;
+    case jm::CTL_POLYPHONY:
+      part.voice_limit = msg.data.i;
+      break;
+    case jm::CTL_ZONE:
+      if (msg.patch == part.playing)
+        edit_zone(part.playing, msg);
+      break;
+    case jm::CTL_WAVE:
+      if (msg.patch == part.playing && msg.index < (int) part.playing->zones.size())
+        attach_wave(&part.playing->zones[msg.index], *msg.data.wave);
+      break;
+    case jm::CTL_PATCH: {
+      jm::patch* old = part.playing;
+      part.playing = msg.patch;
+
+      // old voices keep their waves until they have faded; an edited
+      // patch lets them ring on instead
+      if (msg.fade) {
+        int fade = sample_rate * SWAP_FADE_MS / 1000;
+        for (sg_list_el* sg_el = sound_gens.get_head_ptr(); sg_el != NULL; sg_el = sg_el->next) {
+          if (sg_el->sg->patch == old)
+            sg_el->sg->fade_out(fade);
+        }
+      }
 
-  if (zones[index].start > wav.length)
-    zones[index].start = wav.length;
-  if (zones[index].left > wav.length)
-    zones[index].left = wav.length;
-  if (zones[index].right > wav.length)
-    zones[index].right = wav.length;
+      if (old->voices == 0) {
+        old->dead = true;
+        retired = true;
+      }
+      break;
+    }
+  }
+}
+
+// audio thread; the buffers swapped out wait in old_scratch until the collector frees them
+void JMSampler::swap_scratch() {
+  if (old_scratch.load() != NULL)
+    return;
+
+  jm::scratch* s = pending_scratch.exchange(NULL);
+  if (s == NULL)
+    return;
+
+  for (int i = 0; i < POLYPHONY; ++i)
+    s->out_bufs[i] = playheads[i]->swap_out_buf(s->out_bufs[i]);
+  mods.swap_arrays(&s->mod_pitch, &s->mod_amp, &s->mod_cutoff, s->nframes);
+  std::swap(max_nframes, s->nframes);
+  old_scratch = s;
+  retired = true;
+  growing = false;
+}
 
-  send_update_wave(index);
+void JMSampler::attach_wave(jm::zone* zone, const jm::wave& wav) {
+  zone->wave = wav.wave;
+  zone->num_mips = wav.num_mips;
+  for (int i = 0; i < wav.num_mips; ++i)
+    zone->mips[i] = wav.mips[i];
+  zone->num_channels = wav.num_channels;
+  zone->sample_rate = wav.sample_rate;
+  zone->wave_length = wav.file_length;
+  zone->play_length = wav.length;
+  zone->frame_scale = wav.file_length > 0 ? wav.length / (double) wav.file_length: 1.;
+
+  // anything the patch left unset comes from the wave
+  if (zone->left < 0)
+    zone->left = wav.left;
+  if (zone->right < 0)
+    zone->right = wav.file_length;
+  if (zone->loop_mode == jm::LOOP_UNSET)
+    zone->loop_mode = wav.has_loop ? jm::LOOP_CONTINUOUS: jm::LOOP_OFF;
+
+  // wave may have changed since the patch was written
+  if (zone->start > wav.file_length)
+    zone->start = wav.file_length;
+  if (zone->left > wav.file_length)
+    zone->left = wav.file_length;
+  if (zone->right > wav.file_length)
+    zone->right = wav.file_length;
 }
 
-void JMSampler::add_zone_from_region(const std::map<std::string, SFZValue>& region) {
-  jm::wave& wav = waves[region.find("sample")->second.get_str()];
+void JMSampler::add_zone_from_wave(int part_index, int index, const char* path) {
+  if (part_index < 0 || part_index >= NUM_PARTS)
+    return;
+
+  jm::cached_wave* cw = ref_wave(path);
   jm::zone zone;
   jm::init_zone(&zone);
-  zone.wave = wav.wave;
-  zone.num_channels = wav.num_channels;
-  zone.sample_rate = wav.sample_rate;
-  zone.wave_length = wav.length;
-  zone.left = wav.left;
-  zone.right = wav.length;
-  if (wav.has_loop)
-    zone.loop_mode = jm::LOOP_CONTINUOUS;
-
-  std::map<std::string, SFZValue>::const_iterator it = region.find("jm_name");
-  if (it != region.end())
-    strcpy(zone.name, it->second.get_str().c_str());
-  else
-    sprintf(zone.name, "Zone %i", zone_number++);
-
-  it = region.find("jm_mute");
-  zone.mute = it != region.end() ? it->second.get_int(): 0;
-  it = region.find("jm_solo");
-  zone.solo = it != region.end() ? it->second.get_int(): 0;
-  if (zone.solo)
-    ++solo_count;
-
-  strcpy(zone.path, region.find("sample")->second.get_str().c_str());
-  zone.amp = pow(10., region.find("volume")->second.get_double() / 20.);
-  zone.low_key = region.find("lokey")->second.get_int();
-  zone.high_key = region.find("hikey")->second.get_int();
-  zone.origin = region.find("pitch_keycenter")->second.get_int();
-  zone.low_vel = region.find("lovel")->second.get_int();
-  zone.high_vel = region.find("hivel")->second.get_int();
-  zone.pitch_corr = region.find("tune")->second.get_int() / 100.;
-  zone.start = region.find("offset")->second.get_int();
-
-  jm::loop_mode mode = (jm::loop_mode) region.find("loop_mode")->second.get_int();
-  if (mode != jm::LOOP_UNSET)
-    zone.loop_mode = mode;
-
-  int loop_start = region.find("loop_start")->second.get_int();
-  if (loop_start >= 0)
-    zone.left = loop_start;
-
-  int loop_end = region.find("loop_end")->second.get_int();
-  if (loop_end >= 0)
-    zone.right = loop_end;
-
-  zone.crossfade = sample_rate * region.find("loop_crossfade")->second.get_double();
-  zone.group = region.find("group")->second.get_int();
-  zone.off_group = region.find("off_by")->second.get_int();
-  zone.attack = sample_rate * region.find("ampeg_attack")->second.get_double();
-  zone.hold = sample_rate * region.find("ampeg_hold")->second.get_double();
-  zone.decay = sample_rate * region.find("ampeg_decay")->second.get_double();
-  zone.sustain = region.find("ampeg_sustain")->second.get_double() / 100.;
-  zone.release = sample_rate * region.find("ampeg_release")->second.get_double();
+  zone.left = -1;
+  zone.right = -1;
+  zone.loop_mode = jm::LOOP_UNSET;
+  attach_wave(&zone, cw->wav);
+  jm::copy_str(zone.path, path, MAX_PATH);
+
   pthread_mutex_lock(&zone_lock);
-  zones.push_back(zone);
+  jm::part& part = parts[part_index];
+  sprintf(zone.name, "Zone %i", part.zone_number++);
+  std::vector<jm::zone>& zones = part.patch->zones;
+  if (index < 0 || index > (int) zones.size())
+    index = zones.size();
+  zones.insert(zones.begin() + index, zone);
+  jm::build_zone_index(&part.patch->index, zones);
+  hold_wave(part.patch, cw);
+  send_copy(part_index, false);
+  if (part_index == edit_part)
+    send_add_zone(index);
   pthread_mutex_unlock(&zone_lock);
 }
 
-void JMSampler::duplicate_zone(int index) {
+void JMSampler::zone_from_region(const sfz::sfz& s, const sfz::region& region, int* number, jm::zone* zone) {
+  const sfz::value* v = region.values;
+  jm::init_zone(zone);
+  // no wave until the loader gets to it; note on skips the zone till then
+  zone->wave = NULL;
+  zone->num_channels = 0;
+  zone->sample_rate = 0;
+  zone->wave_length = 0;
+
+  if (region.has(sfz::OP_JM_NAME))
+    jm::copy_str(zone->name, s.get_str(region, sfz::OP_JM_NAME).c_str(), MAX_NAME);
+  else
+    sprintf(zone->name, "Zone %i", (*number)++);
+
+  zone->mute = region.has(sfz::OP_JM_MUTE) ? v[sfz::OP_JM_MUTE].i: 0;
+  zone->solo = region.has(sfz::OP_JM_SOLO) ? v[sfz::OP_JM_SOLO].i: 0;
+
+  jm::copy_str(zone->path, s.get_str(region, sfz::OP_SAMPLE).c_str(), MAX_PATH);
+  zone->amp = pow(10., v[sfz::OP_VOLUME].d / 20.);
+  zone->low_key = v[sfz::OP_LOKEY].i;
+  zone->high_key = v[sfz::OP_HIKEY].i;
+  zone->origin = v[sfz::OP_PITCH_KEYCENTER].i;
+  zone->low_vel = v[sfz::OP_LOVEL].i;
+  zone->high_vel = v[sfz::OP_HIVEL].i;
+  zone->pitch_corr = v[sfz::OP_TUNE].i / 100.;
+  zone->start = v[sfz::OP_OFFSET].i;
+
+  // unset markers and mode are resolved from the wave in attach_wave
+  zone->loop_mode = (jm::loop_mode) v[sfz::OP_LOOP_MODE].i;
+  zone->left = v[sfz::OP_LOOP_START].i;
+  zone->right = v[sfz::OP_LOOP_END].i;
+
+  zone->crossfade = sample_rate * v[sfz::OP_LOOP_CROSSFADE].d;
+  zone->group = v[sfz::OP_GROUP].i;
+  zone->off_group = v[sfz::OP_OFF_BY].i;
+  zone->output = v[sfz::OP_OUTPUT].i;
+  zone->seq_length = v[sfz::OP_SEQ_LENGTH].i;
+  zone->seq_position = v[sfz::OP_SEQ_POSITION].i;
+  zone->lorand = v[sfz::OP_LORAND].d;
+  zone->hirand = v[sfz::OP_HIRAND].d;
+  zone->xfin_lovel = v[sfz::OP_XFIN_LOVEL].i;
+  zone->xfin_hivel = v[sfz::OP_XFIN_HIVEL].i;
+  zone->xfout_lovel = v[sfz::OP_XFOUT_LOVEL].i;
+  zone->xfout_hivel = v[sfz::OP_XFOUT_HIVEL].i;
+  zone->xfin_lokey = v[sfz::OP_XFIN_LOKEY].i;
+  zone->xfin_hikey = v[sfz::OP_XFIN_HIKEY].i;
+  zone->xfout_lokey = v[sfz::OP_XFOUT_LOKEY].i;
+  zone->xfout_hikey = v[sfz::OP_XFOUT_HIKEY].i;
+  zone->xf_velcurve = (jm::xf_curve) v[sfz::OP_XF_VELCURVE].i;
+  zone->xf_keycurve = (jm::xf_curve) v[sfz::OP_XF_KEYCURVE].i;
+  zone->trigger = (jm::trigger_mode) v[sfz::OP_TRIGGER].i;
+  zone->rt_decay = v[sfz::OP_RT_DECAY].d;
+  zone->bend_up = v[sfz::OP_BEND_UP].i;
+  zone->bend_down = v[sfz::OP_BEND_DOWN].i;
+  zone->fil_type = (jm::filter_type) v[sfz::OP_FIL_TYPE].i;
+  zone->cutoff = v[sfz::OP_CUTOFF].d;
+  zone->resonance = v[sfz::OP_RESONANCE].d;
+  zone->fil_veltrack = v[sfz::OP_FIL_VELTRACK].i;
+  zone->fileg_attack = sample_rate * v[sfz::OP_FILEG_ATTACK].d;
+  zone->fileg_hold = sample_rate * v[sfz::OP_FILEG_HOLD].d;
+  zone->fileg_decay = sample_rate * v[sfz::OP_FILEG_DECAY].d;
+  zone->fileg_sustain = v[sfz::OP_FILEG_SUSTAIN].d / 100.;
+  zone->fileg_release = sample_rate * v[sfz::OP_FILEG_RELEASE].d;
+  zone->fileg_depth = v[sfz::OP_FILEG_DEPTH].i;
+  zone->amplfo.freq = v[sfz::OP_AMPLFO_FREQ].d;
+  zone->amplfo.depth = v[sfz::OP_AMPLFO_DEPTH].d;
+  zone->amplfo.depthcc1 = v[sfz::OP_AMPLFO_DEPTHCC1].d;
+  zone->amplfo.delay = sample_rate * v[sfz::OP_AMPLFO_DELAY].d;
+  zone->pitchlfo.freq = v[sfz::OP_PITCHLFO_FREQ].d;
+  zone->pitchlfo.depth = v[sfz::OP_PITCHLFO_DEPTH].d;
+  zone->pitchlfo.depthcc1 = v[sfz::OP_PITCHLFO_DEPTHCC1].d;
+  zone->pitchlfo.delay = sample_rate * v[sfz::OP_PITCHLFO_DELAY].d;
+  zone->fillfo.freq = v[sfz::OP_FILLFO_FREQ].d;
+  zone->fillfo.depth = v[sfz::OP_FILLFO_DEPTH].d;
+  zone->fillfo.depthcc1 = v[sfz::OP_FILLFO_DEPTHCC1].d;
+  zone->fillfo.delay = sample_rate * v[sfz::OP_FILLFO_DELAY].d;
+  zone->pitcheg.attack = sample_rate * v[sfz::OP_PITCHEG_ATTACK].d;
+  zone->pitcheg.hold = sample_rate * v[sfz::OP_PITCHEG_HOLD].d;
+  zone->pitcheg.decay = sample_rate * v[sfz::OP_PITCHEG_DECAY].d;
+  zone->pitcheg.sustain = v[sfz::OP_PITCHEG_SUSTAIN].d / 100.;
+  zone->pitcheg.release = sample_rate * v[sfz::OP_PITCHEG_RELEASE].d;
+  zone->pitcheg.depth = v[sfz::OP_PITCHEG_DEPTH].i;
+  zone->pitcheg.vel2depth = v[sfz::OP_PITCHEG_VEL2DEPTH].i;
+  zone->attack = sample_rate * v[sfz::OP_AMPEG_ATTACK].d;
+  zone->hold = sample_rate * v[sfz::OP_AMPEG_HOLD].d;
+  zone->decay = sample_rate * v[sfz::OP_AMPEG_DECAY].d;
+  zone->sustain = v[sfz::OP_AMPEG_SUSTAIN].d / 100.;
+  zone->release = sample_rate * v[sfz::OP_AMPEG_RELEASE].d;
+}
+
+void JMSampler::duplicate_zone(int part, int index) {
+  if (part < 0 || part >= NUM_PARTS)
+    return;
+
+  pthread_mutex_lock(&zone_lock);
+  jm::patch* patch = parts[part].patch;
+  std::vector<jm::zone>& zones = patch->zones;
+  if (index < 0 || index >= (int) zones.size()) {
+    pthread_mutex_unlock(&zone_lock);
+    return;
+  }
   jm::zone zone;
   zone = zones[index];
   if (zones[index].solo)
-    ++solo_count;
+    ++patch->solo_count;
 
-  pthread_mutex_lock(&zone_lock);
   zones.insert(zones.begin() + index + 1, zone);
+  jm::build_zone_index(&patch->index, zones);
+  send_copy(part, false);
+  if (part == edit_part)
+    send_add_zone(index + 1);
   pthread_mutex_unlock(&zone_lock);
-  send_add_zone(index + 1);
 }
 
-void JMSampler::remove_zone(int index) {
+void JMSampler::remove_zone(int part, int index) {
+  if (part < 0 || part >= NUM_PARTS)
+    return;
+
   pthread_mutex_lock(&zone_lock);
+  jm::patch* patch = parts[part].patch;
+  std::vector<jm::zone>& zones = patch->zones;
+  if (index < 0 || index >= (int) zones.size()) {
+    pthread_mutex_unlock(&zone_lock);
+    return;
+  }
   std::vector<jm::zone>::iterator it = zones.begin() + index;
   if (it->solo)
-    --solo_count;
+    --patch->solo_count;
   zones.erase(zones.begin() + index);
+  jm::build_zone_index(&patch->index, zones);
+  send_copy(part, false);
+  if (part == edit_part)
+    send_remove_zone(index);
   pthread_mutex_unlock(&zone_lock);
 }
 
-void JMSampler::load_patch(const char* path) {
-  SFZParser* parser;
+void JMSampler::rescale_compiled(jm::jmzb* compiled) {
+  // frame based fields were computed at the compiling rate
+  if (compiled->sample_rate == sample_rate)
+    return;
 
-  int len = strlen(path);
-  if (!strcmp(path + len - 4, ".jmz"))
-    parser = new JMZParser(path);
-  // assumed it could ony eitehr be jmz or sfz
-  else
-    parser = new SFZParser(path);
+  double rate_ratio = sample_rate / (double) compiled->sample_rate;
+
+  std::vector<jm::zone>::iterator it;
+  for (it = compiled->zones.begin(); it != compiled->zones.end(); ++it) {
+    it->crossfade = it->crossfade * rate_ratio;
+    it->attack = it->attack * rate_ratio;
+    it->hold = it->hold * rate_ratio;
+    it->decay = it->decay * rate_ratio;
+    it->release = it->release * rate_ratio;
+    it->fileg_attack = it->fileg_attack * rate_ratio;
+    it->fileg_hold = it->fileg_hold * rate_ratio;
+    it->fileg_decay = it->fileg_decay * rate_ratio;
+    it->fileg_release = it->fileg_release * rate_ratio;
+    it->amplfo.delay = it->amplfo.delay * rate_ratio;
+    it->pitchlfo.delay = it->pitchlfo.delay * rate_ratio;
+    it->fillfo.delay = it->fillfo.delay * rate_ratio;
+    it->pitcheg.attack = it->pitcheg.attack * rate_ratio;
+    it->pitcheg.hold = it->pitcheg.hold * rate_ratio;
+    it->pitcheg.decay = it->pitcheg.decay * rate_ratio;
+    it->pitcheg.release = it->pitcheg.release * rate_ratio;
+  }
+  compiled->sample_rate = sample_rate;
+}
+
+// hand a new patch to the audio thread; it swaps it in at the start of its next block
+void JMSampler::publish(int part, jm::patch* new_patch) {
+  pthread_mutex_lock(&wave_lock);
+  patches.push_back(new_patch);
+  pthread_mutex_unlock(&wave_lock);
+
+  // nothing plays from the ui's copy, so the old one can go right away
+  pthread_mutex_lock(&zone_lock);
+  parts[part].patch->dead = true;
+  parts[part].patch = new_patch;
+  send_copy(part, true);
+  pthread_mutex_unlock(&zone_lock);
+
+  collect_garbage();
+}
+
+// takes over the wave refs in refs
+void JMSampler::publish_patch(int part, const jm::jmzb& compiled, std::set<jm::cached_wave*>& refs, int number) {
+  jm::patch* p = new_patch();
+  p->zones = compiled.zones;
+  p->index = compiled.index;
+  p->waves.swap(refs);
+
+  std::vector<jm::zone>::const_iterator it;
+  for (it = p->zones.begin(); it != p->zones.end(); ++it) {
+    if (it->solo)
+      ++p->solo_count;
+  }
+
+  publish(part, p);
+
+  pthread_mutex_lock(&zone_lock);
+  parts[part].zone_number = number;
+  if (compiled.has_control) {
+    set_volume(part, compiled.volume);
+    set_channel(part, compiled.channel - 1);
+  }
+  else {
+    set_volume(part, 0.f);
+    set_channel(part, part);
+  }
+
+  if (part == edit_part)
+    send_part();
+  pthread_mutex_unlock(&zone_lock);
+}
+
+// everything the ui shows for edit_part in one record, the zone table
+// as a single message; needs zone_lock
+void JMSampler::send_part() {
+  const jm::part& part = parts[edit_part];
+  const std::vector<jm::zone>& zones = part.patch->zones;
+  jm::msg_writer out;
+
+  out.begin(jm::MSG_UPDATE_PART);
+  out.put_int(edit_part);
+  out.put_int(part.polyphony);
+  out.end();
+  out.begin(jm::MSG_UPDATE_VOL);
+  out.put_float(*part.volume);
+  out.end();
+  out.begin(jm::MSG_UPDATE_CHAN);
+  out.put_int((int) *part.channel);
+  out.end();
+
+  out.begin(jm::MSG_ZONES);
+  out.put_int(zones.size());
+  for (size_t i = 0; i < zones.size(); ++i)
+    jm::put_zone(&out, zones[i]);
+  out.end();
+  send(jm::UI_ORDERED, out);
+}
+
+void JMSampler::select_part(int part) {
+  if (part < 0 || part >= NUM_PARTS)
+    return;
+
+  pthread_mutex_lock(&zone_lock);
+  edit_part = part;
+  send_part();
+  pthread_mutex_unlock(&zone_lock);
+}
+
+void JMSampler::set_freewheel(bool on) {
+  // converters are only ever added; the audio thread sees them before the flag
+  if (on) {
+    for (size_t i = 0; i < playheads.size(); ++i)
+      playheads[i]->alloc_best();
+  }
+  wanted_freewheel = on;
+}
+
+void JMSampler::begin_cycle() {
+  in_cycle = true;
+  clock_gettime(CLOCK_MONOTONIC, &cycle_start);
+}
+
+void JMSampler::end_cycle(size_t nframes) {
+  in_cycle = false;
 
-  // consider error handling here
-  patch = parser->parse();
+  // nothing to keep up with while rendering off line
+  if (nframes == 0 || freewheel) {
+    voice_cap = POLYPHONY;
+    return;
+  }
+
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = (now.tv_sec - cycle_start.tv_sec) + (now.tv_nsec - cycle_start.tv_nsec) / 1e9;
+  float load = elapsed * sample_rate / nframes;
+
+  // quick to rise so a dense passage is caught before it runs over, slow
+  // to fall so the cap doesn't flap with each note
+  float ms = load > load_avg ? GOV_RISE_MS: GOV_FALL_MS;
+  load_avg += (load - load_avg) * (1.f - expf(-(float) nframes * 1000.f / (ms * sample_rate)));
+
+  if (load > load_peak)
+    load_peak = load;
+  peak_frames += nframes;
+  if (peak_frames >= (size_t) sample_rate) {
+    pub_peak = load_peak;
+    load_peak = 0.f;
+    peak_frames = 0;
+  }
 
-  delete parser;
+  int voices = sound_gens.size();
+  cap_frames += nframes;
+  if (!governor)
+    voice_cap = POLYPHONY;
+  else if (cap_frames >= (size_t) (GOV_HOLD_MS * sample_rate / 1000)) {
+    if (load_avg > GOV_HIGH_LOAD && voices > GOV_MIN_VOICES) {
+      // voices cost roughly the same each, so aim for the middle of the band
+      int cap = voices * (GOV_HIGH_LOAD + GOV_LOW_LOAD) / (2.f * load_avg);
+      if (cap < GOV_MIN_VOICES)
+        cap = GOV_MIN_VOICES;
+      if (cap < voice_cap) {
+        voice_cap = cap;
+        cap_frames = 0;
+      }
+    }
+    // give voices back gradually; the rise is quick to take them again
+    else if (load_avg < GOV_LOW_LOAD && voice_cap < POLYPHONY) {
+      voice_cap += voice_cap / 8 + 1;
+      if (voice_cap > POLYPHONY)
+        voice_cap = POLYPHONY;
+      cap_frames = 0;
+    }
+  }
 
-  zone_number = 1;
-  solo_count = 0;
+  pub_load = load_avg;
+  pub_voices = voices;
+  pub_cap = voice_cap;
+  pub_steals = steals;
+  ++cycles;
+}
+
+void JMSampler::get_metrics(jm::metrics* m) {
+  m->load = pub_load;
+  m->peak = pub_peak;
+  m->voices = pub_voices;
+  m->voice_cap = pub_cap;
+  m->steals = pub_steals;
+}
+
+void JMSampler::set_polyphony(int part, int polyphony) {
+  if (part < 0 || part >= NUM_PARTS)
+    return;
+
+  if (polyphony < 1)
+    polyphony = 1;
+  else if (polyphony > POLYPHONY)
+    polyphony = POLYPHONY;
 
   pthread_mutex_lock(&zone_lock);
-  zones.erase(zones.begin(), zones.end());
+  parts[part].polyphony = polyphony;
   pthread_mutex_unlock(&zone_lock);
 
-  std::vector<std::map<std::string, SFZValue> >::iterator it;
-  for (it = patch.regions.begin(); it != patch.regions.end(); ++it) {
-    std::string wav_path = (*it)["sample"].get_str();
-    if (waves.find(wav_path) == waves.end()) {
-      waves[wav_path] = jm::parse_wave(wav_path.c_str());
+  jm::ctl_msg msg;
+  msg.type = jm::CTL_POLYPHONY;
+  msg.part = part;
+  msg.data.i = polyphony;
+  send_control(msg);
+}
+
+void JMSampler::set_volume(int part, float volume) {
+  if (part < 0 || part >= NUM_PARTS)
+    return;
+
+  jm::ctl_msg msg;
+  msg.type = jm::CTL_VOLUME;
+  msg.part = part;
+  msg.data.d = volume;
+  send_control(msg);
+}
+
+void JMSampler::set_channel(int part, int channel) {
+  if (part < 0 || part >= NUM_PARTS)
+    return;
+
+  jm::ctl_msg msg;
+  msg.type = jm::CTL_CHANNEL;
+  msg.part = part;
+  msg.data.i = channel;
+  send_control(msg);
+}
+
+void JMSampler::compile_patch(jm::jmzb* compiled) {
+  compiled->sample_rate = sample_rate;
+  compiled->has_control = false;
+  compiled->volume = 0.f;
+  compiled->channel = 1;
+  pthread_mutex_lock(&zone_lock);
+  compiled->zones = parts[edit_part].patch->zones;
+  compiled->index = parts[edit_part].patch->index;
+  pthread_mutex_unlock(&zone_lock);
+  compiled->deps.clear();
+}
+
+// blocks until every wave is decoded; run it off the audio and ui threads.
+// the old patch keeps playing until one wave per key of the new patch is ready,
+// then the new one takes over and the rest of its waves come in as they decode
+void JMSampler::load_patch(int part, const char* path) {
+  if (part < 0 || part >= NUM_PARTS)
+    return;
+
+  jm::part& target = parts[part];
+  target.cancel_load = false;
+
+  sfz::sfz new_patch;
+  jm::jmzb compiled;
+  int number = 1;
+
+  // text patches are compiled on first load; reuse that while nothing it was built from changed
+  char real_path[PATH_MAX];
+  std::string cache_path;
+  bool have_compiled = false;
+
+  if (jm::is_jmzb_path(path)) {
+    jm::read_jmzb(path, &compiled);
+    have_compiled = true;
+  }
+  else {
+    if (realpath(path, real_path) != NULL)
+      cache_path = jm::jmzb_cache_path(real_path);
+
+    if (!cache_path.empty()) {
+      try {
+        jm::read_jmzb(cache_path.c_str(), &compiled);
+        // first dep is always the source; also guards against cache name collisions
+        if (compiled.sample_rate == sample_rate && !compiled.deps.empty() &&
+            compiled.deps[0].path == real_path && jm::jmzb_deps_current(compiled)) {
+          have_compiled = true;
+          // nothing new to cache
+          cache_path.clear();
+        }
+      }
+      // no usable cache; fall through to text
+      catch (std::runtime_error&) {}
+    }
+  }
+
+  if (have_compiled) {
+    rescale_compiled(&compiled);
+    // compiled waves are loaded from scratch like text ones
+    std::vector<jm::zone>::iterator it;
+    for (it = compiled.zones.begin(); it != compiled.zones.end(); ++it)
+      it->wave = NULL;
+    // numbering carried on from the names, as a text load would have left it
+    number = next_zone_number(compiled.zones);
+  }
+  else {
+    SFZParser* parser;
+
+    int len = strlen(path);
+    if (!strcmp(path + len - 4, ".jmz"))
+      parser = new JMZParser(path);
+    // assumed it could ony eitehr be jmz or sfz
+    else
+      parser = new SFZParser(path);
+
+    try {
+      new_patch = parser->parse();
+    }
+    catch (std::runtime_error&) {
+      delete parser;
+      throw;
+    }
+
+    delete parser;
+
+    compiled.zones.clear();
+    std::vector<sfz::region>::const_iterator it;
+    for (it = new_patch.regions.begin(); it != new_patch.regions.end(); ++it) {
+      // nothing to play
+      if (!it->has(sfz::OP_SAMPLE))
+        continue;
+
+      jm::zone zone;
+      zone_from_region(new_patch, *it, &number, &zone);
+      compiled.zones.push_back(zone);
+    }
+    jm::build_zone_index(&compiled.index, compiled.zones);
+
+    compiled.sample_rate = sample_rate;
+    compiled.has_control = false;
+    compiled.volume = 0.f;
+    compiled.channel = 1;
+    std::map<std::string, SFZValue>::iterator c_it = new_patch.control.find("jm_vol");
+    if (c_it != new_patch.control.end()) {
+      compiled.has_control = true;
+      compiled.volume = c_it->second.get_double();
+      compiled.channel = new_patch.control["jm_chan"].get_int();
     }
-    add_zone_from_region(*it);
   }
+
+  // zones sharing each wave and the mip levels the highest of them needs
+  std::map<std::string, std::vector<int> > wave_zones;
+  std::map<std::string, int> wave_mips;
+  for (size_t i = 0; i < compiled.zones.size(); ++i) {
+    const jm::zone& zone = compiled.zones[i];
+    wave_zones[zone.path].push_back(i);
+    int& mips = wave_mips[zone.path];
+    mips = std::max(mips, jm::mip_levels(zone));
+  }
+
+  // decode order: a wave per key first so the whole range plays early,
+  // preferring the layer a medium velocity would hit, then the rest
+  std::vector<std::string> load_order;
+  std::set<std::string> ordered;
+  for (int k = NOTE_MIN; k <= NOTE_MAX; ++k) {
+    int best = -1;
+    for (int i = compiled.index.key_offsets[k]; i < compiled.index.key_offsets[k + 1]; ++i) {
+      const jm::zone& zone = compiled.zones[compiled.index.zones[i]];
+      if (best < 0)
+        best = compiled.index.zones[i];
+      if (zone.low_vel <= 64 && zone.high_vel >= 64) {
+        best = compiled.index.zones[i];
+        break;
+      }
+    }
+
+    if (best >= 0 && ordered.insert(compiled.zones[best].path).second)
+      load_order.push_back(compiled.zones[best].path);
+  }
+
+  size_t publish_at = load_order.size();
+
+  std::map<std::string, std::vector<int> >::iterator w_it;
+  for (w_it = wave_zones.begin(); w_it != wave_zones.end(); ++w_it) {
+    if (ordered.insert(w_it->first).second)
+      load_order.push_back(w_it->first);
+  }
+
+  if (part == edit_part)
+    send_load_progress(0, load_order.size());
+
+  // queue everything on the decode pool up front; it works through it in load order
+  std::vector<jm::decode_job> jobs(load_order.size());
+  pthread_mutex_lock(&decode_lock);
+  for (size_t w = 0; w < load_order.size(); ++w) {
+    jobs[w].path = load_order[w];
+    jobs[w].mips = wave_mips[load_order[w]];
+    jobs[w].cw = NULL;
+    jobs[w].done = false;
+    decode_q.push_back(&jobs[w]);
+  }
+  pthread_cond_broadcast(&decode_cond);
+  pthread_mutex_unlock(&decode_lock);
+
+  // refs on waves decoded before publishing; the new patch takes them over
+  std::set<jm::cached_wave*> refs;
+  bool published = false;
+  if (publish_at == 0) {
+    publish_patch(part, compiled, refs, number);
+    published = true;
+  }
+
+  for (size_t w = 0; w < load_order.size(); ++w) {
+    // a newer load wants in; whatever was published stays as is
+    if (target.cancel_load) {
+      drop_decodes(jobs, w);
+      break;
+    }
+
+    const std::string& wav_path = load_order[w];
+    wait_decode(&jobs[w]);
+    jm::cached_wave* cw = jobs[w].cw;
+    if (cw == NULL) {
+      drop_decodes(jobs, w + 1);
+      std::set<jm::cached_wave*>::iterator r_it;
+      for (r_it = refs.begin(); r_it != refs.end(); ++r_it)
+        unref_wave(*r_it);
+      throw std::runtime_error(jobs[w].error);
+    }
+
+    const jm::wave& wav = cw->wav;
+    const std::vector<int>& zone_list = wave_zones[wav_path];
+    for (size_t i = 0; i < zone_list.size(); ++i)
+      attach_wave(&compiled.zones[zone_list[i]], wav);
+
+    if (published) {
+      pthread_mutex_lock(&zone_lock);
+      jm::patch* patch = target.patch;
+      std::vector<jm::zone>& zones = patch->zones;
+      for (size_t i = 0; i < zone_list.size(); ++i) {
+        int index = zone_list[i];
+        // zones may have been added or removed since publishing; find by path instead
+        if (index >= (int) zones.size() || zones[index].wave != NULL ||
+            wav_path != zones[index].path) {
+          for (index = 0; index < (int) zones.size(); ++index) {
+            if (zones[index].wave == NULL && wav_path == zones[index].path)
+              break;
+          }
+          if (index == (int) zones.size())
+            continue;
+        }
+
+        attach_wave(&zones[index], wav);
+        if (part == edit_part)
+          send_update_wave(index);
+
+        jm::ctl_msg msg;
+        msg.type = jm::CTL_WAVE;
+        msg.part = part;
+        msg.patch = target.sent;
+        msg.index = index;
+        msg.data.wave = &cw->wav;
+        send_control(msg);
+      }
+      share_wave(target.sent, cw);
+      hold_wave(patch, cw);
+      pthread_mutex_unlock(&zone_lock);
+    }
+    else {
+      refs.insert(cw);
+      if (w + 1 == publish_at) {
+        publish_patch(part, compiled, refs, number);
+        published = true;
+      }
+    }
+
+    if (part == edit_part)
+      send_load_progress(w + 1, load_order.size());
+  }
+
+  // cancelled before the new patch got out
+  std::set<jm::cached_wave*>::iterator r_it;
+  for (r_it = refs.begin(); r_it != refs.end(); ++r_it)
+    unref_wave(*r_it);
+
+  if (target.cancel_load || cache_path.empty())
+    return;
+
+  // source files first, then every sample referenced
+  compiled.deps.clear();
+  std::vector<std::string>::iterator f_it;
+  for (f_it = new_patch.files.begin(); f_it != new_patch.files.end(); ++f_it) {
+    jm::jmzb_dep dep;
+    dep.path = *f_it;
+    compiled.deps.push_back(dep);
+  }
+
+  for (w_it = wave_zones.begin(); w_it != wave_zones.end(); ++w_it) {
+    jm::jmzb_dep dep;
+    dep.path = w_it->first;
+    compiled.deps.push_back(dep);
+  }
+
+  // failing to cache is harmless; it just means parsing text again next time
+  try {
+    jm::write_jmzb(cache_path.c_str(), compiled);
+  }
+  catch (std::runtime_error&) {}
 }
 
 void JMSampler::save_patch(const char* path) {
+  if (jm::is_jmzb_path(path)) {
+    jm::jmzb compiled;
+    compile_patch(&compiled);
+    compiled.has_control = true;
+    compiled.volume = *parts[edit_part].volume;
+    compiled.channel = (int) *parts[edit_part].channel + 1;
+    jm::write_jmzb(path, compiled);
+    return;
+  }
+
   int len = strlen(path);
 
   sfz::sfz save_patch;
 
   bool is_jmz = !strcmp(path + len - 4, ".jmz");
+
   if (is_jmz) {
-    save_patch.control["jm_vol"] = (double) *volume;
-    save_patch.control["jm_chan"] = (int) *channel + 1;
+    save_patch.control["jm_vol"] = (double) *parts[edit_part].volume;
+    save_patch.control["jm_chan"] = (int) *parts[edit_part].channel + 1;
   }
 
+  std::vector<jm::zone> zones;
+  pthread_mutex_lock(&zone_lock);
+  zones = parts[edit_part].patch->zones;
+  pthread_mutex_unlock(&zone_lock);
+
   std::vector<jm::zone>::iterator it;
   for (it = zones.begin(); it != zones.end(); ++it) {
-    std::map<std::string, SFZValue> region;
+    sfz::region region;
 
     if (is_jmz) {
-      region["jm_name"] = it->name;
-      region["jm_mute"] = it->mute;
-      region["jm_solo"] = it->solo;
-    }
-
-    region["sample"] = it->path;
-    region["volume"] = 20. * log10(it->amp);
-    region["lokey"] = it->low_key;
-    region["hikey"] = it->high_key;
-    region["pitch_keycenter"] = it->origin;
-    region["lovel"] = it->low_vel;
-    region["hivel"] = it->high_vel;
-    region["tune"] = (int) (100. * it->pitch_corr);
-    region["offset"] = it->start;
-    region["loop_mode"] = it->loop_mode;
-    region["loop_start"] = it->left;
-    region["loop_end"] = it->right;
-    region["loop_crossfade"] = (double) it->crossfade / sample_rate;
-    region["group"] = it->group;
-    region["off_by"] = it->off_group;
-    region["ampeg_attack"] = (double) it->attack / sample_rate;
-    region["ampeg_hold"] = (double) it->hold / sample_rate;
-    region["ampeg_decay"] = (double) it->decay / sample_rate;
-    region["ampeg_sustain"] = 100. * it->sustain;
-    region["ampeg_release"] = (double) it->release / sample_rate;
+      region.set_str(sfz::OP_JM_NAME, save_patch.add_string(it->name));
+      region.set_int(sfz::OP_JM_MUTE, it->mute);
+      region.set_int(sfz::OP_JM_SOLO, it->solo);
+    }
+
+    region.set_str(sfz::OP_SAMPLE, save_patch.add_string(it->path));
+    region.set_double(sfz::OP_VOLUME, 20. * log10(it->amp));
+    region.set_int(sfz::OP_LOKEY, it->low_key);
+    region.set_int(sfz::OP_HIKEY, it->high_key);
+    region.set_int(sfz::OP_PITCH_KEYCENTER, it->origin);
+    region.set_int(sfz::OP_LOVEL, it->low_vel);
+    region.set_int(sfz::OP_HIVEL, it->high_vel);
+    region.set_int(sfz::OP_TUNE, (int) (100. * it->pitch_corr));
+    region.set_int(sfz::OP_OFFSET, it->start);
+    region.set_int(sfz::OP_LOOP_MODE, it->loop_mode);
+    region.set_int(sfz::OP_LOOP_START, it->left);
+    region.set_int(sfz::OP_LOOP_END, it->right);
+    region.set_double(sfz::OP_LOOP_CROSSFADE, (double) it->crossfade / sample_rate);
+    region.set_int(sfz::OP_GROUP, it->group);
+    region.set_int(sfz::OP_OFF_BY, it->off_group);
+    region.set_int(sfz::OP_OUTPUT, it->output);
+    region.set_int(sfz::OP_SEQ_LENGTH, it->seq_length);
+    region.set_int(sfz::OP_SEQ_POSITION, it->seq_position);
+    region.set_double(sfz::OP_LORAND, it->lorand);
+    region.set_double(sfz::OP_HIRAND, it->hirand);
+    region.set_int(sfz::OP_XFIN_LOVEL, it->xfin_lovel);
+    region.set_int(sfz::OP_XFIN_HIVEL, it->xfin_hivel);
+    region.set_int(sfz::OP_XFOUT_LOVEL, it->xfout_lovel);
+    region.set_int(sfz::OP_XFOUT_HIVEL, it->xfout_hivel);
+    region.set_int(sfz::OP_XFIN_LOKEY, it->xfin_lokey);
+    region.set_int(sfz::OP_XFIN_HIKEY, it->xfin_hikey);
+    region.set_int(sfz::OP_XFOUT_LOKEY, it->xfout_lokey);
+    region.set_int(sfz::OP_XFOUT_HIKEY, it->xfout_hikey);
+    region.set_int(sfz::OP_XF_VELCURVE, it->xf_velcurve);
+    region.set_int(sfz::OP_XF_KEYCURVE, it->xf_keycurve);
+    region.set_int(sfz::OP_TRIGGER, it->trigger);
+    region.set_double(sfz::OP_RT_DECAY, it->rt_decay);
+    region.set_int(sfz::OP_BEND_UP, it->bend_up);
+    region.set_int(sfz::OP_BEND_DOWN, it->bend_down);
+    // unfiltered zones leave the filter opcodes out entirely
+    if (it->cutoff > 0.f) {
+      region.set_int(sfz::OP_FIL_TYPE, it->fil_type);
+      region.set_double(sfz::OP_CUTOFF, it->cutoff);
+      region.set_double(sfz::OP_RESONANCE, it->resonance);
+      region.set_int(sfz::OP_FIL_VELTRACK, it->fil_veltrack);
+      region.set_double(sfz::OP_FILEG_ATTACK, (double) it->fileg_attack / sample_rate);
+      region.set_double(sfz::OP_FILEG_HOLD, (double) it->fileg_hold / sample_rate);
+      region.set_double(sfz::OP_FILEG_DECAY, (double) it->fileg_decay / sample_rate);
+      region.set_double(sfz::OP_FILEG_SUSTAIN, 100. * it->fileg_sustain);
+      region.set_double(sfz::OP_FILEG_RELEASE, (double) it->fileg_release / sample_rate);
+      region.set_int(sfz::OP_FILEG_DEPTH, it->fileg_depth);
+    }
+    // modulation opcodes are likewise left out when unused
+    if (it->amplfo.freq > 0.f) {
+      region.set_double(sfz::OP_AMPLFO_FREQ, it->amplfo.freq);
+      region.set_double(sfz::OP_AMPLFO_DEPTH, it->amplfo.depth);
+      region.set_double(sfz::OP_AMPLFO_DEPTHCC1, it->amplfo.depthcc1);
+      region.set_double(sfz::OP_AMPLFO_DELAY, (double) it->amplfo.delay / sample_rate);
+    }
+    if (it->pitchlfo.freq > 0.f) {
+      region.set_double(sfz::OP_PITCHLFO_FREQ, it->pitchlfo.freq);
+      region.set_double(sfz::OP_PITCHLFO_DEPTH, it->pitchlfo.depth);
+      region.set_double(sfz::OP_PITCHLFO_DEPTHCC1, it->pitchlfo.depthcc1);
+      region.set_double(sfz::OP_PITCHLFO_DELAY, (double) it->pitchlfo.delay / sample_rate);
+    }
+    if (it->fillfo.freq > 0.f) {
+      region.set_double(sfz::OP_FILLFO_FREQ, it->fillfo.freq);
+      region.set_double(sfz::OP_FILLFO_DEPTH, it->fillfo.depth);
+      region.set_double(sfz::OP_FILLFO_DEPTHCC1, it->fillfo.depthcc1);
+      region.set_double(sfz::OP_FILLFO_DELAY, (double) it->fillfo.delay / sample_rate);
+    }
+    if (it->pitcheg.depth != 0 || it->pitcheg.vel2depth != 0) {
+      region.set_double(sfz::OP_PITCHEG_ATTACK, (double) it->pitcheg.attack / sample_rate);
+      region.set_double(sfz::OP_PITCHEG_HOLD, (double) it->pitcheg.hold / sample_rate);
+      region.set_double(sfz::OP_PITCHEG_DECAY, (double) it->pitcheg.decay / sample_rate);
+      region.set_double(sfz::OP_PITCHEG_SUSTAIN, 100. * it->pitcheg.sustain);
+      region.set_double(sfz::OP_PITCHEG_RELEASE, (double) it->pitcheg.release / sample_rate);
+      region.set_int(sfz::OP_PITCHEG_DEPTH, it->pitcheg.depth);
+      region.set_int(sfz::OP_PITCHEG_VEL2DEPTH, it->pitcheg.vel2depth);
+    }
+    region.set_double(sfz::OP_AMPEG_ATTACK, (double) it->attack / sample_rate);
+    region.set_double(sfz::OP_AMPEG_HOLD, (double) it->hold / sample_rate);
+    region.set_double(sfz::OP_AMPEG_DECAY, (double) it->decay / sample_rate);
+    region.set_double(sfz::OP_AMPEG_SUSTAIN, 100. * it->sustain);
+    region.set_double(sfz::OP_AMPEG_RELEASE, (double) it->release / sample_rate);
 
     save_patch.regions.push_back(region);
   }
@@ -328,187 +1711,453 @@ void JMSampler::save_patch(const char* path) {
   fout.close();
 }
 
-void JMSampler::reload_waves() {
+// re-reads every wave from disk into a fresh copy of the patch and swaps that in
+void JMSampler::reload_waves(int part) {
+  if (part < 0 || part >= NUM_PARTS)
+    return;
+
+  // the levels each of the part's waves needs
+  std::map<std::string, int> wave_mips;
   pthread_mutex_lock(&zone_lock);
+  std::vector<jm::zone>::const_iterator z_it;
+  for (z_it = parts[part].patch->zones.begin(); z_it != parts[part].patch->zones.end(); ++z_it) {
+    int& mips = wave_mips[z_it->path];
+    mips = std::max(mips, jm::mip_levels(*z_it));
+  }
 
-  std::map<std::string, jm::wave>::iterator it;
-  for (it = waves.begin(); it != waves.end(); ++it)
-    jm::free_wave(it->second);
+  // forget this part's cached waves so they're decoded again; other parts
+  // keep sharing theirs, and patches still holding the old copies keep
+  // their refs till freed
+  pthread_mutex_lock(&wave_lock);
+  std::map<std::string, int>::iterator m_it;
+  for (m_it = wave_mips.begin(); m_it != wave_mips.end(); ++m_it)
+    waves.erase(m_it->first);
+  pthread_mutex_unlock(&wave_lock);
+  pthread_mutex_unlock(&zone_lock);
 
-  waves.clear();
+  // decoded unlocked, so the part can still be edited meanwhile
+  std::map<std::string, jm::cached_wave*> fresh;
+  std::map<std::string, jm::cached_wave*>::iterator f_it;
+  try {
+    for (m_it = wave_mips.begin(); m_it != wave_mips.end(); ++m_it)
+      fresh[m_it->first] = ref_wave(m_it->first.c_str(), m_it->second);
+  }
+  catch (std::runtime_error&) {
+    for (f_it = fresh.begin(); f_it != fresh.end(); ++f_it)
+      unref_wave(f_it->second);
+    throw;
+  }
 
-  for (int i = 0; i < zones.size(); ++i) {
-    if (waves.find(zones[i].path) == waves.end()) {
-      waves[zones[i].path] = jm::parse_wave(zones[i].path);
+  // built from the zones as they are now, not as they were before decoding
+  jm::patch* p = new_patch();
+  pthread_mutex_lock(&zone_lock);
+  jm::patch* patch = parts[part].patch;
+  p->zones = patch->zones;
+  p->index = patch->index;
+  p->solo_count = patch->solo_count;
+  for (size_t i = 0; i < p->zones.size(); ++i) {
+    jm::zone& zone = p->zones[i];
+    f_it = fresh.find(zone.path);
+    if (f_it != fresh.end()) {
+      attach_wave(&zone, f_it->second->wav);
+      share_wave(p, f_it->second);
+      continue;
     }
 
-    update_zone_from_wave(i, zones[i].path);
+    // added while decoding; keeps the wave it was given
+    std::set<jm::cached_wave*>::iterator w_it;
+    for (w_it = patch->waves.begin(); w_it != patch->waves.end(); ++w_it) {
+      if ((*w_it)->wav.wave == zone.wave) {
+        share_wave(p, *w_it);
+        break;
+      }
+    }
   }
 
+  // as publish does, without letting go of zone_lock in between
+  pthread_mutex_lock(&wave_lock);
+  patches.push_back(p);
+  pthread_mutex_unlock(&wave_lock);
+  patch->dead = true;
+  parts[part].patch = p;
+  send_copy(part, true);
+
+  if (part == edit_part) {
+    for (size_t i = 0; i < p->zones.size(); ++i)
+      send_update_wave(i);
+  }
   pthread_mutex_unlock(&zone_lock);
+
+  for (f_it = fresh.begin(); f_it != fresh.end(); ++f_it)
+    unref_wave(f_it->second);
+  collect_garbage();
 }
 
-void JMSampler::update_zone(int index, int key, const char* val) {
+void JMSampler::update_zone(int part, int index, int key, const char* val) {
+  if (part < 0 || part >= NUM_PARTS || index < 0)
+    return;
+
+  if (key == jm::ZONE_PATH) {
+    // decode before taking the zone lock
+    jm::cached_wave* cw = ref_wave(val);
+
+    pthread_mutex_lock(&zone_lock);
+    jm::patch* patch = parts[part].patch;
+    if (index >= (int) patch->zones.size()) {
+      pthread_mutex_unlock(&zone_lock);
+      unref_wave(cw);
+      return;
+    }
+    attach_wave(&patch->zones[index], cw->wav);
+    hold_wave(patch, cw);
+    jm::copy_str(patch->zones[index].path, val, MAX_PATH);
+    send_copy(part, false);
+    if (part == edit_part)
+      send_update_wave(index);
+    pthread_mutex_unlock(&zone_lock);
+    return;
+  }
+
+  jm::ctl_msg msg;
+  msg.type = jm::CTL_ZONE;
+  msg.index = index;
+  msg.key = key;
+  if (key == jm::ZONE_AMP || key == jm::ZONE_PITCH || key == jm::ZONE_SUSTAIN)
+    msg.data.d = atof(val);
+  else
+    msg.data.i = atoi(val);
+  // buses past the last fall back to the first when played, but not below it
+  if (key == jm::ZONE_OUTPUT && msg.data.i < 0)
+    msg.data.i = 0;
+
   pthread_mutex_lock(&zone_lock);
-  switch (key) {
-    case jm::ZONE_NAME:
-      strcpy(zones[index].name, val);
-      break;
-    case jm::ZONE_AMP:
-      zones[index].amp = atof(val);
-      break;
-    case jm::ZONE_MUTE:
-      zones[index].mute = atoi(val);
-      break;
-    case jm::ZONE_SOLO:
-      zones[index].solo = atoi(val);
-      zones[index].solo ? ++solo_count: --solo_count;
-      break;
-    case jm::ZONE_ORIGIN:
-      zones[index].origin = atoi(val);
-      break;
-    case jm::ZONE_LOW_KEY:
-      zones[index].low_key = atoi(val);
-      break;
-    case jm::ZONE_HIGH_KEY:
-      zones[index].high_key = atoi(val);
-      break;
-    case jm::ZONE_LOW_VEL:
-      zones[index].low_vel = atoi(val);
-      break;
-    case jm::ZONE_HIGH_VEL:
-      zones[index].high_vel = atoi(val);
-      break;
-    case jm::ZONE_PITCH:
-      zones[index].pitch_corr = atof(val);
-      break;
-    case jm::ZONE_START:
-      zones[index].start = atoi(val);
-      break;
-    case jm::ZONE_LEFT:
-      zones[index].left = atoi(val);
-      break;
-    case jm::ZONE_RIGHT:
-      zones[index].right = atoi(val);
-      break;
-    case jm::ZONE_LOOP_MODE:
-      zones[index].loop_mode = (jm::loop_mode) atoi(val);
-      break;
-    case jm::ZONE_CROSSFADE:
-      zones[index].crossfade = atoi(val);
-      break;
-    case jm::ZONE_GROUP:
-      zones[index].group = atoi(val);
-      break;
-    case jm::ZONE_OFF_GROUP:
-      zones[index].off_group = atoi(val);
-      break;
-    case jm::ZONE_ATTACK:
-      zones[index].attack = atoi(val);
-      break;
-    case jm::ZONE_HOLD:
-      zones[index].hold = atoi(val);
-      break;
-    case jm::ZONE_DECAY:
-      zones[index].decay = atoi(val);
-      break;
-    case jm::ZONE_SUSTAIN:
-      zones[index].sustain = atof(val);
-      break;
-    case jm::ZONE_RELEASE:
-      zones[index].release = atoi(val);
-      break;
-    case jm::ZONE_PATH:
-      jm::wave& wav = waves[val];
-      zones[index].wave = wav.wave;
-      zones[index].num_channels = wav.num_channels;
-      zones[index].sample_rate = wav.sample_rate;
-      zones[index].wave_length = wav.length;
+  msg.part = part;
+  jm::patch* patch = parts[part].patch;
+  if (index >= (int) patch->zones.size()) {
+    pthread_mutex_unlock(&zone_lock);
+    return;
+  }
+  // the audio thread never shows names
+  if (key == jm::ZONE_NAME)
+    jm::copy_str(patch->zones[index].name, val, MAX_NAME);
+  else {
+    edit_zone(patch, msg);
+    // the key index has to be rebuilt, which the audio thread can't do
+    if (key == jm::ZONE_LOW_KEY || key == jm::ZONE_HIGH_KEY) {
+      jm::build_zone_index(&patch->index, patch->zones);
+      send_copy(part, false);
+    }
+    else {
+      msg.patch = parts[part].sent;
+      send_control(msg);
+    }
+  }
+  pthread_mutex_unlock(&zone_lock);
 
-      if (zones[index].start > wav.length)
-        zones[index].start = wav.length;
-      if (zones[index].left > wav.length)
-        zones[index].left = wav.length;
-      if (zones[index].right > wav.length)
-        zones[index].right = wav.length;
+  // these move how far above its origin the zone plays
+  if (key == jm::ZONE_HIGH_KEY || key == jm::ZONE_ORIGIN || key == jm::ZONE_PITCH)
+    refresh_mips(part, index);
+}
 
-      strcpy(zones[index].path, val);
+void JMSampler::free_voice(sg_list_el* sg_el) {
+  jm::part& part = parts[sg_el->sg->part];
+  jm::patch* p = sg_el->sg->patch;
+  if (sg_el->sg->release_trigger)
+    --release_voices;
+  else
+    --part.voices;
+  if (sg_el->sg->filter >= 0)
+    filters.free(sg_el->sg->filter);
+  if (sg_el->sg->mod >= 0)
+    mods.free(sg_el->sg->mod);
+  sg_el->sg->release_resources();
+  sound_gens.remove(sg_el);
+
+  // last voice of a replaced patch; it can go now
+  if (--p->voices == 0 && p != part.playing) {
+    p->dead = true;
+    retired = true;
+  }
+}
 
-      send_update_wave(index);
+// the governor's cap is reached: cut the quietest voices already in release
+// until there is room, and only if none are left the oldest held note
+void JMSampler::steal_for_cap() {
+  while ((int) sound_gens.size() >= voice_cap) {
+    sg_list_el* quietest = NULL;
+    float quietest_level = 0.f;
+    for (sg_list_el* sg_el = sound_gens.get_head_ptr(); sg_el != NULL; sg_el = sg_el->next) {
+      if (!sg_el->sg->is_released())
+        continue;
+      float level = sg_el->sg->level();
+      if (quietest == NULL || level < quietest_level) {
+        quietest = sg_el;
+        quietest_level = level;
+      }
+    }
+    if (quietest == NULL)
       break;
+    free_voice(quietest);
+    ++steals;
+  }
+
+  if ((int) sound_gens.size() >= voice_cap) {
+    for (sg_list_el* sg_el = sound_gens.get_tail_ptr(); sg_el != NULL; sg_el = sg_el->prev) {
+      if (!sg_el->sg->release_trigger) {
+        free_voice(sg_el);
+        ++steals;
+        break;
+      }
+    }
   }
-  pthread_mutex_unlock(&zone_lock);
 }
 
 void JMSampler::pre_process(size_t nframes) {
-  // pitch existing playheads
+  block_time = next_block_time;
+  next_block_time += nframes;
+  swap_scratch();
+  freewheel = wanted_freewheel;
+
+  jm::ctl_msg msg;
+  while (ctl_q.pop(&msg))
+    apply_control(msg);
+
+  // one pole bend smoothing, stepped once per block
+  float bend_coef = 1.f - expf(-(float) nframes * 1000.f / (BEND_SMOOTH_MS * sample_rate));
+
+  for (int i = 0; i < NUM_PARTS; ++i) {
+    jm::part& part = parts[i];
+    part.bend_smooth += (part.bend - part.bend_smooth) * bend_coef;
+    if (fabsf(part.bend - part.bend_smooth) < 1e-4f)
+      part.bend_smooth = part.bend;
+
+    // ramp from where the last block ended to this block's gain; the pan law
+    // keeps center at unity and attenuates only the far side
+    float amp = get_amp(*part.volume) * part.cc_volume * part.cc_expression;
+    float pan[2] = {sqrtf(2.f * (1.f - part.cc_pan)), sqrtf(2.f * part.cc_pan)};
+    for (int c = 0; c < 2; ++c) {
+      part.gain[c] += part.gain_step[c] * last_nframes;
+      part.gain_step[c] = ((pan[c] > 1.f ? amp: amp * pan[c]) - part.gain[c]) / nframes;
+    }
+  }
+
+  last_nframes = nframes;
+
+  // the busier the callbacks, the louder a voice must be to get a better converter
+  float busy = (load_avg - GOV_LOW_LOAD) / (GOV_HIGH_LOAD - GOV_LOW_LOAD);
+  busy = busy < 0.f ? 0.f: (busy > 1.f ? 1.f: busy);
+  high_level = load_avg < GOV_HIGH_LOAD ? get_amp(QUALITY_HIGH_DB + busy * QUALITY_LOAD_DB): HUGE_VALF;
+  mid_level = get_amp(QUALITY_MID_DB + busy * QUALITY_LOAD_DB);
+
+  // modulate and pitch existing playheads
   for (sg_list_el* sg_el = sound_gens.get_head_ptr(); sg_el != NULL; sg_el = sg_el->next) {
+    const jm::part& part = parts[sg_el->sg->part];
+    if (sg_el->sg->mod >= 0) {
+      mods.run(sg_el->sg->mod, nframes, 0, part.cc_mod, sg_el->sg->is_released());
+      // the arrays may have just been swapped
+      sg_el->sg->set_pitch_mod(mods.pitch_of(sg_el->sg->mod), control_frames);
+    }
+    sg_el->sg->set_bend(part.bend_smooth);
+    // off line every voice keeps the converter it started with
+    if (!freewheel)
+      sg_el->sg->set_quality(quality_for(sg_el->sg->level() * std::max(part.gain[0], part.gain[1])));
     sg_el->sg->pre_process(nframes);
   }
 }
 
 void JMSampler::handle_note_on(const unsigned char* midi_msg, size_t nframes, size_t curframe) {
+  int chan = midi_msg[0] & 0x0f;
+  for (int i = 0; i < NUM_PARTS; ++i) {
+    if ((int) *parts[i].channel == chan)
+      note_on(i, midi_msg, nframes, curframe);
+  }
+}
+
+// voice room must already be made
+void JMSampler::start_voice(int part_index, const jm::zone& zone, int key, int velocity, float gain, size_t nframes, size_t curframe) {
+  jm::part& part = parts[part_index];
+  jm::patch* playing = part.playing;
+
+  // shut off any sound gens that are in this off group
+  if (zone.group > 0) {
+    for (sg_list_el* sg_el = sound_gens.get_head_ptr(); sg_el != NULL; sg_el = sg_el->next) {
+      if (sg_el->sg->part == part_index && sg_el->sg->off_group == zone.group)
+        sg_el->sg->set_release();
+    }
+  }
+
+  // create sound gen
+  AmpEnvGenerator* ag = amp_gen_pool.pop();
+  Playhead* ph = playhead_pool.pop();
+  ph->init(zone, key, freewheel ? jm::QUALITY_BEST: jm::QUALITY_MID);
+  ag->init(ph, zone, key, velocity, gain);
+  if (!freewheel)
+    ag->set_quality(quality_for(ag->level() * std::max(part.gain[0], part.gain[1])));
+  ag->part = part_index;
+  ag->output = zone.output >= 0 && zone.output < num_outputs ? zone.output: 0;
+  ag->filter = filters.alloc(zone, velocity);
+  ag->mod = mods.alloc(zone, velocity);
+  if (ag->mod >= 0) {
+    mods.run(ag->mod, nframes, curframe, part.cc_mod, false);
+    ag->set_pitch_mod(mods.pitch_of(ag->mod), control_frames);
+  }
+  // keeps the patch and its waves alive while the voice plays
+  ag->patch = playing;
+  ++playing->voices;
+  if (ag->release_trigger) {
+    ++release_voices;
+    // a looped release sample would hold forever; let its envelope end it
+    if (zone.loop_mode == jm::LOOP_CONTINUOUS)
+      ag->set_release();
+  }
+  else
+    ++part.voices;
+  ag->set_bend(part.bend_smooth);
+  //cerr << "pre process start" << endl;
+  ag->pre_process(nframes - curframe);
+  //cerr << "pre process finish" << endl;
+
+  // add sound gen to queue
+  sound_gens.add(ag);
+}
+
+void JMSampler::note_on(int part_index, const unsigned char* midi_msg, size_t nframes, size_t curframe) {
+  jm::part& part = parts[part_index];
   sg_list_el* sg_el;
   // if sustain on and note is already playing, release old one first
-  if (sustain_on) {
+  if (part.sustain_on) {
     for (sg_el = sound_gens.get_head_ptr(); sg_el != NULL; sg_el = sg_el->next) {
       // doesn't apply to one shot
-      if (!sg_el->sg->one_shot && sg_el->sg->pitch == midi_msg[1])
+      if (sg_el->sg->part == part_index && !sg_el->sg->one_shot && sg_el->sg->pitch == midi_msg[1])
         sg_el->sg->set_release();
     }
   }
   // pick out zones midi event matches against and add sound gens to queue
-  // yes, using mutex here violates the laws of real time ..BUT..
-  // we don't expect a musician to tweak zones during an actual take!
-  // this allows for demoing zone changes in thread safe way in *almost* real time
-  // we can safely assume this mutex will be unlocked in a real take
-  pthread_mutex_lock(&zone_lock);
-  std::vector<jm::zone>::const_iterator it;
-  for (it = zones.begin(); it != zones.end(); ++it) {
-    if (jm::zone_contains(&*it, midi_msg[1], midi_msg[2]) && 
-        (it->solo || (!solo_count && !it->mute))) {
+  jm::patch* playing = part.playing;
+  const jm::zone_index& zone_idx = playing->index;
+  int key = midi_msg[1];
+  // remembered for the release triggers this key fires on note off
+  part.key_vel[key] = midi_msg[2];
+  part.key_on_time[key] = block_time + curframe;
+  // one sequence step and one random draw per note, shared by every zone on the key
+  unsigned int seq = part.seq_counters[key]++;
+  float rand_val = next_rand();
+  part.key_rand[key] = rand_val;
+  for (int i = zone_idx.key_offsets[key]; i < zone_idx.key_offsets[key + 1]; ++i) {
+    std::vector<jm::zone>::const_iterator it = playing->zones.begin() + zone_idx.zones[i];
+    // still waiting on the loader
+    if (it->wave == NULL || it->trigger != jm::TRIGGER_ATTACK)
+      continue;
+    if (!jm::zone_contains(&*it, midi_msg[1], midi_msg[2]) || !jm::zone_in_layer(&*it, seq, rand_val))
+      continue;
+    // faded all the way out; don't spend a voice on silence
+    int zone_i = zone_idx.zones[i];
+    float xf_gain = zone_idx.vel_gain[zone_i * (VEL_MAX + 1) + midi_msg[2]] *
+      zone_idx.key_gain[zone_i * (NOTE_MAX + 1) + key];
+    if (xf_gain <= 0.f)
+      continue;
+    if (it->solo || (!playing->solo_count && !it->mute)) {
       //cerr << "sg num: " << sound_gens.size() << endl;
-      // oops we hit polyphony, remove oldest sound gen in the queue to make room
-      if (sound_gens.size() >= POLYPHONY) {
+      // held back by the cpu governor
+      if (voice_cap < POLYPHONY && (int) sound_gens.size() >= voice_cap)
+        steal_for_cap();
+      // part is over budget; make room from its own oldest voice
+      if (part.voices >= part.voice_limit && !freewheel) {
+        for (sg_el = sound_gens.get_tail_ptr(); sg_el != NULL; sg_el = sg_el->prev) {
+          if (sg_el->sg->part == part_index && !sg_el->sg->release_trigger) {
+            free_voice(sg_el);
+            break;
+          }
+        }
+      }
+      // oops we hit polyphony, remove oldest sound gen in the queue to make room;
+      // the release reserve is off limits to notes
+      else if (sound_gens.size() - release_voices >= POLYPHONY - RELEASE_RESERVE) {
         //cerr << "hit poly lim!" << endl;
-        sound_gens.get_tail_ptr()->sg->release_resources();
-        sound_gens.remove_last();
+        for (sg_el = sound_gens.get_tail_ptr(); sg_el != NULL; sg_el = sg_el->prev) {
+          if (!sg_el->sg->release_trigger) {
+            free_voice(sg_el);
+            break;
+          }
+        }
       }
-
-      // shut off any sound gens that are in this off group
-      if (it->group > 0) {
-        for (sg_el = sound_gens.get_head_ptr(); sg_el != NULL; sg_el = sg_el->next) {
-          if (sg_el->sg->off_group == it->group)
-            sg_el->sg->set_release();
+      // release samples have spilled past the reserve and filled the pool
+      else if (sound_gens.size() >= POLYPHONY) {
+        for (sg_el = sound_gens.get_tail_ptr(); sg_el != NULL; sg_el = sg_el->prev) {
+          if (sg_el->sg->release_trigger) {
+            free_voice(sg_el);
+            break;
+          }
         }
       }
 
-      // create sound gen
-      AmpEnvGenerator* ag = amp_gen_pool.pop();
-      Playhead* ph = playhead_pool.pop();
-      ph->init(*it, midi_msg[1]);
-      ag->init(ph, *it, midi_msg[1], midi_msg[2]);
-      //cerr << "pre process start" << endl;
-      ag->pre_process(nframes - curframe);
-      //cerr << "pre process finish" << endl;
-
-      // add sound gen to queue
-      sound_gens.add(ag);
+      start_voice(part_index, *it, key, midi_msg[2], xf_gain, nframes, curframe);
       //cerr << "event: channel: " << (midi_msg[0] & 0x0F) << "; note on;  note: " << midi_msg[1] << "; vel: " << midi_msg[2] << endl;
     }
   }
-  pthread_mutex_unlock(&zone_lock);
 }
 
-void JMSampler::handle_note_off(const unsigned char* midi_msg) {
+// fires the release triggered zones of a key that just went up
+void JMSampler::note_up(int part_index, int key, size_t nframes, size_t curframe) {
+  jm::part& part = parts[part_index];
+  int velocity = part.key_vel[key];
+  // never went down
+  if (velocity == 0)
+    return;
+  part.key_vel[key] = 0;
+
+  float held = (float) (block_time + curframe - part.key_on_time[key]) / sample_rate;
+
+  jm::patch* playing = part.playing;
+  const jm::zone_index& zone_idx = playing->index;
+  // same sequence step and random layer the note on picked
+  unsigned int seq = part.seq_counters[key] - 1;
+  float rand_val = part.key_rand[key];
+  for (int i = zone_idx.key_offsets[key]; i < zone_idx.key_offsets[key + 1]; ++i) {
+    std::vector<jm::zone>::const_iterator it = playing->zones.begin() + zone_idx.zones[i];
+    if (it->wave == NULL || it->trigger != jm::TRIGGER_RELEASE)
+      continue;
+    if (!jm::zone_contains(&*it, key, velocity) || !jm::zone_in_layer(&*it, seq, rand_val))
+      continue;
+    if (!it->solo && (playing->solo_count || it->mute))
+      continue;
+    int zone_i = zone_idx.zones[i];
+    float gain = zone_idx.vel_gain[zone_i * (VEL_MAX + 1) + velocity] *
+      zone_idx.key_gain[zone_i * (NOTE_MAX + 1) + key] *
+      get_amp(-it->rt_decay * held);
+    // decayed past hearing
+    if (gain < 1e-5f)
+      continue;
+
+    if (voice_cap < POLYPHONY && (int) sound_gens.size() >= voice_cap)
+      steal_for_cap();
+    // only other release samples are stolen; the reserve guarantees there is one
+    if (sound_gens.size() >= POLYPHONY) {
+      sg_list_el* sg_el;
+      for (sg_el = sound_gens.get_tail_ptr(); sg_el != NULL; sg_el = sg_el->prev) {
+        if (sg_el->sg->release_trigger)
+          break;
+      }
+      if (sg_el == NULL)
+        continue;
+      free_voice(sg_el);
+    }
+
+    start_voice(part_index, *it, key, velocity, gain, nframes, curframe);
+  }
+}
+
+void JMSampler::handle_note_off(const unsigned char* midi_msg, size_t nframes, size_t curframe) {
   //cerr << "event: note off; note: " << midi_msg[1] << endl;
+  int chan = midi_msg[0] & 0x0f;
   // find all sound gens assigned to this pitch
   for (sg_list_el* sg_el = sound_gens.get_head_ptr(); sg_el != NULL; sg_el = sg_el->next) {
-    if (sg_el->sg->pitch == midi_msg[1]) {
+    const jm::part& part = parts[sg_el->sg->part];
+    if ((int) *part.channel == chan && sg_el->sg->pitch == midi_msg[1]) {
       // note off does not apply to one shot
       if (!sg_el->sg->one_shot) {
         // if sustaining, just mark for removal later
-        if (sustain_on) {
+        if (part.sustain_on) {
           sg_el->sg->note_off = true;
         }
         // not sustaining, remove immediately
@@ -517,40 +2166,133 @@ void JMSampler::handle_note_off(const unsigned char* midi_msg) {
       }
     }
   }
+
+  for (int i = 0; i < NUM_PARTS; ++i) {
+    jm::part& part = parts[i];
+    if ((int) *part.channel != chan)
+      continue;
+    // release samples wait for the pedal like the note does
+    if (part.sustain_on)
+      part.release_pending[midi_msg[1]] = true;
+    else
+      note_up(i, midi_msg[1], nframes, curframe);
+  }
 }
 
-void JMSampler::handle_sustain(const unsigned char* midi_msg) {
-  // >= 64 turns on sustain
-  if (midi_msg[2] >= 64) {
-    sustain_on = true;
-    //cerr << "sustain on" << endl;
+void JMSampler::handle_sustain(const unsigned char* midi_msg, size_t nframes, size_t curframe) {
+  int chan = midi_msg[0] & 0x0f;
+  for (int i = 0; i < NUM_PARTS; ++i) {
+    jm::part& part = parts[i];
+    if ((int) *part.channel != chan)
+      continue;
+
+    // >= 64 turns on sustain
+    if (midi_msg[2] >= 64) {
+      part.sustain_on = true;
+      //cerr << "sustain on" << endl;
+    }
+    // < 64 turns ustain off
+    else if (part.sustain_on) {
+      for (sg_list_el* sg_el = sound_gens.get_head_ptr(); sg_el != NULL; sg_el = sg_el->next) {
+        // turn off all sound gens marked with previous note off
+        if (sg_el->sg->part == i && sg_el->sg->note_off == true)
+          sg_el->sg->set_release();
+      }
+
+      part.sustain_on = false;
+      for (int key = NOTE_MIN; key <= NOTE_MAX; ++key) {
+        if (part.release_pending[key]) {
+          part.release_pending[key] = false;
+          note_up(i, key, nframes, curframe);
+        }
+      }
+      //cerr << "sustain off" << endl;
+    }
   }
-  // < 64 turns ustain off
-  else {
-    for (sg_list_el* sg_el = sound_gens.get_head_ptr(); sg_el != NULL; sg_el = sg_el->next) {
-      // turn off all sound gens marked with previous note off
-      if (sg_el->sg->note_off == true)
-        sg_el->sg->set_release();
+}
+
+void JMSampler::handle_control(const unsigned char* midi_msg) {
+  int chan = midi_msg[0] & 0x0f;
+  int val = midi_msg[2];
+  for (int i = 0; i < NUM_PARTS; ++i) {
+    jm::part& part = parts[i];
+    if ((int) *part.channel != chan)
+      continue;
+
+    switch (midi_msg[1]) {
+      case 1:
+        part.cc_mod = val / 127.f;
+        break;
+      // volume and expression follow the usual squared curve
+      case 7:
+        part.cc_volume = val * val / (127.f * 127.f);
+        break;
+      case 11:
+        part.cc_expression = val * val / (127.f * 127.f);
+        break;
+      // 64 is center
+      case 10:
+        part.cc_pan = val < 64 ? val / 128.f: .5f + (val - 64) / 126.f;
+        break;
+      default:
+        break;
     }
+  }
+}
 
-    sustain_on = false;
-    //cerr << "sustain off" << endl;
+void JMSampler::handle_pitch_bend(const unsigned char* midi_msg) {
+  int chan = midi_msg[0] & 0x0f;
+  int val = ((midi_msg[2] << 7) | midi_msg[1]) - 8192;
+  for (int i = 0; i < NUM_PARTS; ++i) {
+    if ((int) *parts[i].channel == chan)
+      parts[i].bend = val / (val < 0 ? 8192.f: 8191.f);
   }
 }
 
-void JMSampler::process_frame(size_t curframe, float* out1, float* out2) {
-  // loop sound gens and fill audio buffer at current time (frame) position
-  for (sg_list_el* sg_el = sound_gens.get_head_ptr(); sg_el != NULL; sg_el = sg_el->next) {
-    float amp = get_amp(*volume);
+void JMSampler::process_frame(size_t curframe, float** outs) {
+  bool control = curframe % control_frames == 0;
+  sg_list_el* sg_el;
+  // loop sound gens and fill audio buffer at current time (frame) position;
+  // filtered voices park their values in the filter bank instead
+  for (sg_el = sound_gens.get_head_ptr(); sg_el != NULL; sg_el = sg_el->next) {
     float values[2];
     sg_el->sg->get_values(values);
-    out1[curframe] += amp * values[0];
-    out2[curframe] += amp * values[1];
+    int m = sg_el->sg->mod;
+    if (m >= 0) {
+      float amp = mods.amp_at(m, curframe);
+      values[0] *= amp;
+      values[1] *= amp;
+    }
+    int f = sg_el->sg->filter;
+    if (f >= 0) {
+      if (control)
+        filters.update(f, sg_el->sg->is_released(), m >= 0 ? mods.cutoff_at(m, curframe): 0.f);
+      filters.in[0][f] = values[0];
+      filters.in[1][f] = values[1];
+      continue;
+    }
 
-    sg_el->sg->inc();
-    if (sg_el->sg->is_finished()) {
-      sg_el->sg->release_resources();
-      sound_gens.remove(sg_el);
+    const jm::part& part = parts[sg_el->sg->part];
+    float** out = outs + 2 * sg_el->sg->output;
+    out[0][curframe] += (part.gain[0] + part.gain_step[0] * curframe) * values[0];
+    out[1][curframe] += (part.gain[1] + part.gain_step[1] * curframe) * values[1];
+  }
+
+  // run every voice filter at once, then mix what came out
+  if (filters.end > 0)
+    filters.process();
+
+  for (sg_el = sound_gens.get_head_ptr(); sg_el != NULL; sg_el = sg_el->next) {
+    int f = sg_el->sg->filter;
+    if (f >= 0) {
+      const jm::part& part = parts[sg_el->sg->part];
+      float** out = outs + 2 * sg_el->sg->output;
+      out[0][curframe] += (part.gain[0] + part.gain_step[0] * curframe) * filters.out[0][f];
+      out[1][curframe] += (part.gain[1] + part.gain_step[1] * curframe) * filters.out[1][f];
     }
+
+    sg_el->sg->inc();
+    if (sg_el->sg->is_finished())
+      free_voice(sg_el);
   }
 }
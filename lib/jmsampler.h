@@ -21,55 +21,456 @@
 #define JMSAMPLER_H
 
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <time.h>
 #include <cmath>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
 
 #include "zone.h"
 #include "wave.h"
 #include "sfzparser.h"
+#include "jmzb.h"
+#include "uimsg.h"
 #include "collections.h"
 #include "components.h"
 
-#define POLYPHONY 10
+// voices shared by all parts
+#define POLYPHONY 64
+// voices of the shared pool only release triggered samples may take, so
+// a burst of note offs never steals sounding notes
+#define RELEASE_RESERVE 8
+// default voice budget of each part
+#define PART_POLYPHONY 10
+#define NUM_PARTS 16
+#define DECODE_THREADS 4
 #define VOL_STEPS 17
+// voices of a replaced patch fade out over this long
+#define SWAP_FADE_MS 20
+// time constant pitch bend is smoothed with
+#define BEND_SMOOTH_MS 10
+// lines waiting for the ui writer before senders have to wait
+#define UI_QUEUE_SIZE 1024
+// control messages waiting for the audio thread before senders have to wait
+#define CTL_QUEUE_SIZE 256
+// cpu governor: share of the period callbacks may take before the voice cap
+// tightens, and below which it relaxes again
+#define GOV_HIGH_LOAD .75f
+#define GOV_LOW_LOAD .5f
+// fewest voices the cap goes down to
+#define GOV_MIN_VOICES 8
+// least time between two cap changes
+#define GOV_HOLD_MS 100
+// time constants the load figure rises and falls with
+#define GOV_RISE_MS 10
+#define GOV_FALL_MS 300
+// how often the ui writer reports metrics
+#define METRICS_MS 250
+// voices louder than QUALITY_HIGH_DB play through the sinc converter, those
+// louder than QUALITY_MID_DB through the linear one and the rest through zero
+// order hold. both rise by up to QUALITY_LOAD_DB as callback load goes from
+// GOV_LOW_LOAD to GOV_HIGH_LOAD, and past it no voice gets the sinc converter
+#define QUALITY_HIGH_DB -30.f
+#define QUALITY_MID_DB -60.f
+#define QUALITY_LOAD_DB 24.f
 
-class JMSampler {
-  private:
+namespace jm {
+  // a decoded wave shared by every patch playing it
+  struct cached_wave {
+    jm::wave wav;
+    std::string path;
+    // patches (or a load in progress) holding it; guarded by wave_lock
+    int refs;
+  };
+
+  // everything note on reads from a loaded patch. the ui edits its own copy;
+  // the audio thread is handed another by pointer at a block boundary, keeps it
+  // in step through control messages and only lets it go once no voice plays from it
+  struct patch {
+    std::vector<jm::zone> zones;
+    jm::zone_index index;
+    int solo_count;
+    // one ref on every wave zones have pointed at during the patch's life
+    std::set<jm::cached_wave*> waves;
+    // voices playing from this patch; audio thread only
+    int voices;
+    // set once replaced and silent; collect_garbage frees it then
+    std::atomic<bool> dead;
+  };
+
+  // one instrument of the engine, playing its own patch on its own midi channel
+  struct part {
+    // latest published patch; ui edits and the loader change it under zone_lock.
+    // the audio thread never reads it
+    jm::patch* patch;
+    // copy of patch last sent to the audio thread; zone edits are addressed to it.
+    // changed under zone_lock
+    jm::patch* sent;
+    // patch the audio thread plays new notes from
+    jm::patch* playing;
+    // point at host ports if there are any, otherwise at vol_val and chan_val;
+    // only the audio thread writes through them
+    float* volume;
+    float* channel;
+    float vol_val;
+    float chan_val;
+    // voices this part may hold at once; changed under zone_lock
+    int polyphony;
+    // the same for the audio thread
+    int voice_limit;
     int zone_number;
-    // state
+    // set to abandon a load in progress
+    std::atomic<bool> cancel_load;
+    // audio thread only
     bool sustain_on;
-    int solo_count;
+    int voices;
+    // left and right mix gain at the start of the block and their per frame step;
+    // volume, expression and pan ramp across a block instead of jumping
+    float gain[2];
+    float gain_step[2];
+    // midi controllers; bend in [-1, 1], pan in [0, 1]
+    float bend;
+    float bend_smooth;
+    float cc_volume;
+    float cc_expression;
+    float cc_pan;
+    float cc_mod;
+    // note ons seen per key, for round robin
+    unsigned int seq_counters[NOTE_MAX + 1];
+    // velocity, block time and random draw of each key's last note on, for release triggers
+    int key_vel[NOTE_MAX + 1];
+    uint64_t key_on_time[NOTE_MAX + 1];
+    float key_rand[NOTE_MAX + 1];
+    // key went up while sustained; release triggers fire on pedal up
+    bool release_pending[NOTE_MAX + 1];
+  };
+
+  // voice buffers for blocks of up to nframes; built off the audio thread
+  // and swapped in whole at a block boundary when the host's blocks grow
+  struct scratch {
+    size_t nframes;
+    // one stereo buffer per playhead
+    float* out_bufs[POLYPHONY];
+    float* mod_pitch;
+    float* mod_amp;
+    float* mod_cutoff;
+  };
+
+  enum ctl_type {
+    CTL_VOLUME,
+    CTL_CHANNEL,
+    CTL_POLYPHONY,
+    // a scalar zone field; index and key as for update_zone
+    CTL_ZONE,
+    // a wave finished decoding for zone index
+    CTL_WAVE,
+    // play from a new patch; fade says whether old voices fade out or ring on
+    CTL_PATCH
+  };
+
+  // everything the ui and loaders change on the audio thread's side
+  struct ctl_msg {
+    ctl_type type;
+    int part;
+    // patch a zone message is meant for, or the one to swap in
+    jm::patch* patch;
+    int index;
+    int key;
+    bool fade;
+    union {
+      int i;
+      double d;
+      const jm::wave* wave;
+    } data;
+  };
+
+  // what a queued ui message may be coalesced with
+  enum ui_key {
+    // zone list changes; never dropped and nothing coalesces across them
+    UI_ORDERED = 0,
+    UI_VOL,
+    UI_CHAN,
+    UI_PROGRESS,
+    // plus the zone index
+    UI_WAVE
+  };
+
+  // one or more encoded messages for the ui, see uimsg.h
+  struct ui_msg {
+    // a later record with the same nonzero key replaces this one if the
+    // writer finds both queued; -1 once replaced
+    int key;
+    // ui the record was meant for; records for a ui since replaced are dropped
+    unsigned int gen;
+    // owned by the record; freed by the writer
+    char* data;
+    size_t len;
+  };
+
+  // a ui the writer sends to
+  struct ui_out {
+    FILE* f;
+    // records queued before the ui was attached aren't meant for it
+    unsigned int gen;
+  };
+
+  // callback load and what the cpu governor made of it
+  struct metrics {
+    // time callbacks took as a share of the period, smoothed, and the
+    // longest single one over the last second
+    float load;
+    float peak;
+    int voices;
+    // voices the governor allows at once; POLYPHONY when it isn't holding back
+    int voice_cap;
+    // voices cut to stay under the cap since start
+    int steals;
+  };
+
+  // a wave queued on the decode pool
+  struct decode_job {
+    std::string path;
+    // mip levels the zones playing it want
+    int mips;
+    jm::cached_wave* cw;
+    std::string error;
+    bool done;
+  };
+};
+
+class JMSampler {
+  private:
     SoundGenList sound_gens;
+    FilterBank filters;
+    ModBank mods;
+    // every patch not yet freed; guarded by wave_lock
+    std::vector<jm::patch*> patches;
+    // audio thread retired a patch since take_retired was last called
+    bool retired;
+    // xorshift state for random layers; audio thread only
+    uint32_t rand_state;
+    // frames processed before the current and next block; audio thread only
+    uint64_t block_time;
+    uint64_t next_block_time;
+    // voices playing release triggered samples; audio thread only
+    int release_voices;
+    // length of the previous block, over which part gains ramped
+    size_t last_nframes;
+    // longest block the voice buffers hold; audio thread only
+    size_t max_nframes;
+    // longest block the host said it will run
+    std::atomic<size_t> wanted_nframes;
+    // size of the newest buffers collect_garbage built
+    size_t built_nframes;
+    // asked the collector for larger buffers and none swapped in yet; audio thread only
+    bool growing;
+    // larger buffers waiting for the audio thread, and the ones it swapped out
+    std::atomic<jm::scratch*> pending_scratch;
+    std::atomic<jm::scratch*> old_scratch;
+    // rendering off line as the host asked; set by set_freewheel once the
+    // sinc converters exist, taken up at the next block
+    std::atomic<bool> wanted_freewheel;
+    // audio thread only
+    bool freewheel;
+
+    // cpu governor state; audio thread only
+    timespec cycle_start;
+    float load_avg;
+    float load_peak;
+    // frames into the current peak window and since the cap last changed
+    size_t peak_frames;
+    size_t cap_frames;
+    int voice_cap;
+    int steals;
+    // gains a voice needs for each converter this block
+    float high_level;
+    float mid_level;
+    // governor turned on by the host
+    std::atomic<bool> governor;
+    // what the audio thread last published for get_metrics
+    std::atomic<float> pub_load;
+    std::atomic<float> pub_peak;
+    std::atomic<int> pub_voices;
+    std::atomic<int> pub_cap;
+    std::atomic<int> pub_steals;
+    // cycles measured; the writer only reports metrics when it moved
+    std::atomic<unsigned int> cycles;
 
+    // control messages on their way to the audio thread, drained at the start
+    // of each block; senders take ctl_q_lock so the audio thread is the single consumer
+    JMRing<jm::ctl_msg> ctl_q;
+    pthread_mutex_t ctl_q_lock;
+
+    // lines on their way to the ui; senders take ui_q_lock so the
+    // writer thread is the single consumer
+    JMRing<jm::ui_msg> ui_q;
+    pthread_mutex_t ui_q_lock;
+    // posted for each queued message
+    sem_t ui_sem;
+    pthread_t ui_writer;
+    std::atomic<bool> ui_quit;
+    // bumped by set_ui and add_ui; changed under fout_lock and ui_q_lock
+    unsigned int ui_gen;
+
+    // every playhead, pooled or playing
+    std::vector<Playhead*> playheads;
     JMStack<Playhead*> playhead_pool;
     JMStack<AmpEnvGenerator*> amp_gen_pool;
 
+    // decoders shared by every load in progress
+    pthread_t decoders[DECODE_THREADS];
+    std::deque<jm::decode_job*> decode_q;
+    pthread_mutex_t decode_lock;
+    // new jobs queued or shutting down
+    pthread_cond_t decode_cond;
+    // some job finished
+    pthread_cond_t decoded_cond;
+    bool decode_quit;
+
+    static void* decode_thread(void* arg);
+    static void* ui_thread(void* arg);
+    void send(int key, const jm::msg_writer& msg);
+    void wait_decode(jm::decode_job* job);
+    void drop_decodes(std::vector<jm::decode_job>& jobs, size_t from);
+    void zone_from_region(const sfz::sfz& s, const sfz::region& region, int* number, jm::zone* zone);
+    void attach_wave(jm::zone* zone, const jm::wave& wav);
+    void rescale_compiled(jm::jmzb* compiled);
+    void publish_patch(int part, const jm::jmzb& compiled, std::set<jm::cached_wave*>& refs, int number);
+    void publish(int part, jm::patch* new_patch);
+    void hold_wave(jm::patch* p, jm::cached_wave* cw);
+    void grow_mips(jm::cached_wave* cw, int mips);
+    void refresh_mips(int part, int index);
+    void share_wave(jm::patch* p, jm::cached_wave* cw);
+    jm::patch* copy_patch(const jm::patch* p);
+    void send_copy(int part, bool fade);
+    void send_control(const jm::ctl_msg& msg);
+    void apply_control(const jm::ctl_msg& msg);
+    void unref_wave_locked(jm::cached_wave* cw);
+    void compile_patch(jm::jmzb* compiled);
+    void send_part();
+    void free_voice(sg_list_el* sg_el);
+    void free_scratch(jm::scratch* s);
+    void swap_scratch();
+    // uniform in [0, 1)
+    float next_rand() {
+      rand_state ^= rand_state << 13;
+      rand_state ^= rand_state >> 17;
+      rand_state ^= rand_state << 5;
+      return (rand_state >> 8) / 16777216.f;
+    }
+    void note_on(int part, const unsigned char* midi_msg, size_t nframes, size_t curframe);
+    void note_up(int part, int key, size_t nframes, size_t curframe);
+    void start_voice(int part, const jm::zone& zone, int key, int velocity, float gain, size_t nframes, size_t curframe);
+    void steal_for_cap();
+    int quality_for(float level) {
+      return level >= high_level ? jm::QUALITY_HIGH: (level >= mid_level ? jm::QUALITY_MID: jm::QUALITY_LOW);
+    }
+
   public:
-    FILE* fout;
+    // pipes to the attached uis; only the writer thread writes them, changed
+    // through set_ui, add_ui and remove_ui under fout_lock
+    std::vector<jm::ui_out> fouts;
     int sample_rate;
-    float* volume;
-    float* channel;
-    sfz::sfz patch;
-    std::map<std::string, jm::wave> waves;
-    std::vector<jm::zone> zones;
+    // stereo buses process_frame mixes into; zones routed past the last go to the first
+    int num_outputs;
+    // frames between modulation and filter updates
+    int control_frames;
+    // decode waves straight to sample_rate so untransposed voices skip the resampler;
+    // only affects waves decoded after it changes
+    bool convert_waves;
+    // decoded waves by path
+    std::map<std::string, jm::cached_wave*> waves;
+    jm::part parts[NUM_PARTS];
+    // part the ui is showing and editing; changed under zone_lock
+    int edit_part;
     pthread_mutex_t zone_lock;
-    JMSampler(int sample_rate, size_t in_nframes, size_t out_nframes);
+    // guards waves, wave refs and patches; taken after zone_lock when both are needed
+    pthread_mutex_t wave_lock;
+    // held by the writer thread while writing fouts; taken after zone_lock when both are needed
+    pthread_mutex_t fout_lock;
+    // held while adding mip levels to a cached wave; taken with no other lock held
+    pthread_mutex_t mip_lock;
+    JMSampler(int sample_rate, size_t in_nframes, size_t out_nframes, int num_outputs = 1,
+      int control_frames = CONTROL_FRAMES);
     virtual ~JMSampler();
+    // point the writer at a new ui, or NULL for none; lines still queued for the
+    // old one are dropped. returns the old one for the caller to close.
+    // for hosts with a single ui
+    FILE* set_ui(FILE* f);
+    // several uis at once; each gets what is sent after it was added and
+    // messages go to all of them. a ui whose stream fails is skipped until removed
+    void add_ui(FILE* f);
+    // once this returns the writer is done with f and the caller may close it
+    void remove_ui(FILE* f);
+    // these only queue a line; none of them wait on the ui
+    void send_sample_rate();
     void send_add_zone(int index);
+    void send_remove_zone(int index);
     void send_update_wave(int index);
-    void add_zone_from_wave(int index, const char* path);
-    void update_zone_from_wave(int index, const char* path);
-    void add_zone_from_region(const std::map<std::string, SFZValue>& region);
-    void duplicate_zone(int index);
-    void remove_zone(int index);
-    void load_patch(const char* path);
+    void send_update_vol(float val);
+    void send_update_chan(int val);
+    void send_load_progress(int loaded, int total);
+    // returns the wave with a ref taken for the caller and at least mips
+    // levels, or as many as it is long enough for
+    jm::cached_wave* ref_wave(const char* path, int mips = MAX_MIPS);
+    void unref_wave(jm::cached_wave* cw);
+    // frees replaced patches once silent and builds larger voice buffers
+    // when the host's blocks grew; call from a non-RT thread
+    void collect_garbage();
+    // audio thread only; true if collect_garbage has something to do
+    bool take_retired();
+    // the host will now run blocks of up to nframes; safe from any thread.
+    // buffers grow through collect_garbage, so run blocks no longer than
+    // block_frames until they do
+    void set_buffer_size(size_t nframes) {wanted_nframes = nframes;}
+    // longest block pre_process may be given; audio thread only
+    size_t block_frames() {return max_nframes;}
+    // the host renders off line with no deadline: voices started from the
+    // next block on use the sinc converter and part voice limits are lifted.
+    // may allocate, so not from the audio thread
+    void set_freewheel(bool on);
+    // cpu governor: while on, callbacks running close to the period lower the
+    // number of voices that may play at once and it rises again with headroom.
+    // off by default; safe from any thread
+    void set_governor(bool on) {governor = on;}
+    // hosts bracket each callback with these, on the audio thread, so the
+    // governor and metrics see how long it took against the nframes period;
+    // control messages sent from in between are applied rather than waited on
+    void begin_cycle();
+    void end_cycle(size_t nframes);
+    // latest figures; safe from any thread
+    void get_metrics(jm::metrics* m);
+    // switch the part the ui edits and resend its contents
+    void select_part(int part);
+    void set_polyphony(int part, int polyphony);
+    // take effect at the start of the next block
+    void set_volume(int part, float volume);
+    void set_channel(int part, int channel);
+    // zone edits name the part they were made on, which the ui may have
+    // since switched away from; the ui only hears of changes to edit_part
+    void add_zone_from_wave(int part, int index, const char* path);
+    void duplicate_zone(int part, int index);
+    void remove_zone(int part, int index);
+    // acts on edit_part
     void save_patch(const char* path);
-    void reload_waves();
-    void update_zone(int index, int key, const char* val);
+    void reload_waves(int part);
+    void update_zone(int part, int index, int key, const char* val);
+    void load_patch(int part, const char* path);
     void pre_process(size_t nframes);
+    // midi handlers route to every part listening on the message's channel
     void handle_note_on(const unsigned char* midi_msg, size_t nframes, size_t curframe);
-    void handle_note_off(const unsigned char* midi_msg);
-    void handle_sustain(const unsigned char* midi_msg);
-    void process_frame(size_t curframe, float* out1, float* out2);
+    void handle_note_off(const unsigned char* midi_msg, size_t nframes, size_t curframe);
+    void handle_sustain(const unsigned char* midi_msg, size_t nframes, size_t curframe);
+    // mod wheel, volume, expression and pan; sustain goes to handle_sustain
+    void handle_control(const unsigned char* midi_msg);
+    void handle_pitch_bend(const unsigned char* midi_msg);
+    // outs holds left and right buffers for each bus: outs[2 * bus], outs[2 * bus + 1]
+    void process_frame(size_t curframe, float** outs);
 };
 
 inline float get_amp(float index) {
@@ -0,0 +1,565 @@
+/****************************************************************************
+    Copyright (C) 2017  jmage619
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*****************************************************************************/
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <climits>
+#include <sstream>
+#include <stdexcept>
+#include <functional>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+
+#include "zone.h"
+#include "jmzb.h"
+
+namespace {
+  const char MAGIC[4] = {'J', 'M', 'Z', 'B'};
+
+  // on disk layout, in order:
+  // file_header, zone_rec[num_zones], int32 key_offsets[NOTE_MAX + 2],
+  // int32 index[num_index], dep_rec[num_deps], char strings[strings_size]
+  // all native endian; compiled patches are not meant to move between machines
+  struct file_header {
+    char magic[4];
+    uint32_t version;
+    int32_t sample_rate;
+    int32_t has_control;
+    float volume;
+    int32_t channel;
+    uint32_t num_zones;
+    uint32_t num_index;
+    uint32_t num_deps;
+    uint32_t strings_size;
+  };
+
+  struct zone_rec {
+    int32_t start;
+    int32_t left;
+    int32_t right;
+    int32_t low_key;
+    int32_t high_key;
+    int32_t origin;
+    int32_t low_vel;
+    int32_t high_vel;
+    float amp;
+    int32_t mute;
+    int32_t solo;
+    int32_t attack;
+    int32_t hold;
+    int32_t decay;
+    float sustain;
+    int32_t release;
+    int32_t long_tail;
+    int32_t loop_mode;
+    int32_t group;
+    int32_t off_group;
+    int32_t crossfade;
+    int32_t output;
+    int32_t seq_length;
+    int32_t seq_position;
+    float lorand;
+    float hirand;
+    int32_t xfin_lovel;
+    int32_t xfin_hivel;
+    int32_t xfout_lovel;
+    int32_t xfout_hivel;
+    int32_t xfin_lokey;
+    int32_t xfin_hikey;
+    int32_t xfout_lokey;
+    int32_t xfout_hikey;
+    int32_t xf_velcurve;
+    int32_t xf_keycurve;
+    int32_t trigger;
+    float rt_decay;
+    int32_t bend_up;
+    int32_t bend_down;
+    int32_t fil_type;
+    float cutoff;
+    float resonance;
+    int32_t fil_veltrack;
+    int32_t fileg_attack;
+    int32_t fileg_hold;
+    int32_t fileg_decay;
+    float fileg_sustain;
+    int32_t fileg_release;
+    int32_t fileg_depth;
+    float amplfo_freq;
+    float amplfo_depth;
+    float amplfo_depthcc1;
+    int32_t amplfo_delay;
+    float pitchlfo_freq;
+    float pitchlfo_depth;
+    float pitchlfo_depthcc1;
+    int32_t pitchlfo_delay;
+    float fillfo_freq;
+    float fillfo_depth;
+    float fillfo_depthcc1;
+    int32_t fillfo_delay;
+    int32_t pitcheg_attack;
+    int32_t pitcheg_hold;
+    int32_t pitcheg_decay;
+    float pitcheg_sustain;
+    int32_t pitcheg_release;
+    int32_t pitcheg_depth;
+    int32_t pitcheg_vel2depth;
+    double pitch_corr;
+    // string table offsets
+    uint32_t name;
+    uint32_t path;
+  };
+
+  struct dep_rec {
+    int64_t mtime;
+    int64_t size;
+    uint32_t path;
+  };
+
+  class StringTable {
+    private:
+      std::map<std::string, uint32_t> offsets;
+    public:
+      std::string data;
+      uint32_t add(const std::string& str) {
+        std::map<std::string, uint32_t>::iterator it = offsets.find(str);
+        if (it != offsets.end())
+          return it->second;
+
+        uint32_t off = data.size();
+        data += str;
+        data += '\0';
+        offsets[str] = off;
+        return off;
+      }
+  };
+
+  class Reader {
+    private:
+      const char* buf;
+      size_t size;
+      size_t pos;
+    public:
+      Reader(const char* buf, size_t size): buf(buf), size(size), pos(0) {}
+      void read(void* dest, size_t len) {
+        if (pos + len > size)
+          throw std::runtime_error("jmzb file truncated");
+        memcpy(dest, buf + pos, len);
+        pos += len;
+      }
+      const char* cur() {return buf + pos;}
+      size_t remaining() {return size - pos;}
+  };
+
+  std::string dir_of(const char* path) {
+    char tmp_str[PATH_MAX];
+    strncpy(tmp_str, path, PATH_MAX - 1);
+    tmp_str[PATH_MAX - 1] = '\0';
+    std::string dir(dirname(tmp_str));
+    dir += "/";
+    return dir;
+  }
+};
+
+void jm::write_jmzb(const char* path, const jmzb& patch) {
+  std::string dir = dir_of(path);
+  StringTable strings;
+
+  std::vector<zone_rec> zone_recs(patch.zones.size());
+  for (size_t i = 0; i < patch.zones.size(); ++i) {
+    const jm::zone& z = patch.zones[i];
+    zone_rec& r = zone_recs[i];
+    memset(&r, 0, sizeof(r));
+    r.start = z.start;
+    r.left = z.left;
+    r.right = z.right;
+    r.low_key = z.low_key;
+    r.high_key = z.high_key;
+    r.origin = z.origin;
+    r.low_vel = z.low_vel;
+    r.high_vel = z.high_vel;
+    r.amp = z.amp;
+    r.mute = z.mute;
+    r.solo = z.solo;
+    r.attack = z.attack;
+    r.hold = z.hold;
+    r.decay = z.decay;
+    r.sustain = z.sustain;
+    r.release = z.release;
+    r.long_tail = z.long_tail;
+    r.loop_mode = z.loop_mode;
+    r.group = z.group;
+    r.off_group = z.off_group;
+    r.crossfade = z.crossfade;
+    r.output = z.output;
+    r.seq_length = z.seq_length;
+    r.seq_position = z.seq_position;
+    r.lorand = z.lorand;
+    r.hirand = z.hirand;
+    r.xfin_lovel = z.xfin_lovel;
+    r.xfin_hivel = z.xfin_hivel;
+    r.xfout_lovel = z.xfout_lovel;
+    r.xfout_hivel = z.xfout_hivel;
+    r.xfin_lokey = z.xfin_lokey;
+    r.xfin_hikey = z.xfin_hikey;
+    r.xfout_lokey = z.xfout_lokey;
+    r.xfout_hikey = z.xfout_hikey;
+    r.xf_velcurve = z.xf_velcurve;
+    r.xf_keycurve = z.xf_keycurve;
+    r.trigger = z.trigger;
+    r.rt_decay = z.rt_decay;
+    r.bend_up = z.bend_up;
+    r.bend_down = z.bend_down;
+    r.fil_type = z.fil_type;
+    r.cutoff = z.cutoff;
+    r.resonance = z.resonance;
+    r.fil_veltrack = z.fil_veltrack;
+    r.fileg_attack = z.fileg_attack;
+    r.fileg_hold = z.fileg_hold;
+    r.fileg_decay = z.fileg_decay;
+    r.fileg_sustain = z.fileg_sustain;
+    r.fileg_release = z.fileg_release;
+    r.fileg_depth = z.fileg_depth;
+    r.amplfo_freq = z.amplfo.freq;
+    r.amplfo_depth = z.amplfo.depth;
+    r.amplfo_depthcc1 = z.amplfo.depthcc1;
+    r.amplfo_delay = z.amplfo.delay;
+    r.pitchlfo_freq = z.pitchlfo.freq;
+    r.pitchlfo_depth = z.pitchlfo.depth;
+    r.pitchlfo_depthcc1 = z.pitchlfo.depthcc1;
+    r.pitchlfo_delay = z.pitchlfo.delay;
+    r.fillfo_freq = z.fillfo.freq;
+    r.fillfo_depth = z.fillfo.depth;
+    r.fillfo_depthcc1 = z.fillfo.depthcc1;
+    r.fillfo_delay = z.fillfo.delay;
+    r.pitcheg_attack = z.pitcheg.attack;
+    r.pitcheg_hold = z.pitcheg.hold;
+    r.pitcheg_decay = z.pitcheg.decay;
+    r.pitcheg_sustain = z.pitcheg.sustain;
+    r.pitcheg_release = z.pitcheg.release;
+    r.pitcheg_depth = z.pitcheg.depth;
+    r.pitcheg_vel2depth = z.pitcheg.vel2depth;
+    r.pitch_corr = z.pitch_corr;
+    r.name = strings.add(z.name);
+
+    // samples next to the patch are stored relative so the pair can be moved
+    std::string wav_path(z.path);
+    if (!wav_path.compare(0, dir.size(), dir))
+      wav_path.erase(0, dir.size());
+    r.path = strings.add(wav_path);
+  }
+
+  std::vector<dep_rec> dep_recs(patch.deps.size());
+  for (size_t i = 0; i < patch.deps.size(); ++i) {
+    struct stat sb;
+    if (stat(patch.deps[i].path.c_str(), &sb))
+      throw std::runtime_error("unable to access file: " + patch.deps[i].path);
+
+    memset(&dep_recs[i], 0, sizeof(dep_rec));
+    dep_recs[i].mtime = sb.st_mtime;
+    dep_recs[i].size = sb.st_size;
+    dep_recs[i].path = strings.add(patch.deps[i].path);
+  }
+
+  file_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = JMZB_VERSION;
+  header.sample_rate = patch.sample_rate;
+  header.has_control = patch.has_control;
+  header.volume = patch.volume;
+  header.channel = patch.channel;
+  header.num_zones = zone_recs.size();
+  header.num_index = patch.index.zones.size();
+  header.num_deps = dep_recs.size();
+  header.strings_size = strings.data.size();
+
+  std::string buf;
+  buf.append((const char*) &header, sizeof(header));
+  if (!zone_recs.empty())
+    buf.append((const char*) &zone_recs[0], zone_recs.size() * sizeof(zone_rec));
+  for (int k = 0; k <= NOTE_MAX + 1; ++k) {
+    int32_t off = patch.index.key_offsets[k];
+    buf.append((const char*) &off, sizeof(off));
+  }
+  for (size_t i = 0; i < patch.index.zones.size(); ++i) {
+    int32_t zone_i = patch.index.zones[i];
+    buf.append((const char*) &zone_i, sizeof(zone_i));
+  }
+  if (!dep_recs.empty())
+    buf.append((const char*) &dep_recs[0], dep_recs.size() * sizeof(dep_rec));
+  buf.append(strings.data);
+
+  // write to a temp file and rename so readers never see a partial patch
+  std::string tmp_path(path);
+  std::ostringstream sout;
+  sout << ".tmp" << getpid();
+  tmp_path += sout.str();
+
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    throw std::runtime_error(std::string("unable to write file: ") + path);
+
+  const char* p = buf.data();
+  size_t left = buf.size();
+  while (left > 0) {
+    ssize_t n = write(fd, p, left);
+    if (n <= 0) {
+      close(fd);
+      unlink(tmp_path.c_str());
+      throw std::runtime_error(std::string("unable to write file: ") + path);
+    }
+    p += n;
+    left -= n;
+  }
+  close(fd);
+
+  if (rename(tmp_path.c_str(), path)) {
+    unlink(tmp_path.c_str());
+    throw std::runtime_error(std::string("unable to write file: ") + path);
+  }
+}
+
+void jm::read_jmzb(const char* path, jmzb* patch) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error(std::string("unable to open file: ") + path);
+
+  struct stat sb;
+  if (fstat(fd, &sb)) {
+    close(fd);
+    throw std::runtime_error(std::string("unable to access file: ") + path);
+  }
+
+  // whole file in one read
+  std::vector<char> buf(sb.st_size);
+  ssize_t n = sb.st_size > 0 ? read(fd, &buf[0], sb.st_size): 0;
+  close(fd);
+  if (n != sb.st_size)
+    throw std::runtime_error(std::string("error reading file: ") + path);
+
+  Reader in(buf.empty() ? NULL: &buf[0], buf.size());
+
+  file_header header;
+  in.read(&header, sizeof(header));
+  if (memcmp(header.magic, MAGIC, sizeof(MAGIC)))
+    throw std::runtime_error(std::string("not a jmzb file: ") + path);
+  if (header.version != JMZB_VERSION)
+    throw std::runtime_error(std::string("unsupported jmzb version: ") + path);
+
+  // counts are checked against what is left before anything is sized by them
+  uint64_t table_size = (uint64_t) header.num_zones * sizeof(zone_rec) +
+    (NOTE_MAX + 2) * sizeof(int32_t) + (uint64_t) header.num_index * sizeof(int32_t) +
+    (uint64_t) header.num_deps * sizeof(dep_rec);
+  if (table_size > in.remaining())
+    throw std::runtime_error(std::string("jmzb file truncated: ") + path);
+
+  std::vector<zone_rec> zone_recs(header.num_zones);
+  if (header.num_zones > 0)
+    in.read(&zone_recs[0], header.num_zones * sizeof(zone_rec));
+
+  // note on walks the index by these, so they must start at 0, never go
+  // back and end at its length
+  for (int k = 0; k <= NOTE_MAX + 1; ++k) {
+    int32_t off;
+    in.read(&off, sizeof(off));
+    if (k == 0 ? off != 0: off < patch->index.key_offsets[k - 1])
+      throw std::runtime_error(std::string("corrupt jmzb index: ") + path);
+    patch->index.key_offsets[k] = off;
+  }
+  if ((uint32_t) patch->index.key_offsets[NOTE_MAX + 1] != header.num_index)
+    throw std::runtime_error(std::string("corrupt jmzb index: ") + path);
+
+  patch->index.zones.resize(header.num_index);
+  for (uint32_t i = 0; i < header.num_index; ++i) {
+    int32_t zone_i;
+    in.read(&zone_i, sizeof(zone_i));
+    if (zone_i < 0 || (uint32_t) zone_i >= header.num_zones)
+      throw std::runtime_error(std::string("corrupt jmzb index: ") + path);
+    patch->index.zones[i] = zone_i;
+  }
+
+  std::vector<dep_rec> dep_recs(header.num_deps);
+  if (header.num_deps > 0)
+    in.read(&dep_recs[0], header.num_deps * sizeof(dep_rec));
+
+  if (in.remaining() != header.strings_size || header.strings_size == 0 ||
+      in.cur()[header.strings_size - 1] != '\0')
+    throw std::runtime_error(std::string("corrupt jmzb string table: ") + path);
+  const char* strings = in.cur();
+
+  patch->sample_rate = header.sample_rate;
+  patch->has_control = header.has_control;
+  patch->volume = header.volume;
+  patch->channel = header.channel;
+
+  std::string dir = dir_of(path);
+
+  patch->zones.resize(header.num_zones);
+  for (uint32_t i = 0; i < header.num_zones; ++i) {
+    const zone_rec& r = zone_recs[i];
+    if (r.name >= header.strings_size || r.path >= header.strings_size)
+      throw std::runtime_error(std::string("corrupt jmzb zone: ") + path);
+
+    jm::zone& z = patch->zones[i];
+    jm::init_zone(&z);
+    z.wave = NULL;
+    z.num_channels = 0;
+    z.sample_rate = 0;
+    z.wave_length = 0;
+    z.start = r.start;
+    z.left = r.left;
+    z.right = r.right;
+    z.low_key = r.low_key;
+    z.high_key = r.high_key;
+    z.origin = r.origin;
+    z.low_vel = r.low_vel;
+    z.high_vel = r.high_vel;
+    z.amp = r.amp;
+    z.mute = r.mute;
+    z.solo = r.solo;
+    z.attack = r.attack;
+    z.hold = r.hold;
+    z.decay = r.decay;
+    z.sustain = r.sustain;
+    z.release = r.release;
+    z.long_tail = r.long_tail;
+    z.loop_mode = r.loop_mode >= jm::LOOP_UNSET && r.loop_mode <= jm::LOOP_ONE_SHOT ?
+      (jm::loop_mode) r.loop_mode: jm::LOOP_UNSET;
+    z.group = r.group;
+    z.off_group = r.off_group;
+    z.crossfade = r.crossfade;
+    z.output = r.output;
+    z.seq_length = r.seq_length;
+    z.seq_position = r.seq_position;
+    z.lorand = r.lorand;
+    z.hirand = r.hirand;
+    z.xfin_lovel = r.xfin_lovel;
+    z.xfin_hivel = r.xfin_hivel;
+    z.xfout_lovel = r.xfout_lovel;
+    z.xfout_hivel = r.xfout_hivel;
+    z.xfin_lokey = r.xfin_lokey;
+    z.xfin_hikey = r.xfin_hikey;
+    z.xfout_lokey = r.xfout_lokey;
+    z.xfout_hikey = r.xfout_hikey;
+    z.xf_velcurve = r.xf_velcurve == jm::XF_GAIN ? jm::XF_GAIN: jm::XF_POWER;
+    z.xf_keycurve = r.xf_keycurve == jm::XF_GAIN ? jm::XF_GAIN: jm::XF_POWER;
+    z.trigger = r.trigger == jm::TRIGGER_RELEASE ? jm::TRIGGER_RELEASE: jm::TRIGGER_ATTACK;
+    z.rt_decay = r.rt_decay;
+    z.bend_up = r.bend_up;
+    z.bend_down = r.bend_down;
+    z.fil_type = r.fil_type >= jm::FILTER_LPF_2P && r.fil_type <= jm::FILTER_BRF_2P ?
+      (jm::filter_type) r.fil_type: jm::FILTER_LPF_2P;
+    z.cutoff = r.cutoff;
+    z.resonance = r.resonance;
+    z.fil_veltrack = r.fil_veltrack;
+    z.fileg_attack = r.fileg_attack;
+    z.fileg_hold = r.fileg_hold;
+    z.fileg_decay = r.fileg_decay;
+    z.fileg_sustain = r.fileg_sustain;
+    z.fileg_release = r.fileg_release;
+    z.fileg_depth = r.fileg_depth;
+    z.amplfo.freq = r.amplfo_freq;
+    z.amplfo.depth = r.amplfo_depth;
+    z.amplfo.depthcc1 = r.amplfo_depthcc1;
+    z.amplfo.delay = r.amplfo_delay;
+    z.pitchlfo.freq = r.pitchlfo_freq;
+    z.pitchlfo.depth = r.pitchlfo_depth;
+    z.pitchlfo.depthcc1 = r.pitchlfo_depthcc1;
+    z.pitchlfo.delay = r.pitchlfo_delay;
+    z.fillfo.freq = r.fillfo_freq;
+    z.fillfo.depth = r.fillfo_depth;
+    z.fillfo.depthcc1 = r.fillfo_depthcc1;
+    z.fillfo.delay = r.fillfo_delay;
+    z.pitcheg.attack = r.pitcheg_attack;
+    z.pitcheg.hold = r.pitcheg_hold;
+    z.pitcheg.decay = r.pitcheg_decay;
+    z.pitcheg.sustain = r.pitcheg_sustain;
+    z.pitcheg.release = r.pitcheg_release;
+    z.pitcheg.depth = r.pitcheg_depth;
+    z.pitcheg.vel2depth = r.pitcheg_vel2depth;
+    z.pitch_corr = r.pitch_corr;
+    copy_str(z.name, strings + r.name, MAX_NAME);
+
+    // fields used as offsets or indexes; the rest only scale or compare
+    if (z.output < 0)
+      z.output = 0;
+    if (z.start < 0)
+      z.start = 0;
+    if (z.crossfade < 0)
+      z.crossfade = 0;
+
+    const char* wav_path = strings + r.path;
+    if (wav_path[0] == '/')
+      copy_str(z.path, wav_path, MAX_PATH);
+    else
+      copy_str(z.path, (dir + wav_path).c_str(), MAX_PATH);
+  }
+
+  // gain tables aren't stored; they're cheap to rebuild from the zones
+  jm::build_xf_tables(&patch->index, patch->zones);
+
+  patch->deps.resize(header.num_deps);
+  for (uint32_t i = 0; i < header.num_deps; ++i) {
+    if (dep_recs[i].path >= header.strings_size)
+      throw std::runtime_error(std::string("corrupt jmzb dependency: ") + path);
+    patch->deps[i].path = strings + dep_recs[i].path;
+    patch->deps[i].mtime = dep_recs[i].mtime;
+    patch->deps[i].size = dep_recs[i].size;
+  }
+}
+
+bool jm::jmzb_deps_current(const jmzb& patch) {
+  for (size_t i = 0; i < patch.deps.size(); ++i) {
+    struct stat sb;
+    if (stat(patch.deps[i].path.c_str(), &sb) || sb.st_mtime != patch.deps[i].mtime ||
+        sb.st_size != patch.deps[i].size)
+      return false;
+  }
+
+  return true;
+}
+
+std::string jm::jmzb_cache_path(const char* source_path) {
+  std::string dir;
+  const char* xdg_cache = getenv("XDG_CACHE_HOME");
+  if (xdg_cache != NULL && xdg_cache[0] != '\0')
+    dir = xdg_cache;
+  else {
+    const char* home = getenv("HOME");
+    if (home == NULL)
+      return "";
+    dir = home;
+    dir += "/.cache";
+  }
+  mkdir(dir.c_str(), 0755);
+  dir += "/jmage-sampler";
+  mkdir(dir.c_str(), 0755);
+
+  std::ostringstream sout;
+  sout << dir << "/" << std::hex << std::hash<std::string>()(source_path) << ".jmzb";
+  return sout.str();
+}
@@ -0,0 +1,66 @@
+/****************************************************************************
+    Copyright (C) 2017  jmage619
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*****************************************************************************/
+
+#ifndef JMZB_H
+#define JMZB_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "zone.h"
+
+// compiled patch format; a flat zone table, key index and string table
+// that loads with a single read instead of re-parsing sfz/jmz text
+#define JMZB_VERSION 8
+
+namespace jm {
+  // a file the compiled patch was built from; if any of these change
+  // a cached jmzb is stale
+  struct jmzb_dep {
+    std::string path;
+    int64_t mtime;
+    int64_t size;
+  };
+
+  struct jmzb {
+    // rate the frame based zone fields were computed at
+    int sample_rate;
+    bool has_control;
+    float volume;
+    int channel;
+    std::vector<jm::zone> zones;
+    jm::zone_index index;
+    std::vector<jmzb_dep> deps;
+  };
+
+  // deps only need path filled in; mtime and size are taken at write time
+  void write_jmzb(const char* path, const jmzb& patch);
+  // zone wave fields are left unset; caller must attach waves
+  void read_jmzb(const char* path, jmzb* patch);
+  bool jmzb_deps_current(const jmzb& patch);
+  // where text patches are compiled to on first load
+  std::string jmzb_cache_path(const char* source_path);
+  inline bool is_jmzb_path(const char* path) {
+    size_t len = strlen(path);
+    return len >= 5 && !strcmp(path + len - 5, ".jmzb");
+  }
+};
+
+#endif
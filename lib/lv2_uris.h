@@ -35,11 +35,21 @@
 #define JM_SAMPLER__params JM_SAMPLER_URI "#params"
 #define JM_SAMPLER__loadPatch JM_SAMPLER_URI "#loadPatch"
 #define JM_SAMPLER__patchFile JM_SAMPLER_URI "#patchFile"
+#define JM_SAMPLER__part JM_SAMPLER_URI "#part"
+// zone edits from the ui, carried out on the worker
+#define JM_SAMPLER__addZone JM_SAMPLER_URI "#addZone"
+#define JM_SAMPLER__dupZone JM_SAMPLER_URI "#dupZone"
+#define JM_SAMPLER__removeZone JM_SAMPLER_URI "#removeZone"
+#define JM_SAMPLER__updateZone JM_SAMPLER_URI "#updateZone"
+#define JM_SAMPLER__reloadWaves JM_SAMPLER_URI "#reloadWaves"
+#define JM_SAMPLER__index JM_SAMPLER_URI "#index"
+#define JM_SAMPLER__key JM_SAMPLER_URI "#key"
 
 namespace jm {
   struct uris {
     LV2_URID atom_eventTransfer;
     LV2_URID atom_Object;
+    LV2_URID atom_Int;
     LV2_URID atom_String;
     LV2_URID midi_Event;
     LV2_URID bufsize_maxBlockLength;
@@ -48,11 +58,20 @@ namespace jm {
     LV2_URID jm_params;
     LV2_URID jm_loadPatch;
     LV2_URID jm_patchFile;
+    LV2_URID jm_part;
+    LV2_URID jm_addZone;
+    LV2_URID jm_dupZone;
+    LV2_URID jm_removeZone;
+    LV2_URID jm_updateZone;
+    LV2_URID jm_reloadWaves;
+    LV2_URID jm_index;
+    LV2_URID jm_key;
   };
 
   static inline void map_uris(LV2_URID_Map* map, jm::uris* uris) {
     uris->atom_eventTransfer = map->map(map->handle, LV2_ATOM__eventTransfer);
     uris->atom_Object = map->map(map->handle, LV2_ATOM__Object);
+    uris->atom_Int = map->map(map->handle, LV2_ATOM__Int);
     uris->atom_String = map->map(map->handle, LV2_ATOM__String);
     uris->midi_Event = map->map(map->handle, LV2_MIDI__MidiEvent);
     uris->bufsize_maxBlockLength = map->map(map->handle, LV2_BUF_SIZE__maxBlockLength);
@@ -61,6 +80,14 @@ namespace jm {
     uris->jm_params = map->map(map->handle, JM_SAMPLER__params);
     uris->jm_loadPatch = map->map(map->handle, JM_SAMPLER__loadPatch);
     uris->jm_patchFile = map->map(map->handle, JM_SAMPLER__patchFile);
+    uris->jm_part = map->map(map->handle, JM_SAMPLER__part);
+    uris->jm_addZone = map->map(map->handle, JM_SAMPLER__addZone);
+    uris->jm_dupZone = map->map(map->handle, JM_SAMPLER__dupZone);
+    uris->jm_removeZone = map->map(map->handle, JM_SAMPLER__removeZone);
+    uris->jm_updateZone = map->map(map->handle, JM_SAMPLER__updateZone);
+    uris->jm_reloadWaves = map->map(map->handle, JM_SAMPLER__reloadWaves);
+    uris->jm_index = map->map(map->handle, JM_SAMPLER__index);
+    uris->jm_key = map->map(map->handle, JM_SAMPLER__key);
   }
 };
 
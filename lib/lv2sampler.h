@@ -35,21 +35,35 @@
 #include "sfzparser.h"
 #include "jmsampler.h"
 
+// stereo output buses; every bus past the first is optional for the host
+#define LV2_OUTPUTS 4
+
 class LV2Sampler: public JMSampler {
   public:
     const LV2_Atom_Sequence* control_port;
     LV2_Atom_Sequence* notify_port;
-    float* out1;
-    float* out2;
+    // as connected by the host; NULL if left unconnected
+    float* outs[2 * LV2_OUTPUTS];
+    // what run mixes into; unconnected buses fall back to the first
+    float* mix_outs[2 * LV2_OUTPUTS];
     LV2_URID_Map* map;
     jm::uris uris;
     LV2_Worker_Schedule* schedule;
     LV2_Atom_Forge forge;
     LV2_Atom_Forge_Frame seq_frame;
-    char patch_path[256];
+    char patch_path[NUM_PARTS][MAX_PATH];
+    // restored parts run has yet to hand to the worker
+    std::atomic<bool> restore_pending[NUM_PARTS];
 
     LV2Sampler(int sample_rate, size_t in_nframes, size_t out_nframes):
-      JMSampler(sample_rate, in_nframes, out_nframes) {patch_path[0] = '\0';};
+        JMSampler(sample_rate, in_nframes, out_nframes, LV2_OUTPUTS) {
+      for (int i = 0; i < NUM_PARTS; ++i) {
+        patch_path[i][0] = '\0';
+        restore_pending[i] = false;
+      }
+      for (int i = 0; i < 2 * LV2_OUTPUTS; ++i)
+        outs[i] = NULL;
+    }
 };
 
 #endif
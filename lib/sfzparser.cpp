@@ -22,6 +22,8 @@
 #include <vector>
 #include <map>
 #include <cstring>
+#include <cctype>
+#include <climits>
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -29,10 +31,13 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <pthread.h>
 
 #include "zone.h"
 #include "sfzparser.h"
 
+#define MAX_INCLUDE_DEPTH 16
+
 namespace {
   void validate_int(const std::string& op, long val, long min, long max) {
     if (val < min || val > max) {
@@ -41,8 +46,232 @@ namespace {
       throw std::runtime_error(sout.str());
     }
   }
+
+  // a file split into raw tokens; #define and #include lines are kept
+  // as directive tokens so variables can be substituted per instrument
+  struct fragment {
+    std::string path;
+    time_t mtime;
+    off_t size;
+    std::vector<std::string> tokens;
+  };
+
+  // fragments are shared between every patch loaded in this process
+  // so libraries built from common #include files only tokenize them once
+  std::map<std::string, std::shared_ptr<const fragment> > fragment_cache;
+  pthread_mutex_t fragment_lock = PTHREAD_MUTEX_INITIALIZER;
+
+  std::string trim_directive_arg(const std::string& str) {
+    size_t first = str.find_first_not_of(" \t\r");
+    if (first == std::string::npos)
+      return "";
+    size_t last = str.find_last_not_of(" \t\r");
+    std::string arg = str.substr(first, last - first + 1);
+
+    // strip quotes from #include "file"
+    if (arg.length() >= 2 && arg[0] == '"' && arg[arg.length() - 1] == '"')
+      arg = arg.substr(1, arg.length() - 2);
+
+    return arg;
+  }
+
+  void tokenize(std::istream& fin, std::vector<std::string>& tokens) {
+    bool in_block_comment = false;
+    std::string line;
+    while (std::getline(fin, line)) {
+      // strip block comments, which may span lines
+      size_t pos;
+      if (in_block_comment) {
+        if ((pos = line.find("*/")) == std::string::npos)
+          continue;
+        line.erase(0, pos + 2);
+        in_block_comment = false;
+      }
+      while ((pos = line.find("/*")) != std::string::npos) {
+        size_t end = line.find("*/", pos + 2);
+        if (end == std::string::npos) {
+          line.erase(pos);
+          in_block_comment = true;
+          break;
+        }
+        line.erase(pos, end + 2 - pos);
+      }
+
+      // strip comment
+      pos = line.find("//");
+      if (pos != std::string::npos)
+        line.erase(pos);
+
+      // split line by space
+      std::istringstream sin(line);
+      std::string field;
+      while (sin >> field) {
+        // directives consume the rest of the line
+        if (field == "#define") {
+          std::string name;
+          sin >> name;
+          std::string value;
+          std::getline(sin, value);
+          tokens.push_back(field);
+          tokens.push_back(name);
+          tokens.push_back(trim_directive_arg(value));
+          break;
+        }
+        else if (field == "#include") {
+          std::string inc_path;
+          std::getline(sin, inc_path);
+          tokens.push_back(field);
+          tokens.push_back(trim_directive_arg(inc_path));
+          break;
+        }
+
+        tokens.push_back(field);
+      }
+    }
+  }
+
+  std::map<std::string, sfz::opcode> build_opcode_ids() {
+    std::map<std::string, sfz::opcode> ids;
+    for (int op = 0; op < sfz::OP_COUNT; ++op)
+      ids[sfz::opcodes[op].name] = (sfz::opcode) op;
+    return ids;
+  }
+
+  std::shared_ptr<const fragment> load_fragment(const std::string& rel_path) {
+    // key the cache on the canonical path so includes spelled differently still hit
+    char buf[PATH_MAX];
+    struct stat sb;
+    if (realpath(rel_path.c_str(), buf) == NULL || stat(buf, &sb))
+      throw std::runtime_error("unable to access file: " + rel_path);
+
+    std::string path(buf);
+
+    pthread_mutex_lock(&fragment_lock);
+    std::map<std::string, std::shared_ptr<const fragment> >::iterator it = fragment_cache.find(path);
+    if (it != fragment_cache.end() && it->second->mtime == sb.st_mtime && it->second->size == sb.st_size) {
+      std::shared_ptr<const fragment> frag = it->second;
+      pthread_mutex_unlock(&fragment_lock);
+      return frag;
+    }
+    pthread_mutex_unlock(&fragment_lock);
+
+    // tokenize outside the lock; worst case two threads both parse the same
+    // stale file and the last one wins
+    std::ifstream fin(path.c_str());
+    if (!fin)
+      throw std::runtime_error("unable to open file: " + path);
+
+    std::shared_ptr<fragment> frag(new fragment);
+    frag->path = path;
+    frag->mtime = sb.st_mtime;
+    frag->size = sb.st_size;
+    tokenize(fin, frag->tokens);
+    fin.close();
+
+    pthread_mutex_lock(&fragment_lock);
+    fragment_cache[path] = frag;
+    pthread_mutex_unlock(&fragment_lock);
+
+    return frag;
+  }
+};
+
+const sfz::opcode_info sfz::opcodes[OP_COUNT] = {
+  {"sample", TYPE_STRING},
+  {"volume", TYPE_DOUBLE},
+  {"pitch_keycenter", TYPE_INT},
+  {"lokey", TYPE_INT},
+  {"hikey", TYPE_INT},
+  {"key", TYPE_INT},
+  {"lovel", TYPE_INT},
+  {"hivel", TYPE_INT},
+  {"tune", TYPE_INT},
+  {"offset", TYPE_INT},
+  {"loop_start", TYPE_INT},
+  {"loop_end", TYPE_INT},
+  {"loop_mode", TYPE_INT},
+  {"loop_crossfade", TYPE_DOUBLE},
+  {"group", TYPE_INT},
+  {"off_by", TYPE_INT},
+  {"output", TYPE_INT},
+  {"seq_length", TYPE_INT},
+  {"seq_position", TYPE_INT},
+  {"lorand", TYPE_DOUBLE},
+  {"hirand", TYPE_DOUBLE},
+  {"xfin_lovel", TYPE_INT},
+  {"xfin_hivel", TYPE_INT},
+  {"xfout_lovel", TYPE_INT},
+  {"xfout_hivel", TYPE_INT},
+  {"xfin_lokey", TYPE_INT},
+  {"xfin_hikey", TYPE_INT},
+  {"xfout_lokey", TYPE_INT},
+  {"xfout_hikey", TYPE_INT},
+  {"xf_velcurve", TYPE_INT},
+  {"xf_keycurve", TYPE_INT},
+  {"trigger", TYPE_INT},
+  {"rt_decay", TYPE_DOUBLE},
+  {"bend_up", TYPE_INT},
+  {"bend_down", TYPE_INT},
+  {"fil_type", TYPE_INT},
+  {"cutoff", TYPE_DOUBLE},
+  {"resonance", TYPE_DOUBLE},
+  {"fil_veltrack", TYPE_INT},
+  {"fileg_attack", TYPE_DOUBLE},
+  {"fileg_hold", TYPE_DOUBLE},
+  {"fileg_decay", TYPE_DOUBLE},
+  {"fileg_sustain", TYPE_DOUBLE},
+  {"fileg_release", TYPE_DOUBLE},
+  {"fileg_depth", TYPE_INT},
+  {"amplfo_freq", TYPE_DOUBLE},
+  {"amplfo_depth", TYPE_DOUBLE},
+  {"amplfo_depthcc1", TYPE_DOUBLE},
+  {"amplfo_delay", TYPE_DOUBLE},
+  {"pitchlfo_freq", TYPE_DOUBLE},
+  {"pitchlfo_depth", TYPE_DOUBLE},
+  {"pitchlfo_depthcc1", TYPE_DOUBLE},
+  {"pitchlfo_delay", TYPE_DOUBLE},
+  {"fillfo_freq", TYPE_DOUBLE},
+  {"fillfo_depth", TYPE_DOUBLE},
+  {"fillfo_depthcc1", TYPE_DOUBLE},
+  {"fillfo_delay", TYPE_DOUBLE},
+  {"pitcheg_attack", TYPE_DOUBLE},
+  {"pitcheg_hold", TYPE_DOUBLE},
+  {"pitcheg_decay", TYPE_DOUBLE},
+  {"pitcheg_sustain", TYPE_DOUBLE},
+  {"pitcheg_release", TYPE_DOUBLE},
+  {"pitcheg_depth", TYPE_INT},
+  {"pitcheg_vel2depth", TYPE_INT},
+  {"ampeg_attack", TYPE_DOUBLE},
+  {"ampeg_hold", TYPE_DOUBLE},
+  {"ampeg_decay", TYPE_DOUBLE},
+  {"ampeg_sustain", TYPE_DOUBLE},
+  {"ampeg_release", TYPE_DOUBLE},
+  {"jm_name", TYPE_STRING},
+  {"jm_mute", TYPE_INT},
+  {"jm_solo", TYPE_INT}
 };
 
+sfz::opcode sfz::lookup_opcode(const std::string& name) {
+  // built once on first use
+  static const std::map<std::string, opcode> ids = build_opcode_ids();
+
+  std::map<std::string, opcode>::const_iterator it = ids.find(name);
+  if (it == ids.end())
+    return OP_UNKNOWN;
+  return it->second;
+}
+
+int sfz::sfz::add_string(const std::string& str) {
+  std::map<std::string, int>::iterator it = string_ids.find(str);
+  if (it != string_ids.end())
+    return it->second;
+
+  int id = strings.size();
+  strings.push_back(str);
+  string_ids[str] = id;
+  return id;
+}
+
 void sfz::write(const sfz* s, std::ostream& out) {
   out << "<control>";
 
@@ -55,20 +284,45 @@ void sfz::write(const sfz* s, std::ostream& out) {
 
   out << std::endl;
 
-  std::vector<std::map<std::string, SFZValue> >::const_iterator v_it;
-  for (v_it = s->regions.begin(); v_it != s->regions.end(); ++v_it) {
+  std::vector<unknown_opcode>::const_iterator u_it = s->unknown.begin();
+  for (size_t r = 0; r < s->regions.size(); ++r) {
+    const region& reg = s->regions[r];
     out << "<region>";
-    for (it = v_it->begin(); it != v_it->end(); ++it) {
-      out << " " << it->first << "=";
+    for (int op = 0; op < OP_COUNT; ++op) {
+      if (!reg.has((opcode) op))
+        continue;
+
+      out << " " << opcodes[op].name << "=";
       // for sample need to strip abs path dir; assumption
       // is users will save sfz into same dir as wave files
-      if (it->first == "sample") {
-        char tmp_str[256];
-        strcpy(tmp_str, it->second.get_str().c_str());
-        out << basename(tmp_str);
+      if (op == OP_SAMPLE) {
+        std::string sample = s->get_str(reg, OP_SAMPLE);
+        std::vector<char> tmp_str(sample.begin(), sample.end());
+        tmp_str.push_back('\0');
+        out << basename(&tmp_str[0]);
       }
-      else if (it->first == "loop_mode") {
-        switch (it->second.get_int()) {
+      else if (op == OP_XF_VELCURVE || op == OP_XF_KEYCURVE)
+        out << (reg.values[op].i == jm::XF_GAIN ? "gain": "power");
+      else if (op == OP_FIL_TYPE) {
+        switch (reg.values[op].i) {
+          case jm::FILTER_LPF_2P:
+            out << "lpf_2p";
+            break;
+          case jm::FILTER_HPF_2P:
+            out << "hpf_2p";
+            break;
+          case jm::FILTER_BPF_2P:
+            out << "bpf_2p";
+            break;
+          case jm::FILTER_BRF_2P:
+            out << "brf_2p";
+            break;
+        }
+      }
+      else if (op == OP_TRIGGER)
+        out << (reg.values[op].i == jm::TRIGGER_RELEASE ? "release": "attack");
+      else if (op == OP_LOOP_MODE) {
+        switch (reg.values[op].i) {
           case jm::LOOP_OFF:
             out << "no_loop";
             break;
@@ -81,9 +335,23 @@ void sfz::write(const sfz* s, std::ostream& out) {
         }
       }
       else {
-        it->second.write(out);
+        switch (opcodes[op].type) {
+          case TYPE_STRING:
+            out << s->get_str(reg, (opcode) op);
+            break;
+          case TYPE_INT:
+            out << reg.values[op].i;
+            break;
+          case TYPE_DOUBLE:
+            out << reg.values[op].d;
+            break;
+        }
       }
     }
+
+    for (; u_it != s->unknown.end() && u_it->region == r; ++u_it)
+      out << " " << u_it->opcode << "=" << u_it->value;
+
     out << std::endl;
   }
 }
@@ -103,24 +371,31 @@ void SFZValue::write(std::ostream& out) const {
 }
 
 SFZParser::SFZParser(const std::string& path) {
-  char buf[256];
-  realpath(path.c_str(), buf);
-  this->path = buf;
+  // realpath needs room for PATH_MAX
+  char buf[PATH_MAX];
+  if (realpath(path.c_str(), buf) != NULL)
+    this->path = buf;
+  else
+    this->path = path;
 }
 
 void SFZParser::save_prev() {
+  sfz::opcode op = sfz::lookup_opcode(cur_op);
   switch (state) {
     case CONTROL:
       update_control(*cur_control, cur_op, data);
       break;
     case GLOBAL:
-      update_region(*cur_global, cur_op, data);
+      if (!update_region(*cur_global, op, cur_op, data))
+        global_unknown.push_back(std::make_pair(cur_op, data));
       break;
     case GROUP:
-      update_region(*cur_group, cur_op, data);
+      if (!update_region(*cur_group, op, cur_op, data))
+        group_unknown.push_back(std::make_pair(cur_op, data));
       break;
     case REGION:
-      update_region(*cur_region, cur_op, data);
+      if (!update_region(*cur_region, op, cur_op, data))
+        region_unknown.push_back(std::make_pair(cur_op, data));
       break;
     default:
       break;
@@ -129,179 +404,449 @@ void SFZParser::save_prev() {
   data.erase();
 }
 
-void SFZParser::set_region_defaults(std::map<std::string, SFZValue>& region) {
-  region["volume"] = 0.;
-  region["pitch_keycenter"] = 32;
-  region["lokey"] = 0;
-  region["hikey"] = 127;
-  region["lovel"] = 0;
-  region["hivel"] = 127;
-  region["tune"] = 0;
-  region["offset"] = 0;
+void SFZParser::push_region() {
+  size_t index = cur_sfz->regions.size();
+  cur_sfz->regions.push_back(*cur_region);
+
+  unknown_list::const_iterator it;
+  for (it = region_unknown.begin(); it != region_unknown.end(); ++it) {
+    sfz::unknown_opcode u;
+    u.region = index;
+    u.opcode = it->first;
+    u.value = it->second;
+    cur_sfz->unknown.push_back(u);
+  }
+}
+
+void SFZParser::set_region_defaults(sfz::region& region) {
+  region.present.reset();
+  region.values[sfz::OP_SAMPLE].str = add_string("");
+  region.values[sfz::OP_VOLUME].d = 0.;
+  region.values[sfz::OP_PITCH_KEYCENTER].i = 32;
+  region.values[sfz::OP_LOKEY].i = 0;
+  region.values[sfz::OP_HIKEY].i = 127;
+  region.values[sfz::OP_KEY].i = 0;
+  region.values[sfz::OP_LOVEL].i = 0;
+  region.values[sfz::OP_HIVEL].i = 127;
+  region.values[sfz::OP_TUNE].i = 0;
+  region.values[sfz::OP_OFFSET].i = 0;
   // -1 to say not defined since may be defined in wav
-  region["loop_start"] = -1;
-  region["loop_end"] = -1;
-  region["loop_mode"] = jm::LOOP_UNSET;
-  region["loop_crossfade"] = 0.;
-  region["group"] = 0;
-  region["off_by"] = 0;
-  region["ampeg_attack"] = 0.;
-  region["ampeg_hold"] = 0.;
-  region["ampeg_decay"] = 0.;
-  region["ampeg_sustain"] = 100.;
-  region["ampeg_release"] = 0.;
+  region.values[sfz::OP_LOOP_START].i = -1;
+  region.values[sfz::OP_LOOP_END].i = -1;
+  region.values[sfz::OP_LOOP_MODE].i = jm::LOOP_UNSET;
+  region.values[sfz::OP_LOOP_CROSSFADE].d = 0.;
+  region.values[sfz::OP_GROUP].i = 0;
+  region.values[sfz::OP_OFF_BY].i = 0;
+  region.values[sfz::OP_OUTPUT].i = 0;
+  region.values[sfz::OP_SEQ_LENGTH].i = 1;
+  region.values[sfz::OP_SEQ_POSITION].i = 1;
+  region.values[sfz::OP_LORAND].d = 0.;
+  region.values[sfz::OP_HIRAND].d = 1.;
+  region.values[sfz::OP_XFIN_LOVEL].i = 0;
+  region.values[sfz::OP_XFIN_HIVEL].i = 0;
+  region.values[sfz::OP_XFOUT_LOVEL].i = 127;
+  region.values[sfz::OP_XFOUT_HIVEL].i = 127;
+  region.values[sfz::OP_XFIN_LOKEY].i = 0;
+  region.values[sfz::OP_XFIN_HIKEY].i = 0;
+  region.values[sfz::OP_XFOUT_LOKEY].i = 127;
+  region.values[sfz::OP_XFOUT_HIKEY].i = 127;
+  region.values[sfz::OP_XF_VELCURVE].i = jm::XF_POWER;
+  region.values[sfz::OP_XF_KEYCURVE].i = jm::XF_POWER;
+  region.values[sfz::OP_TRIGGER].i = jm::TRIGGER_ATTACK;
+  region.values[sfz::OP_RT_DECAY].d = 0.;
+  region.values[sfz::OP_BEND_UP].i = 200;
+  region.values[sfz::OP_BEND_DOWN].i = -200;
+  region.values[sfz::OP_FIL_TYPE].i = jm::FILTER_LPF_2P;
+  region.values[sfz::OP_CUTOFF].d = 0.;
+  region.values[sfz::OP_RESONANCE].d = 0.;
+  region.values[sfz::OP_FIL_VELTRACK].i = 0;
+  region.values[sfz::OP_FILEG_ATTACK].d = 0.;
+  region.values[sfz::OP_FILEG_HOLD].d = 0.;
+  region.values[sfz::OP_FILEG_DECAY].d = 0.;
+  region.values[sfz::OP_FILEG_SUSTAIN].d = 100.;
+  region.values[sfz::OP_FILEG_RELEASE].d = 0.;
+  region.values[sfz::OP_FILEG_DEPTH].i = 0;
+  region.values[sfz::OP_AMPLFO_FREQ].d = 0.;
+  region.values[sfz::OP_AMPLFO_DEPTH].d = 0.;
+  region.values[sfz::OP_AMPLFO_DEPTHCC1].d = 0.;
+  region.values[sfz::OP_AMPLFO_DELAY].d = 0.;
+  region.values[sfz::OP_PITCHLFO_FREQ].d = 0.;
+  region.values[sfz::OP_PITCHLFO_DEPTH].d = 0.;
+  region.values[sfz::OP_PITCHLFO_DEPTHCC1].d = 0.;
+  region.values[sfz::OP_PITCHLFO_DELAY].d = 0.;
+  region.values[sfz::OP_FILLFO_FREQ].d = 0.;
+  region.values[sfz::OP_FILLFO_DEPTH].d = 0.;
+  region.values[sfz::OP_FILLFO_DEPTHCC1].d = 0.;
+  region.values[sfz::OP_FILLFO_DELAY].d = 0.;
+  region.values[sfz::OP_PITCHEG_ATTACK].d = 0.;
+  region.values[sfz::OP_PITCHEG_HOLD].d = 0.;
+  region.values[sfz::OP_PITCHEG_DECAY].d = 0.;
+  region.values[sfz::OP_PITCHEG_SUSTAIN].d = 100.;
+  region.values[sfz::OP_PITCHEG_RELEASE].d = 0.;
+  region.values[sfz::OP_PITCHEG_DEPTH].i = 0;
+  region.values[sfz::OP_PITCHEG_VEL2DEPTH].i = 0;
+  region.values[sfz::OP_AMPEG_ATTACK].d = 0.;
+  region.values[sfz::OP_AMPEG_HOLD].d = 0.;
+  region.values[sfz::OP_AMPEG_DECAY].d = 0.;
+  region.values[sfz::OP_AMPEG_SUSTAIN].d = 100.;
+  region.values[sfz::OP_AMPEG_RELEASE].d = 0.;
+  region.values[sfz::OP_JM_NAME].str = region.values[sfz::OP_SAMPLE].str;
+  region.values[sfz::OP_JM_MUTE].i = 0;
+  region.values[sfz::OP_JM_SOLO].i = 0;
 }
 
 // missing some validation checks here
-void SFZParser::update_region(std::map<std::string, SFZValue>& region, const std::string& field, const std::string& data) {
-  // generic double
-  if (field == "volume" || field == "loop_crossfade" || field == "ampeg_attack" ||
-      field == "ampeg_hold" || field == "ampeg_decay" || field == "ampeg_sustain" ||
-      field == "ampeg_release")
-    region[field] = strtod(data.c_str(), NULL);
-  // int range 0-127
-  else if (field == "pitch_keycenter" || field == "lokey" || field == "hikey" ||
-      field == "lovel" || field == "hivel" || field == "key") {
-    long val = strtol(data.c_str(), NULL, 10);
-    validate_int(field, val, 0, 127);
-    if (field == "key") {
-      region["pitch_keycenter"] = (int) val;
-      region["lokey"] = (int) val;
-      region["hikey"] = (int) val;
+bool SFZParser::update_region(sfz::region& region, sfz::opcode op, const std::string& field, const std::string& data) {
+  switch (op) {
+    // generic double
+    case sfz::OP_VOLUME:
+    case sfz::OP_LOOP_CROSSFADE:
+    case sfz::OP_AMPEG_ATTACK:
+    case sfz::OP_AMPEG_HOLD:
+    case sfz::OP_AMPEG_DECAY:
+    case sfz::OP_AMPEG_SUSTAIN:
+    case sfz::OP_AMPEG_RELEASE:
+    case sfz::OP_FILEG_ATTACK:
+    case sfz::OP_FILEG_HOLD:
+    case sfz::OP_FILEG_DECAY:
+    case sfz::OP_FILEG_SUSTAIN:
+    case sfz::OP_FILEG_RELEASE:
+    case sfz::OP_AMPLFO_DELAY:
+    case sfz::OP_PITCHLFO_DELAY:
+    case sfz::OP_FILLFO_DELAY:
+    case sfz::OP_PITCHEG_ATTACK:
+    case sfz::OP_PITCHEG_HOLD:
+    case sfz::OP_PITCHEG_DECAY:
+    case sfz::OP_PITCHEG_SUSTAIN:
+    case sfz::OP_PITCHEG_RELEASE:
+    case sfz::OP_AMPLFO_FREQ:
+    case sfz::OP_AMPLFO_DEPTH:
+    case sfz::OP_AMPLFO_DEPTHCC1:
+    case sfz::OP_PITCHLFO_FREQ:
+    case sfz::OP_PITCHLFO_DEPTH:
+    case sfz::OP_PITCHLFO_DEPTHCC1:
+    case sfz::OP_FILLFO_FREQ:
+    case sfz::OP_FILLFO_DEPTH:
+    case sfz::OP_FILLFO_DEPTHCC1:
+      region.set_double(op, strtod(data.c_str(), NULL));
+      break;
+    // int range 0-127
+    case sfz::OP_PITCH_KEYCENTER:
+    case sfz::OP_LOKEY:
+    case sfz::OP_HIKEY:
+    case sfz::OP_LOVEL:
+    case sfz::OP_HIVEL:
+    case sfz::OP_XFIN_LOVEL:
+    case sfz::OP_XFIN_HIVEL:
+    case sfz::OP_XFOUT_LOVEL:
+    case sfz::OP_XFOUT_HIVEL:
+    case sfz::OP_XFIN_LOKEY:
+    case sfz::OP_XFIN_HIKEY:
+    case sfz::OP_XFOUT_LOKEY:
+    case sfz::OP_XFOUT_HIKEY:
+    case sfz::OP_KEY: {
+      long val = strtol(data.c_str(), NULL, 10);
+      validate_int(field, val, 0, 127);
+      if (op == sfz::OP_KEY) {
+        region.set_int(sfz::OP_PITCH_KEYCENTER, val);
+        region.set_int(sfz::OP_LOKEY, val);
+        region.set_int(sfz::OP_HIKEY, val);
+      }
+      else
+        region.set_int(op, val);
+      break;
     }
-    else
-      region[field] = (int) val;
-  }
-  // int range -100-100
-  else if (field == "tune") {
-    long val = strtol(data.c_str(), NULL, 10);
-    validate_int(field, val, -100, 100);
-    region[field] = (int) val;
+    // int range 1-100
+    case sfz::OP_SEQ_LENGTH:
+    case sfz::OP_SEQ_POSITION: {
+      long val = strtol(data.c_str(), NULL, 10);
+      validate_int(field, val, 1, 100);
+      region.set_int(op, val);
+      break;
+    }
+    // double range 0-1
+    case sfz::OP_LORAND:
+    case sfz::OP_HIRAND: {
+      double val = strtod(data.c_str(), NULL);
+      if (val < 0. || val > 1.)
+        throw std::runtime_error(field + " must be between 0 and 1: " + data);
+      region.set_double(op, val);
+      break;
+    }
+    // db per second, range 0-200
+    case sfz::OP_RT_DECAY: {
+      double val = strtod(data.c_str(), NULL);
+      if (val < 0. || val > 200.)
+        throw std::runtime_error(field + " must be between 0 and 200: " + data);
+      region.set_double(op, val);
+      break;
+    }
+    // hz, range 0-sample rate is checked at play time
+    case sfz::OP_CUTOFF: {
+      double val = strtod(data.c_str(), NULL);
+      if (val < 0.)
+        throw std::runtime_error(field + " must not be negative: " + data);
+      region.set_double(op, val);
+      break;
+    }
+    // db, range 0-40
+    case sfz::OP_RESONANCE: {
+      double val = strtod(data.c_str(), NULL);
+      if (val < 0. || val > 40.)
+        throw std::runtime_error(field + " must be between 0 and 40: " + data);
+      region.set_double(op, val);
+      break;
+    }
+    // cents, range -12000-12000
+    case sfz::OP_PITCHEG_DEPTH:
+    case sfz::OP_PITCHEG_VEL2DEPTH:
+    case sfz::OP_FILEG_DEPTH: {
+      long val = strtol(data.c_str(), NULL, 10);
+      validate_int(field, val, -12000, 12000);
+      region.set_int(op, val);
+      break;
+    }
+    // cents, range -9600-9600
+    case sfz::OP_FIL_VELTRACK:
+    case sfz::OP_BEND_UP:
+    case sfz::OP_BEND_DOWN: {
+      long val = strtol(data.c_str(), NULL, 10);
+      validate_int(field, val, -9600, 9600);
+      region.set_int(op, val);
+      break;
+    }
+    // output bus
+    case sfz::OP_OUTPUT: {
+      long val = strtol(data.c_str(), NULL, 10);
+      validate_int(field, val, 0, MAX_OUTPUTS - 1);
+      region.set_int(op, val);
+      break;
+    }
+    // int range -100-100
+    case sfz::OP_TUNE: {
+      long val = strtol(data.c_str(), NULL, 10);
+      validate_int(field, val, -100, 100);
+      region.set_int(op, val);
+      break;
+    }
+    // generic int
+    case sfz::OP_OFFSET:
+    case sfz::OP_LOOP_START:
+    case sfz::OP_LOOP_END:
+    case sfz::OP_GROUP:
+    case sfz::OP_OFF_BY:
+      region.set_int(op, strtol(data.c_str(), NULL, 10));
+      break;
+    // crossfade curve
+    case sfz::OP_XF_VELCURVE:
+    case sfz::OP_XF_KEYCURVE:
+      if (data == "power")
+        region.set_int(op, jm::XF_POWER);
+      else if (data == "gain")
+        region.set_int(op, jm::XF_GAIN);
+      else
+        throw std::runtime_error(field + " must be \"power\" or \"gain\"");
+      break;
+    // filter type; one pole types play as their two pole counterpart
+    case sfz::OP_FIL_TYPE:
+      if (data == "lpf_2p" || data == "lpf_1p")
+        region.set_int(op, jm::FILTER_LPF_2P);
+      else if (data == "hpf_2p" || data == "hpf_1p")
+        region.set_int(op, jm::FILTER_HPF_2P);
+      else if (data == "bpf_2p")
+        region.set_int(op, jm::FILTER_BPF_2P);
+      else if (data == "brf_2p")
+        region.set_int(op, jm::FILTER_BRF_2P);
+      else
+        throw std::runtime_error("fil_type must be \"lpf_1p\", \"hpf_1p\", \"lpf_2p\", \"hpf_2p\", \"bpf_2p\", or \"brf_2p\"");
+      break;
+    // trigger; first and legato have no mono mode to tell them apart here so they play as attack
+    case sfz::OP_TRIGGER:
+      if (data == "attack" || data == "first" || data == "legato")
+        region.set_int(op, jm::TRIGGER_ATTACK);
+      else if (data == "release")
+        region.set_int(op, jm::TRIGGER_RELEASE);
+      else
+        throw std::runtime_error("trigger must be \"attack\", \"release\", \"first\", or \"legato\"");
+      break;
+    // loop mode
+    case sfz::OP_LOOP_MODE:
+      if (data == "no_loop")
+        region.set_int(op, jm::LOOP_OFF);
+      else if (data == "loop_continuous")
+        region.set_int(op, jm::LOOP_CONTINUOUS);
+      else if (data == "one_shot")
+        region.set_int(op, jm::LOOP_ONE_SHOT);
+      else
+        throw std::runtime_error("loop_mode must be \"no_loop\", \"loop_continuous\", or \"one_shot\"");
+      break;
+    // sample path
+    case sfz::OP_SAMPLE: {
+      struct stat sb;
+      std::string sample_path(dir_path);
+      sample_path += data;
+
+      // bail if stat fails or if you don't own file and others not allowed to read
+      if (stat(sample_path.c_str(), &sb) || (sb.st_uid != getuid() && !(sb.st_mode & S_IROTH)))
+        throw std::runtime_error("unable to access file: " + sample_path);
+
+      if (!S_ISREG(sb.st_mode))
+        throw std::runtime_error("not regular file: " + sample_path);
+
+      region.set_str(op, add_string(sample_path));
+      break;
+    }
+    // don't know what it is; caller keeps it in the unknown table
+    default:
+      return false;
   }
-  // generic int
-  else if (field == "offset" || field == "loop_start" || field == "loop_end" ||
-      field == "group" || field == "off_by")
-    region[field] = (int) strtol(data.c_str(), NULL, 10);
-  // loop mode
-  else if (field == "loop_mode") {
-    if (data == "no_loop")
-      region[field] = jm::LOOP_OFF;
-    else if (data == "loop_continuous")
-      region[field] = jm::LOOP_CONTINUOUS;
-    else if (data == "one_shot")
-      region[field] = jm::LOOP_ONE_SHOT;
+
+  return true;
+}
+
+std::string SFZParser::substitute(const std::string& token) {
+  if (defines.empty() || token.find('$') == std::string::npos)
+    return token;
+
+  std::string result;
+  size_t pos = 0;
+  size_t dollar;
+  while ((dollar = token.find('$', pos)) != std::string::npos) {
+    result.append(token, pos, dollar - pos);
+
+    // variable names are $ followed by alnum or _
+    size_t end = dollar + 1;
+    while (end < token.length() && (isalnum(token[end]) || token[end] == '_'))
+      ++end;
+
+    std::map<std::string, std::string>::const_iterator it = defines.find(token.substr(dollar, end - dollar));
+    if (it != defines.end())
+      result += it->second;
     else
-      throw std::runtime_error("loop_mode must be \"no_loop\", \"loop_continuous\", or \"one_shot\"");
+      result.append(token, dollar, end - dollar);
+
+    pos = end;
   }
-  // sample path
-  else if (field == "sample") {
-    struct stat sb;
-    std::string sample_path(dir_path);
-    sample_path += data;
+  result.append(token, pos, std::string::npos);
+
+  return result;
+}
 
-    // bail if stat fails or if you don't own file and others not allowed to read
-    if (stat(sample_path.c_str(), &sb) || (sb.st_uid != getuid() && !(sb.st_mode & S_IROTH)))
-      throw std::runtime_error("unable to access file: " + sample_path);
+void SFZParser::expand(const std::string& path, int depth) {
+  if (depth > MAX_INCLUDE_DEPTH)
+    throw std::runtime_error("#include nested too deep: " + path);
 
-    if (!S_ISREG(sb.st_mode))
-      throw std::runtime_error("not regular file: " + sample_path);
+  // hold a ref so the cache can replace it under us
+  std::shared_ptr<const fragment> frag = load_fragment(path);
+  cur_sfz->files.push_back(frag->path);
+  const std::vector<std::string>& tokens = frag->tokens;
 
-    region[field] = sample_path.c_str();
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    if (tokens[i] == "#define" && i + 2 < tokens.size()) {
+      defines[tokens[i + 1]] = substitute(tokens[i + 2]);
+      i += 2;
+    }
+    else if (tokens[i] == "#include" && i + 1 < tokens.size()) {
+      // includes are relative to the top level patch, not the including file
+      expand(dir_path + substitute(tokens[i + 1]), depth + 1);
+      i += 1;
+    }
+    else {
+      std::string field = substitute(tokens[i]);
+      // a define with no value leaves nothing behind
+      if (!field.empty())
+        handle_token(field);
+    }
   }
-  // don't know what it is; just pass through as string
+}
+
+void SFZParser::handle_token(const std::string& field) {
+  size_t pos;
+  // either a new tag
+  if (field[0] == '<' && field[field.length() - 1] == '>') {
+    if (data.length() > 0) {
+      save_prev();
+      if (state == REGION)
+        push_region();
+      else if (state == CONTROL)
+        cur_sfz->control = *cur_control;
+    }
+    if (field == "<control>") {
+      // reset cur_control
+      *cur_control = std::map<std::string, SFZValue>();
+      set_control_defaults(*cur_control);
+      state = CONTROL;
+    }
+    else if (field == "<global>") {
+      // reset cur_global
+      set_region_defaults(*cur_global);
+      global_unknown.clear();
+      state = GLOBAL;
+    }
+    else if (field == "<group>") {
+      // reset cur_group
+      *cur_group = *cur_global;
+      group_unknown = global_unknown;
+      state = GROUP;
+    }
+    else if (field == "<region>") {
+      // reset cur_region
+      *cur_region = *cur_group;
+      region_unknown = group_unknown;
+      state = REGION;
+    }
+  }
+  // or new op code
+  else if ((pos = field.find('=')) != std::string::npos) {
+    if (data.length() > 0)
+      save_prev();
+
+    cur_op = field.substr(0, pos);
+    data += field.substr(pos + 1);
+  }
+  // or continuing space separated data for prev op code
   else {
-    region[field] = data.c_str();
+    data += " ";
+    data += field;
   }
 }
 
 sfz::sfz SFZParser::parse() {
-  char tmp_str[256];
-  strcpy(tmp_str, path.c_str());
-  dir_path += dirname(tmp_str);
+  // dirname may modify its argument, and the path can be any length
+  std::vector<char> tmp_str(path.begin(), path.end());
+  tmp_str.push_back('\0');
+  dir_path += dirname(&tmp_str[0]);
   dir_path += "/";
 
-  std::ifstream fin(path.c_str());
   sfz::sfz s;
+  cur_sfz = &s;
   std::map<std::string, SFZValue> cur_control;
   set_control_defaults(cur_control);
-  std::map<std::string, SFZValue> cur_global;
+  sfz::region cur_global;
   set_region_defaults(cur_global);
-  std::map<std::string, SFZValue> cur_group = cur_global;
-  std::map<std::string, SFZValue> cur_region = cur_group;
+  sfz::region cur_group = cur_global;
+  sfz::region cur_region = cur_group;
   this->cur_control = &cur_control;
   this->cur_global = &cur_global;
   this->cur_group = &cur_group;
   this->cur_region = &cur_region;
+  global_unknown.clear();
+  group_unknown.clear();
+  region_unknown.clear();
+  state = NONE;
+  defines.clear();
 
-  std::string line;
-  while (std::getline(fin, line)) {
-    // strip comment
-    size_t pos = line.find("//");
-    if (pos != std::string::npos)
-      line.erase(pos);
-
-    // split line by space
-    std::istringstream sin(line);
-    std::string field;
-    while (sin >> field) {
-      // either a new tag
-      if (field[0] == '<' && field[field.length() - 1] == '>') {
-        if (data.length() > 0) {
-          save_prev();
-          if (state == REGION)
-            s.regions.push_back(cur_region);
-          else if (state == CONTROL)
-            s.control = cur_control;
-        }
-        if (field == "<control>") {
-          // reset cur_control
-          cur_control = std::map<std::string, SFZValue>();
-          set_control_defaults(cur_control);
-          state = CONTROL;
-        }
-        else if (field == "<global>") {
-          // reset cur_global
-          cur_global = std::map<std::string, SFZValue>();
-          set_region_defaults(cur_global);
-          state = GLOBAL;
-        }
-        else if (field == "<group>") {
-          // reset cur_group
-          cur_group = cur_global;
-          state = GROUP;
-        }
-        else if (field == "<region>") {
-          // reset cur_region
-          cur_region = cur_group;
-          state = REGION;
-        }
-      }
-      // or new op code
-      else if ((pos = field.find('=')) != std::string::npos) {
-        if (data.length() > 0)
-          save_prev();
+  expand(path, 0);
 
-        cur_op = field.substr(0, pos);
-        data += field.substr(pos + 1);
-      }
-      // or continuing space separated data for prev op code
-      else {
-        data += " ";
-        data += field;
-      }
-    }
-  }
   // save last region or control if data left over
   if (data.length() > 0) {
     save_prev();
     if (state == REGION)
-      s.regions.push_back(cur_region);
+      push_region();
     else if (state == CONTROL)
       s.control = cur_control;
   }
 
-  fin.close();
-
   return s;
 }
 
@@ -311,9 +856,9 @@ void JMZParser::set_control_defaults(std::map<std::string, SFZValue>& control) {
   control["jm_chan"] = 1;
 }
 
-void JMZParser::set_region_defaults(std::map<std::string, SFZValue>& region) {
+void JMZParser::set_region_defaults(sfz::region& region) {
   SFZParser::set_region_defaults(region);
-  region["jm_name"] = "";
+  region.set_str(sfz::OP_JM_NAME, add_string(""));
 }
 
 void JMZParser::update_control(std::map<std::string, SFZValue>& control, const std::string& field, const std::string& data) {
@@ -329,13 +874,17 @@ void JMZParser::update_control(std::map<std::string, SFZValue>& control, const s
     SFZParser::update_control(control, field, data);
 }
 
-void JMZParser::update_region(std::map<std::string, SFZValue>& region, const std::string& field, const std::string& data) {
-  if (field == "jm_name")
-    region["jm_name"] = data.c_str();
-  else if (field == "jm_mute" || field == "jm_solo")
-    region[field] = (int) strtol(data.c_str(), NULL, 10);
-  // don't know what it is; let parent handle it
-  else
-    SFZParser::update_region(region, field, data);
+bool JMZParser::update_region(sfz::region& region, sfz::opcode op, const std::string& field, const std::string& data) {
+  switch (op) {
+    case sfz::OP_JM_NAME:
+      region.set_str(op, add_string(data));
+      return true;
+    case sfz::OP_JM_MUTE:
+    case sfz::OP_JM_SOLO:
+      region.set_int(op, strtol(data.c_str(), NULL, 10));
+      return true;
+    // don't know what it is; let parent handle it
+    default:
+      return SFZParser::update_region(region, op, field, data);
+  }
 }
-
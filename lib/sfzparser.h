@@ -23,15 +23,146 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <bitset>
 #include <iostream>
 #include <stdexcept>
+#include <memory>
 
 class SFZValue;
 
 namespace sfz {
+  // interned ids for every opcode the sampler understands
+  // anything else lands in sfz::unknown
+  enum opcode {
+    OP_UNKNOWN = -1,
+    OP_SAMPLE,
+    OP_VOLUME,
+    OP_PITCH_KEYCENTER,
+    OP_LOKEY,
+    OP_HIKEY,
+    OP_KEY, // sets lokey, hikey and pitch_keycenter; never stored
+    OP_LOVEL,
+    OP_HIVEL,
+    OP_TUNE,
+    OP_OFFSET,
+    OP_LOOP_START,
+    OP_LOOP_END,
+    OP_LOOP_MODE,
+    OP_LOOP_CROSSFADE,
+    OP_GROUP,
+    OP_OFF_BY,
+    OP_OUTPUT,
+    OP_SEQ_LENGTH,
+    OP_SEQ_POSITION,
+    OP_LORAND,
+    OP_HIRAND,
+    OP_XFIN_LOVEL,
+    OP_XFIN_HIVEL,
+    OP_XFOUT_LOVEL,
+    OP_XFOUT_HIVEL,
+    OP_XFIN_LOKEY,
+    OP_XFIN_HIKEY,
+    OP_XFOUT_LOKEY,
+    OP_XFOUT_HIKEY,
+    OP_XF_VELCURVE,
+    OP_XF_KEYCURVE,
+    OP_TRIGGER,
+    OP_RT_DECAY,
+    OP_BEND_UP,
+    OP_BEND_DOWN,
+    OP_FIL_TYPE,
+    OP_CUTOFF,
+    OP_RESONANCE,
+    OP_FIL_VELTRACK,
+    OP_FILEG_ATTACK,
+    OP_FILEG_HOLD,
+    OP_FILEG_DECAY,
+    OP_FILEG_SUSTAIN,
+    OP_FILEG_RELEASE,
+    OP_FILEG_DEPTH,
+    OP_AMPLFO_FREQ,
+    OP_AMPLFO_DEPTH,
+    OP_AMPLFO_DEPTHCC1,
+    OP_AMPLFO_DELAY,
+    OP_PITCHLFO_FREQ,
+    OP_PITCHLFO_DEPTH,
+    OP_PITCHLFO_DEPTHCC1,
+    OP_PITCHLFO_DELAY,
+    OP_FILLFO_FREQ,
+    OP_FILLFO_DEPTH,
+    OP_FILLFO_DEPTHCC1,
+    OP_FILLFO_DELAY,
+    OP_PITCHEG_ATTACK,
+    OP_PITCHEG_HOLD,
+    OP_PITCHEG_DECAY,
+    OP_PITCHEG_SUSTAIN,
+    OP_PITCHEG_RELEASE,
+    OP_PITCHEG_DEPTH,
+    OP_PITCHEG_VEL2DEPTH,
+    OP_AMPEG_ATTACK,
+    OP_AMPEG_HOLD,
+    OP_AMPEG_DECAY,
+    OP_AMPEG_SUSTAIN,
+    OP_AMPEG_RELEASE,
+    // jmz extensions
+    OP_JM_NAME,
+    OP_JM_MUTE,
+    OP_JM_SOLO,
+    OP_COUNT
+  };
+
+  enum value_type {
+    TYPE_STRING,
+    TYPE_INT,
+    TYPE_DOUBLE
+  };
+
+  struct opcode_info {
+    const char* name;
+    value_type type;
+  };
+
+  extern const opcode_info opcodes[OP_COUNT];
+  opcode lookup_opcode(const std::string& name);
+
+  union value {
+    int i;
+    double d;
+    // index into sfz::strings
+    int str;
+  };
+
+  // fixed size typed record; region.values[OP_LOKEY].i etc.
+  struct region {
+    value values[OP_COUNT];
+    // which opcodes were explicitly given; only these are written out
+    std::bitset<OP_COUNT> present;
+
+    bool has(opcode op) const {return present.test(op);}
+    void set_int(opcode op, int i) {values[op].i = i; present.set(op);}
+    void set_double(opcode op, double d) {values[op].d = d; present.set(op);}
+    void set_str(opcode op, int str) {values[op].str = str; present.set(op);}
+  };
+
+  struct unknown_opcode {
+    size_t region;
+    std::string opcode;
+    std::string value;
+  };
+
   struct sfz {
     std::map<std::string, SFZValue> control;
-    std::vector<std::map<std::string, SFZValue> > regions;
+    std::vector<region> regions;
+    // string valued opcodes, interned
+    std::vector<std::string> strings;
+    std::map<std::string, int> string_ids;
+    // side table of opcodes we don't understand, ordered by region
+    std::vector<unknown_opcode> unknown;
+    // every file read, including #includes
+    std::vector<std::string> files;
+
+    int add_string(const std::string& str);
+    const std::string& get_str(const region& r, opcode op) const {return strings[r.values[op].str];}
   };
 
   void write(const sfz* s, std::ostream& out);
@@ -63,28 +194,44 @@ class SFZValue {
 class SFZParser {
   private:
     enum State {
+      NONE,
       CONTROL,
       GLOBAL,
       GROUP,
       REGION
     } state;
 
+    typedef std::vector<std::pair<std::string, std::string> > unknown_list;
+
     std::string data;
     std::string cur_op;
     std::map<std::string, SFZValue>* cur_control;
-    std::map<std::string, SFZValue>* cur_global;
-    std::map<std::string, SFZValue>* cur_group;
-    std::map<std::string, SFZValue>* cur_region;
+    sfz::region* cur_global;
+    sfz::region* cur_group;
+    sfz::region* cur_region;
+    // unknown opcodes of each open header, inherited like everything else
+    unknown_list global_unknown;
+    unknown_list group_unknown;
+    unknown_list region_unknown;
     std::string path;
     std::string dir_path;
+    // #define'd variables; live for the whole parse including all #includes
+    std::map<std::string, std::string> defines;
+    sfz::sfz* cur_sfz;
 
     void save_prev();
+    void push_region();
+    std::string substitute(const std::string& token);
+    void expand(const std::string& path, int depth);
+    void handle_token(const std::string& field);
 
   protected:
+    int add_string(const std::string& str) {return cur_sfz->add_string(str);}
     virtual void set_control_defaults(std::map<std::string, SFZValue>& /*control*/) {}
-    virtual void set_region_defaults(std::map<std::string, SFZValue>& region);
+    virtual void set_region_defaults(sfz::region& region);
     virtual void update_control(std::map<std::string, SFZValue>& /*control*/, const std::string& /*field*/, const std::string& /*data*/) {}
-    virtual void update_region(std::map<std::string, SFZValue>& region, const std::string& field, const std::string& data);
+    // return false if op is not handled so it's kept as unknown
+    virtual bool update_region(sfz::region& region, sfz::opcode op, const std::string& field, const std::string& data);
   public:
     SFZParser(const std::string& path);
     virtual ~SFZParser(){}
@@ -94,9 +241,9 @@ class SFZParser {
 class JMZParser: public SFZParser {
   protected:
     virtual void set_control_defaults(std::map<std::string, SFZValue>& control);
-    virtual void set_region_defaults(std::map<std::string, SFZValue>& region);
+    virtual void set_region_defaults(sfz::region& region);
     virtual void update_control(std::map<std::string, SFZValue>& control, const std::string& field, const std::string& data);
-    virtual void update_region(std::map<std::string, SFZValue>& region, const std::string& field, const std::string& data);
+    virtual bool update_region(sfz::region& region, sfz::opcode op, const std::string& field, const std::string& data);
   public:
     JMZParser(const std::string& path): SFZParser(path) {}
 };
@@ -0,0 +1,251 @@
+/****************************************************************************
+    Copyright (C) 2017  jmage619
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*****************************************************************************/
+
+#ifndef UIMSG_H
+#define UIMSG_H
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "zone.h"
+
+// engine <-> ui protocol. every message is a header of type and body length
+// followed by the body; ints and floats go as they are in memory since both
+// ends run on the same machine, strings as a length and their bytes.
+// any number of messages may go out in one write
+namespace jm {
+  enum msg_type {
+    // engine to ui
+    MSG_SAMPLE_RATE,
+    // the whole zone table of the edited part, replacing what the ui shows
+    MSG_ZONES,
+    MSG_ADD_ZONE,
+    MSG_UPDATE_WAVE,
+    MSG_LOAD_PROGRESS,
+    MSG_UPDATE_PART,
+    // either way
+    MSG_UPDATE_VOL,
+    MSG_UPDATE_CHAN,
+    MSG_REMOVE_ZONE,
+    // ui to engine
+    MSG_SELECT_PART,
+    MSG_UPDATE_POLY,
+    MSG_NEW_ZONE,
+    MSG_DUP_ZONE,
+    MSG_UPDATE_ZONE,
+    MSG_LOAD_PATCH,
+    MSG_SAVE_PATCH,
+    MSG_REFRESH,
+    // engine to ui, a few times a second: callback load, voices and the
+    // cpu governor's cap, see JMSampler::get_metrics
+    MSG_METRICS
+  };
+
+  struct msg_header {
+    uint32_t type;
+    uint32_t length;
+  };
+
+  // far past the biggest zone table; anything longer is a broken stream
+  const uint32_t MSG_MAX_LENGTH = 1 << 24;
+
+  // builds one or more messages back to back
+  class msg_writer {
+    private:
+      std::vector<char> buf;
+      size_t start;
+
+      void put(const void* p, size_t len) {
+        const char* c = static_cast<const char*>(p);
+        buf.insert(buf.end(), c, c + len);
+      }
+
+    public:
+      msg_writer(): start(0) {}
+      void begin(msg_type type) {
+        start = buf.size();
+        msg_header h = {(uint32_t) type, 0};
+        put(&h, sizeof(h));
+      }
+      void put_int(int32_t val) {put(&val, sizeof(val));}
+      void put_float(float val) {put(&val, sizeof(val));}
+      void put_double(double val) {put(&val, sizeof(val));}
+      void put_str(const char* str) {
+        uint32_t len = strlen(str);
+        put(&len, sizeof(len));
+        put(str, len);
+      }
+      // fill in the length of the message begun last
+      void end() {
+        uint32_t len = buf.size() - start - sizeof(msg_header);
+        memcpy(&buf[start] + offsetof(msg_header, length), &len, sizeof(len));
+      }
+      const char* data() const {return buf.empty() ? NULL: &buf[0];}
+      size_t size() const {return buf.size();}
+      void clear() {buf.clear();}
+  };
+
+  // reads the body of one message; running off the end yields zeros and
+  // empty strings and clears ok
+  class msg_reader {
+    private:
+      const char* p;
+      const char* end;
+
+      bool get(void* val, size_t len) {
+        if ((size_t) (end - p) < len) {
+          ok = false;
+          p = end;
+          memset(val, 0, len);
+          return false;
+        }
+        memcpy(val, p, len);
+        p += len;
+        return true;
+      }
+
+    public:
+      bool ok;
+      msg_reader(const char* body, size_t len): p(body), end(body + len), ok(true) {}
+      int32_t get_int() {int32_t val; get(&val, sizeof(val)); return val;}
+      float get_float() {float val; get(&val, sizeof(val)); return val;}
+      double get_double() {double val; get(&val, sizeof(val)); return val;}
+      std::string get_str() {
+        uint32_t len;
+        if (!get(&len, sizeof(len)))
+          return std::string();
+        if ((size_t) (end - p) < len) {
+          ok = false;
+          len = end - p;
+        }
+        std::string str(p, len);
+        p += len;
+        return str;
+      }
+      // truncated to fit size, always terminated
+      void get_str(char* out, size_t size) {
+        std::string str = get_str();
+        size_t len = str.size() < size - 1 ? str.size(): size - 1;
+        memcpy(out, str.data(), len);
+        out[len] = '\0';
+      }
+  };
+
+  // collects bytes as they arrive and hands out whole messages
+  class msg_buffer {
+    private:
+      std::vector<char> buf;
+      size_t offset;
+
+    public:
+      // cleared for good once a header claims more than MSG_MAX_LENGTH
+      bool ok;
+
+      msg_buffer(): offset(0), ok(true) {}
+      void append(const char* data, size_t len) {
+        // consumed bytes are dropped once they are most of the buffer, not per message
+        if (offset > 0 && offset >= buf.size() / 2) {
+          buf.erase(buf.begin(), buf.begin() + offset);
+          offset = 0;
+        }
+        buf.insert(buf.end(), data, data + len);
+      }
+      // false until a whole message is in; body stays valid until the next append
+      bool next(uint32_t* type, const char** body, size_t* len) {
+        msg_header h;
+        if (buf.size() - offset < sizeof(h))
+          return false;
+        memcpy(&h, &buf[offset], sizeof(h));
+        if (h.length > MSG_MAX_LENGTH) {
+          ok = false;
+          return false;
+        }
+        if (buf.size() - offset - sizeof(h) < h.length)
+          return false;
+
+        *type = h.type;
+        *body = &buf[offset] + sizeof(h);
+        *len = h.length;
+        offset += sizeof(h) + h.length;
+        return true;
+      }
+  };
+
+  // what the ui table shows of a zone
+  inline void put_zone(msg_writer* msg, const jm::zone& zone) {
+    msg->put_int(zone.wave_length);
+    msg->put_str(zone.name);
+    msg->put_float(zone.amp);
+    msg->put_int(zone.mute);
+    msg->put_int(zone.solo);
+    msg->put_int(zone.origin);
+    msg->put_int(zone.low_key);
+    msg->put_int(zone.high_key);
+    msg->put_int(zone.low_vel);
+    msg->put_int(zone.high_vel);
+    msg->put_double(zone.pitch_corr);
+    msg->put_int(zone.start);
+    msg->put_int(zone.left);
+    msg->put_int(zone.right);
+    msg->put_int(zone.loop_mode);
+    msg->put_int(zone.crossfade);
+    msg->put_int(zone.group);
+    msg->put_int(zone.off_group);
+    msg->put_int(zone.output);
+    msg->put_int(zone.attack);
+    msg->put_int(zone.hold);
+    msg->put_int(zone.decay);
+    msg->put_float(zone.sustain);
+    msg->put_int(zone.release);
+    msg->put_str(zone.path);
+  }
+
+  inline void get_zone(msg_reader* msg, jm::zone* zone) {
+    zone->wave_length = msg->get_int();
+    msg->get_str(zone->name, MAX_NAME);
+    zone->amp = msg->get_float();
+    zone->mute = msg->get_int();
+    zone->solo = msg->get_int();
+    zone->origin = msg->get_int();
+    zone->low_key = msg->get_int();
+    zone->high_key = msg->get_int();
+    zone->low_vel = msg->get_int();
+    zone->high_vel = msg->get_int();
+    zone->pitch_corr = msg->get_double();
+    zone->start = msg->get_int();
+    zone->left = msg->get_int();
+    zone->right = msg->get_int();
+    zone->loop_mode = (jm::loop_mode) msg->get_int();
+    zone->crossfade = msg->get_int();
+    zone->group = msg->get_int();
+    zone->off_group = msg->get_int();
+    zone->output = msg->get_int();
+    zone->attack = msg->get_int();
+    zone->hold = msg->get_int();
+    zone->decay = msg->get_int();
+    zone->sustain = msg->get_float();
+    zone->release = msg->get_int();
+    msg->get_str(zone->path, MAX_PATH);
+  }
+};
+
+#endif
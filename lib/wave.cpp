@@ -17,6 +17,8 @@
 
 *****************************************************************************/
 
+#include <atomic>
+#include <cmath>
 #include <stdexcept>
 #include <sstream>
 #include <iostream>
@@ -24,10 +26,83 @@ using std::cerr;
 using std::endl;
 
 #include <sndfile.h>
+#include <samplerate.h>
 
 #include "wave.h"
 
-jm::wave jm::parse_wave(const char* path) {
+// halfband lowpass the decimators run; blackman windowed sinc at a quarter of the input rate
+#define MIP_TAPS 31
+
+static struct mip_filter {
+  float h[MIP_TAPS];
+
+  mip_filter() {
+    float sum = 0.f;
+    for (int i = 0; i < MIP_TAPS; ++i) {
+      double x = (i - MIP_TAPS / 2) / 2.;
+      double sinc = x == 0. ? 1.: sin(M_PI * x) / (M_PI * x);
+      double window = .42 - .5 * cos(2. * M_PI * i / (MIP_TAPS - 1)) + .08 * cos(4. * M_PI * i / (MIP_TAPS - 1));
+      h[i] = sinc * window;
+      sum += h[i];
+    }
+    for (int i = 0; i < MIP_TAPS; ++i)
+      h[i] /= sum;
+  }
+} mip_filter;
+
+// filter and drop every other frame of src, length frames long
+static float* decimate(const float* src, int length, int num_channels) {
+  const float* h = mip_filter.h;
+  int out_length = length / 2;
+  float* out = new float[num_channels * out_length];
+  for (int i = 0; i < out_length; ++i) {
+    for (int c = 0; c < num_channels; ++c) {
+      float acc = 0.f;
+      for (int k = 0; k < MIP_TAPS; ++k) {
+        int j = 2 * i + k - MIP_TAPS / 2;
+        if (j >= 0 && j < length)
+          acc += h[k] * src[num_channels * j + c];
+      }
+      out[num_channels * i + c] = acc;
+    }
+  }
+  return out;
+}
+
+// high quality conversion of the whole wave to rate
+static void convert_wave(jm::wave* wav, int rate) {
+  SRC_DATA data;
+  data.src_ratio = rate / (double) wav->sample_rate;
+  data.input_frames = wav->length;
+  data.output_frames = (long) ceil(wav->length * data.src_ratio);
+  data.data_in = wav->wave;
+  float* out = new float[wav->num_channels * data.output_frames];
+  data.data_out = out;
+
+  int error = src_simple(&data, SRC_SINC_BEST_QUALITY, wav->num_channels);
+  if (error) {
+    delete [] out;
+    throw std::runtime_error(std::string("error converting wave: ") + src_strerror(error));
+  }
+
+  delete [] wav->wave;
+  wav->wave = out;
+  wav->length = data.output_frames_gen;
+  wav->sample_rate = rate;
+}
+
+void jm::add_mips(wave* wav, int mips) {
+  // stop once a level gets too short to be worth filtering
+  for (int i = wav->num_mips; i < mips && i < MAX_MIPS && (wav->length >> i) >= 2 * MIP_TAPS; ++i) {
+    const float* src = i == 0 ? wav->wave: wav->mips[i - 1];
+    wav->mips[i] = decimate(src, wav->length >> i, wav->num_channels);
+    // the level is complete before anyone reading the count can see it
+    std::atomic_thread_fence(std::memory_order_release);
+    ++wav->num_mips;
+  }
+}
+
+jm::wave jm::parse_wave(const char* path, int mips, int rate) {
   SF_INFO sf_info;
   sf_info.format = 0;
   SNDFILE* sf_wav = sf_open(path, SFM_READ, &sf_info);
@@ -39,15 +114,30 @@ jm::wave jm::parse_wave(const char* path) {
 
   wave wav;
   wav.length = sf_info.frames;
+  wav.file_length = wav.length;
   wav.num_channels = sf_info.channels;
   wav.sample_rate = sf_info.samplerate;
   
   wav.wave = new float[wav.num_channels * wav.length];
   sf_read_float(sf_wav, wav.wave, wav.num_channels * wav.length);
 
+  if (rate > 0 && rate != wav.sample_rate) {
+    try {
+      convert_wave(&wav, rate);
+    }
+    catch (std::runtime_error&) {
+      delete [] wav.wave;
+      sf_close(sf_wav);
+      throw;
+    }
+  }
+
+  wav.num_mips = 0;
+  add_mips(&wav, mips);
+
   wav.has_loop = 0;
   wav.left = 0;
-  wav.right = wav.length;
+  wav.right = wav.file_length;
 
   SF_INSTRUMENT inst;
   if (sf_command(sf_wav, SFC_GET_INSTRUMENT, &inst, sizeof(inst)) == SF_FALSE) {
@@ -20,19 +20,36 @@
 #ifndef WAVE_H
 #define WAVE_H
 
+#include "zone.h"
+
 namespace jm {
   struct wave {
     float* wave;
+    // decimated copies; see jm::zone
+    float* mips[MAX_MIPS];
+    int num_mips;
     int num_channels;
     int sample_rate;
     int length;
+    // frames in the file; length differs once converted to another rate.
+    // loop points stay in file frames
+    int file_length;
     int left;
     int right;
     int has_loop;
   };
 
-  wave parse_wave(const char* path);
-  inline void free_wave(wave& wav) {delete [] wav.wave;}
+  // converts to rate first unless it is 0, then builds up to mips decimated levels
+  wave parse_wave(const char* path, int mips = 0, int rate = 0);
+  // builds whatever levels below mips wav doesn't have yet. levels are only
+  // appended and counted once complete, so those reading wav meanwhile see
+  // either fewer levels or whole ones; one writer at a time
+  void add_mips(wave* wav, int mips);
+  inline void free_wave(wave& wav) {
+    delete [] wav.wave;
+    for (int i = 0; i < wav.num_mips; ++i)
+      delete [] wav.mips[i];
+  }
 }
 
 #endif
@@ -23,6 +23,7 @@
 #include <vector>
 #include <cstring>
 #include <cstdio>
+#include <cmath>
 
 #define MAX_NAME 32
 #define MAX_PATH 256
@@ -31,6 +32,10 @@
 #define VEL_MIN 0
 #define VEL_MAX 127
 #define ORIGIN_DEFAULT 36
+// stereo output buses a zone can be routed to
+#define MAX_OUTPUTS 16
+// pre-decimated copies of a wave, each at half the rate of the one before
+#define MAX_MIPS 4
 
 namespace jm {
   enum zone_params {
@@ -51,6 +56,7 @@ namespace jm {
     ZONE_CROSSFADE,
     ZONE_GROUP,
     ZONE_OFF_GROUP,
+    ZONE_OUTPUT,
     ZONE_ATTACK,
     ZONE_HOLD,
     ZONE_DECAY,
@@ -60,6 +66,25 @@ namespace jm {
     ZONE_PATH
   };
 
+  // shape of xfin/xfout ramps
+  enum xf_curve {
+    XF_POWER,
+    XF_GAIN
+  };
+
+  enum filter_type {
+    FILTER_LPF_2P,
+    FILTER_HPF_2P,
+    FILTER_BPF_2P,
+    FILTER_BRF_2P
+  };
+
+  // what starts a zone's voice
+  enum trigger_mode {
+    TRIGGER_ATTACK,
+    TRIGGER_RELEASE
+  };
+
   enum loop_mode {
     LOOP_UNSET = -1,
     LOOP_OFF,
@@ -67,11 +92,39 @@ namespace jm {
     LOOP_ONE_SHOT
   };
 
+  // delay in frames; depth in db for amp, cents for pitch and filter;
+  // depthcc1 is depth added at full mod wheel
+  struct lfo_params {
+    float freq;
+    float depth;
+    float depthcc1;
+    int delay;
+  };
+
+  // frames except sustain (0-1); depth and vel2depth (added at full velocity) in cents
+  struct eg_params {
+    int attack;
+    int hold;
+    int decay;
+    float sustain;
+    int release;
+    int depth;
+    int vel2depth;
+  };
+
   struct zone {
     float* wave;
+    // mips[i] holds wave at 1 / 2^(i + 1) of its rate and length
+    float* mips[MAX_MIPS];
+    int num_mips;
     int num_channels;
     int sample_rate;
+    // in file frames like every other offset here
     int wave_length;
+    // frames actually in wave, and wave frames per file frame;
+    // they differ from the file when the wave was converted on load
+    int play_length;
+    double frame_scale;
     int start;
     int left;
     int right;
@@ -94,6 +147,50 @@ namespace jm {
     int group;
     int off_group;
     int crossfade;
+    // output bus, 0 based
+    int output;
+    // round robin; plays on hit seq_position (1 based) of every seq_length hits of a key
+    int seq_length;
+    int seq_position;
+    // random layer; plays when the note's random value falls in [lorand, hirand)
+    float lorand;
+    float hirand;
+    // crossfades; gain ramps up from xfin lo to hi and down from xfout lo to hi
+    int xfin_lovel;
+    int xfin_hivel;
+    int xfout_lovel;
+    int xfout_hivel;
+    int xfin_lokey;
+    int xfin_hikey;
+    int xfout_lokey;
+    int xfout_hikey;
+    jm::xf_curve xf_velcurve;
+    jm::xf_curve xf_keycurve;
+    jm::trigger_mode trigger;
+    // release triggered voices lose this many dB per second the key was held
+    float rt_decay;
+    // pitch bend range in cents at full up and full down
+    int bend_up;
+    int bend_down;
+    // filter; off unless cutoff (hz) is above 0
+    jm::filter_type fil_type;
+    float cutoff;
+    // db of peak at cutoff
+    float resonance;
+    // cutoff shift in cents at full velocity
+    int fil_veltrack;
+    // filter envelope; frames except sustain (0-1) and depth (cents)
+    int fileg_attack;
+    int fileg_hold;
+    int fileg_decay;
+    float fileg_sustain;
+    int fileg_release;
+    int fileg_depth;
+    // modulation evaluated at control rate
+    jm::lfo_params amplfo;
+    jm::lfo_params pitchlfo;
+    jm::lfo_params fillfo;
+    jm::eg_params pitcheg;
     // some meta info only used by ui
     char name[MAX_NAME];
     char path[MAX_PATH];
@@ -121,6 +218,54 @@ namespace jm {
     zone->group = 0;
     zone->off_group = 0;
     zone->crossfade = 0;
+    zone->output = 0;
+    zone->seq_length = 1;
+    zone->seq_position = 1;
+    zone->lorand = 0.f;
+    zone->hirand = 1.f;
+    zone->xfin_lovel = VEL_MIN;
+    zone->xfin_hivel = VEL_MIN;
+    zone->xfout_lovel = VEL_MAX;
+    zone->xfout_hivel = VEL_MAX;
+    zone->xfin_lokey = NOTE_MIN;
+    zone->xfin_hikey = NOTE_MIN;
+    zone->xfout_lokey = NOTE_MAX;
+    zone->xfout_hikey = NOTE_MAX;
+    zone->xf_velcurve = XF_POWER;
+    zone->xf_keycurve = XF_POWER;
+    zone->trigger = TRIGGER_ATTACK;
+    zone->rt_decay = 0.f;
+    zone->bend_up = 200;
+    zone->bend_down = -200;
+    zone->fil_type = FILTER_LPF_2P;
+    zone->cutoff = 0.f;
+    zone->resonance = 0.f;
+    zone->fil_veltrack = 0;
+    zone->fileg_attack = 0;
+    zone->fileg_hold = 0;
+    zone->fileg_decay = 0;
+    zone->fileg_sustain = 1.f;
+    zone->fileg_release = 0;
+    zone->fileg_depth = 0;
+    jm::lfo_params lfo = {0.f, 0.f, 0.f, 0};
+    zone->amplfo = lfo;
+    zone->pitchlfo = lfo;
+    zone->fillfo = lfo;
+    jm::eg_params eg = {0, 0, 0, 1.f, 0, 0, 0};
+    zone->pitcheg = eg;
+  }
+
+  // for name and path; truncated to fit max, always terminated
+  inline void copy_str(char* dest, const char* src, size_t max) {
+    strncpy(dest, src, max - 1);
+    dest[max - 1] = '\0';
+  }
+
+  // mip levels worth having for the furthest a zone plays above its origin
+  inline int mip_levels(const jm::zone& zone) {
+    double semis = zone.high_key + zone.pitch_corr - zone.origin + zone.bend_up / 100.;
+    int levels = semis < 12. ? 0: (int) (semis / 12.);
+    return levels > MAX_MIPS ? MAX_MIPS: levels;
   }
 
   inline int zone_contains(const jm::zone* zone, int pitch, int velocity) {
@@ -128,82 +273,83 @@ namespace jm {
       velocity >= zone->low_vel && velocity <= zone->high_vel;
   }
 
-  inline void build_zone_str(char* outstr, const std::vector<jm::zone>& zones, int i) {
-    char* p = outstr;
-    // index
-    sprintf(p, "%i,", i);
-    // wave length
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].wave_length);
-    // name
-    p += strlen(p);
-    sprintf(p, "%s,", zones[i].name);
-    // amp
-    p += strlen(p);
-    sprintf(p, "%f,", zones[i].amp);
-    // mute
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].mute);
-    // solo
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].solo);
-    // origin
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].origin);
-    // low key
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].low_key);
-    // high key
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].high_key);
-    // low vel
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].low_vel);
-    // high vel
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].high_vel);
-    // pitch
-    p += strlen(p);
-    sprintf(p, "%f,", zones[i].pitch_corr);
-    // start
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].start);
-    // left
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].left);
-    // right
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].right);
-    // loop mode
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].loop_mode);
-    // crossfade
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].crossfade);
-    // group
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].group);
-    // off group
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].off_group);
-    // attack
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].attack);
-    // hold
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].hold);
-    // decay
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].decay);
-    // sustain
-    p += strlen(p);
-    sprintf(p, "%f,", zones[i].sustain);
-    // release
-    p += strlen(p);
-    sprintf(p, "%i,", zones[i].release);
-    // path
-    p += strlen(p);
-    sprintf(p, "%s\n", zones[i].path);
+  // seq is how many times the key was hit before, rand_val is drawn once per note in [0, 1)
+  inline int zone_in_layer(const jm::zone* zone, unsigned int seq, float rand_val) {
+    return (zone->seq_length <= 1 || (int) (seq % zone->seq_length) == zone->seq_position - 1) &&
+      rand_val >= zone->lorand && (rand_val < zone->hirand || zone->hirand >= 1.f);
+  }
+
+  // gain of a crossfaded layer at val; 0 outside the layer, 1 between the ramps
+  inline float xf_gain(int val, int in_lo, int in_hi, int out_lo, int out_hi, jm::xf_curve curve) {
+    float gain = 1.f;
+    if (val < in_lo || val > out_hi)
+      return 0.f;
+    if (val < in_hi)
+      gain *= (float) (val - in_lo) / (in_hi - in_lo);
+    if (val > out_lo)
+      gain *= (float) (out_hi - val) / (out_hi - out_lo);
+
+    // equal power keeps the summed level steady across the fade
+    return curve == XF_POWER ? sqrtf(gain): gain;
+  }
+
+  // zones that may sound for each key, in zone order
+  // zones for key k are zones[key_offsets[k]] up to zones[key_offsets[k + 1]]
+  struct zone_index {
+    int key_offsets[NOTE_MAX + 2];
+    std::vector<int> zones;
+    // crossfade gain of zone z at velocity v is vel_gain[z * (VEL_MAX + 1) + v],
+    // and at key k is key_gain[z * (NOTE_MAX + 1) + k]
+    std::vector<float> vel_gain;
+    std::vector<float> key_gain;
+  };
+
+  // so note on only has to look crossfade gains up
+  inline void build_xf_tables(jm::zone_index* index, const std::vector<jm::zone>& zones) {
+    index->vel_gain.resize(zones.size() * (VEL_MAX + 1));
+    index->key_gain.resize(zones.size() * (NOTE_MAX + 1));
+
+    for (size_t i = 0; i < zones.size(); ++i) {
+      const jm::zone& z = zones[i];
+      float* vel_gain = &index->vel_gain[i * (VEL_MAX + 1)];
+      for (int v = VEL_MIN; v <= VEL_MAX; ++v)
+        vel_gain[v] = xf_gain(v, z.xfin_lovel, z.xfin_hivel, z.xfout_lovel, z.xfout_hivel, z.xf_velcurve);
+
+      float* key_gain = &index->key_gain[i * (NOTE_MAX + 1)];
+      for (int k = NOTE_MIN; k <= NOTE_MAX; ++k)
+        key_gain[k] = xf_gain(k, z.xfin_lokey, z.xfin_hikey, z.xfout_lokey, z.xfout_hikey, z.xf_keycurve);
+    }
+  }
+
+  inline void build_zone_index(jm::zone_index* index, const std::vector<jm::zone>& zones) {
+    int counts[NOTE_MAX + 1];
+    memset(counts, 0, sizeof(counts));
+
+    for (size_t i = 0; i < zones.size(); ++i) {
+      int low = zones[i].low_key < NOTE_MIN ? NOTE_MIN: zones[i].low_key;
+      int high = zones[i].high_key > NOTE_MAX ? NOTE_MAX: zones[i].high_key;
+      for (int k = low; k <= high; ++k)
+        ++counts[k];
+    }
+
+    index->key_offsets[0] = 0;
+    for (int k = 0; k <= NOTE_MAX; ++k)
+      index->key_offsets[k + 1] = index->key_offsets[k] + counts[k];
+
+    index->zones.resize(index->key_offsets[NOTE_MAX + 1]);
+
+    // reuse counts as fill position per key
+    for (int k = 0; k <= NOTE_MAX; ++k)
+      counts[k] = index->key_offsets[k];
+
+    for (size_t i = 0; i < zones.size(); ++i) {
+      int low = zones[i].low_key < NOTE_MIN ? NOTE_MIN: zones[i].low_key;
+      int high = zones[i].high_key > NOTE_MAX ? NOTE_MAX: zones[i].high_key;
+      for (int k = low; k <= high; ++k)
+        index->zones[counts[k]++] = i;
+    }
+
+    build_xf_tables(index, zones);
   }
 };
 